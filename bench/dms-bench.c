@@ -0,0 +1,285 @@
+// vim:set et ts=3 sw=3:
+//  _____ _         _____                                 _       
+// |  __ (_)       |  __ \                               | |      
+// | |__) | _ __   | |__) |_ _ _   _ _ __ ___   ___ _ __ | |_ ___ 
+// |  ___/ | '_ \  |  ___/ _` | | | | '_ ` _ \ / _ \ '_ \| __/ __|
+// | |   | | | | | | |  | (_| | |_| | | | | | |  __/ | | | |_\__ \
+// |_|   |_|_| |_| |_|   \__,_|\__, |_| |_| |_|\___|_| |_|\__|___/
+//                              __/ |                             
+//                             |___/                              
+// Copyright (C) 2018 Pin Payments
+// http://pinpayments.com
+// 
+// This software is provided 'as-is', without any express or implied
+// warranty.  In no event will the authors be held liable for any damages
+// arising from the use of this software.
+// 
+// Permission is granted to anyone to use this software for any purpose,
+// including commercial applications, and to alter it and redistribute it
+// freely, subject to the following restrictions:
+// 
+// 1. The origin of this software must not be misrepresented; you must not
+//    claim that you wrote the original software. If you use this software
+//    in a product, an acknowledgment in the product documentation would be
+//    appreciated but is not required.
+// 2. Altered source versions must be plainly marked as such, and must not be
+//    misrepresented as being the original software.
+// 3. This notice may not be removed or altered from any source distribution.
+
+/*
+ * dms-bench - latency and throughput of every dms_crud_* operation
+ * against a DMS endpoint, normally dms-mock. Each operation is run on a
+ * fresh handle the way one cron invocation of dms does, and check-ins
+ * are also run through the fleet path to measure concurrency, and on
+ * one warm handle the way the daemon makes them. Allocations on the
+ * response paths are pinned by tests/dms-alloc-test, not here.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <getopt.h>
+#include <time.h>
+
+#include <curl/curl.h>
+#include <jansson.h>
+
+#include <dms-crud.h>
+#include <dms-fleet.h>
+
+#define CREATE_REQUEST \
+  "{\"name\":\"bench daily ClamAV\", \"interval\":\"daily\", \"tags\":[\"production\", \"anti-virus\"]}"
+
+#define MAX_URL 256
+
+typedef struct {
+   const char* name;
+   const char* mode;
+   double*     samples;
+   size_t      n;
+   size_t      failed;
+   double      elapsed;
+} Result;
+
+static double now(void) {
+
+   struct timespec ts;
+
+   clock_gettime(CLOCK_MONOTONIC, &ts);
+   return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static int compare_double(const void* a, const void* b) {
+
+   double x = *(const double*)a;
+   double y = *(const double*)b;
+
+   return (x > y) - (x < y);
+}
+
+static double percentile(const double* sorted, size_t n, double p) {
+
+   size_t i;
+
+   if (n == 0)
+      return 0;
+   i = (size_t)(p * (n - 1) + 0.5);
+   return sorted[i < n ? i : n - 1];
+}
+
+static void report(Result* r) {
+
+   qsort(r->samples, r->n, sizeof(double), compare_double);
+   printf("%-10s %-7s %6zu %6zu %9.3f %9.3f %10.1f\n", r->name, r->mode, r->n, r->failed,
+          percentile(r->samples, r->n, 0.50) * 1000,
+          percentile(r->samples, r->n, 0.99) * 1000,
+          r->elapsed > 0 ? r->n / r->elapsed : 0);
+}
+
+static int create_one(CURL* curl, char** token) {
+
+   char tok[64];
+
+   if (dms_crud_create_token(curl, "bench:", CREATE_REQUEST, tok, sizeof(tok), NULL))
+      return 1;
+   *token = strdup(tok);
+   return *token == NULL;
+}
+
+typedef enum { OP_CREATE, OP_CHECK_IN, OP_PAUSE, OP_DELETE } Op;
+
+/* one operation per iteration, each on its own handle */
+static void run_single(Op op, const char* name, char** tokens, size_t n) {
+
+   Result r = { name, "single", NULL, 0, 0, 0 };
+   CURL* curl;
+   double start;
+   double t;
+   size_t i;
+   int rc;
+
+   r.samples = calloc(n, sizeof(double));
+   start = now();
+
+   for (i = 0; i < n; i++) {
+      if ((curl = curl_easy_init()) == NULL) {
+         r.failed++;
+         continue;
+      }
+      t = now();
+      switch (op) {
+      case OP_CREATE:
+         rc = create_one(curl, &tokens[i]);
+         break;
+      case OP_CHECK_IN:
+         rc = dms_crud_check_in(curl, tokens[i], NULL);
+         break;
+      case OP_PAUSE:
+         rc = dms_crud_pause(curl, "bench:", tokens[i], NULL);
+         break;
+      case OP_DELETE:
+         rc = dms_crud_delete(curl, "bench:", tokens[i], NULL);
+         break;
+      default:
+         rc = 1;
+      }
+      r.samples[r.n++] = now() - t;
+      if (rc)
+         r.failed++;
+      curl_easy_cleanup(curl);
+   }
+
+   r.elapsed = now() - start;
+   report(&r);
+   free(r.samples);
+}
+
+/* Check-ins one after the other on the same handle, after one to open
+ * the connection. */
+static void run_warm(char** tokens, size_t n) {
+
+   Result r = { "check-in", "warm", NULL, 0, 0, 0 };
+   CURL* curl;
+   double start;
+   double t;
+   size_t i;
+
+   if ((curl = curl_easy_init()) == NULL)
+      return;
+   r.samples = calloc(n, sizeof(double));
+   dms_crud_check_in(curl, tokens[0], NULL);
+
+   start = now();
+   for (i = 0; i < n; i++) {
+      t = now();
+      if (dms_crud_check_in(curl, tokens[i], NULL))
+         r.failed++;
+      r.samples[r.n++] = now() - t;
+   }
+   r.elapsed = now() - start;
+
+   report(&r);
+   free(r.samples);
+   curl_easy_cleanup(curl);
+}
+
+static void run_fleet(char** tokens, size_t n, int concurrency) {
+
+   Result r = { "check-in", "fleet", NULL, 0, 0, 0 };
+   FleetEntry* entries;
+   double start;
+   size_t i;
+
+   entries = calloc(n, sizeof(*entries));
+   r.samples = calloc(n, sizeof(double));
+   for (i = 0; i < n; i++)
+      entries[i].token = tokens[i];
+
+   start = now();
+   r.failed = (size_t)dms_fleet_check_in(entries, n, concurrency, NULL);
+   r.elapsed = now() - start;
+
+   for (i = 0; i < n; i++)
+      r.samples[r.n++] = entries[i].seconds;
+
+   report(&r);
+   free(r.samples);
+   free(entries);
+}
+
+static void usage(void) {
+   fprintf(stderr, "\
+Usage: dms-bench -u URL [OPTIONS]\n\
+Options:\n\
+   -u    base URL of the endpoint, e.g. http://127.0.0.1:8080\n\
+   -n    iterations per operation (default 200)\n\
+   -j    concurrent transfers in fleet mode (default 32)\n\
+");
+}
+
+int main(int argc, char* argv[]) {
+
+   char api_url[MAX_URL];
+   const char* base = NULL;
+   char** tokens;
+   size_t n = 200;
+   size_t i;
+   int concurrency = 32;
+   int c;
+
+   while ((c = getopt(argc, argv, "u:n:j:h")) != -1) {
+      switch (c) {
+      case 'u':
+         base = optarg;
+         break;
+      case 'n':
+         n = strtoul(optarg, NULL, 10);
+         break;
+      case 'j':
+         concurrency = atoi(optarg);
+         break;
+      default:
+         usage();
+         return 1;
+      }
+   }
+
+   if (!base || n == 0) {
+      usage();
+      return 1;
+   }
+
+   if (curl_global_init(CURL_GLOBAL_ALL)) {
+      fprintf(stderr, "CURL global initialization failed\n");
+      return 1;
+   }
+
+   snprintf(api_url, sizeof(api_url), "%s/v1/snitches", base);
+   dms_crud_set_urls(api_url, base);
+
+   tokens = calloc(n, sizeof(*tokens));
+
+   printf("%-10s %-7s %6s %6s %9s %9s %10s\n", "operation", "mode", "n", "failed", "p50 ms", "p99 ms", "ops/s");
+   run_single(OP_CREATE, "create", tokens, n);
+
+   for (i = 0; i < n; i++) {
+      if (!tokens[i]) {
+         fprintf(stderr, "create failed, cannot continue\n");
+         return 1;
+      }
+   }
+
+   run_single(OP_CHECK_IN, "check-in", tokens, n);
+   run_warm(tokens, n);
+   run_fleet(tokens, n, concurrency);
+   run_single(OP_PAUSE, "pause", tokens, n);
+   run_single(OP_DELETE, "delete", tokens, n);
+
+   for (i = 0; i < n; i++)
+      free(tokens[i]);
+   free(tokens);
+
+   curl_global_cleanup();
+   return 0;
+}
@@ -0,0 +1,636 @@
+// vim:set et ts=3 sw=3:
+//  _____ _         _____                                 _       
+// |  __ (_)       |  __ \                               | |      
+// | |__) | _ __   | |__) |_ _ _   _ _ __ ___   ___ _ __ | |_ ___ 
+// |  ___/ | '_ \  |  ___/ _` | | | | '_ ` _ \ / _ \ '_ \| __/ __|
+// | |   | | | | | | |  | (_| | |_| | | | | | |  __/ | | | |_\__ \
+// |_|   |_|_| |_| |_|   \__,_|\__, |_| |_| |_|\___|_| |_|\__|___/
+//                              __/ |                             
+//                             |___/                              
+// Copyright (C) 2018 Pin Payments
+// http://pinpayments.com
+// 
+// This software is provided 'as-is', without any express or implied
+// warranty.  In no event will the authors be held liable for any damages
+// arising from the use of this software.
+// 
+// Permission is granted to anyone to use this software for any purpose,
+// including commercial applications, and to alter it and redistribute it
+// freely, subject to the following restrictions:
+// 
+// 1. The origin of this software must not be misrepresented; you must not
+//    claim that you wrote the original software. If you use this software
+//    in a product, an acknowledgment in the product documentation would be
+//    appreciated but is not required.
+// 2. Altered source versions must be plainly marked as such, and must not be
+//    misrepresented as being the original software.
+// 3. This notice may not be removed or altered from any source distribution.
+
+/*
+ * dms-mock - a local stand-in for the Dead Man's Snitch API and the
+ * nosnch.in check-in endpoint, for benchmarking dms without touching
+ * the real service. Plain HTTP/1.1 with keep-alive, one thread per
+ * connection.
+ *
+ *    GET    /v1/snitches[?page=N]      200 [{...}, ...] paged by Link
+ *    GET    /v1/snitches/<token>       200 {...} with an ETag, or 304
+ *    POST   /v1/snitches               201 {"token":...}
+ *    DELETE /v1/snitches/<token>       204
+ *    POST   /v1/snitches/<token>/pause 204
+ *    GET    /<token>                   202
+ *    HEAD   /                          200
+ *
+ * Point dms at it with APIURL http://127.0.0.1:<port>/v1/snitches and
+ * CheckInURL http://127.0.0.1:<port>.
+ */
+
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <errno.h>
+#include <unistd.h>
+#include <getopt.h>
+#include <pthread.h>
+#include <signal.h>
+#include <time.h>
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <sys/socket.h>
+
+#define MAX_REQUEST 16384
+#define MAX_RESPONSE 16384
+#define TOKEN_LEN 10
+#define NAME_LEN 128
+#define PAGE_SIZE 25
+
+typedef struct {
+   char    token[TOKEN_LEN + 1];
+   char    name[NAME_LEN];
+   int     paused;
+   int     deleted;
+   time_t  checked_in;
+} Snitch;
+
+static long latency_ms = 0;
+static int error_percent = 0;
+/* API requests per second before answering 429, 0 for no limit */
+static long api_rate = 0;
+static time_t api_second = 0;
+static long api_count = 0;
+static unsigned long next_token = 0;
+static pthread_mutex_t token_lock = PTHREAD_MUTEX_INITIALIZER;
+/* every snitch created since startup, guarded by token_lock */
+static Snitch* snitches = NULL;
+static size_t nsnitches = 0;
+static size_t snitches_cap = 0;
+
+typedef struct {
+   char*   method;
+   char*   path;
+   char*   body;
+   size_t  body_len;
+   const char* host;
+   const char* if_none_match;
+   int     keep_alive;
+} Request;
+
+typedef struct {
+   int     status;
+   char    headers[512];
+   char    body[MAX_RESPONSE];
+} Response;
+
+static const char* reason(int status) {
+   switch (status) {
+   case 201: return "Created";
+   case 202: return "Accepted";
+   case 204: return "No Content";
+   case 304: return "Not Modified";
+   case 200: return "OK";
+   case 400: return "Bad Request";
+   case 404: return "Not Found";
+   case 429: return "Too Many Requests";
+   case 500: return "Internal Server Error";
+   }
+   return "OK";
+}
+
+static int write_all(int fd, const char* buf, size_t len) {
+
+   ssize_t n;
+
+   while (len) {
+      if ((n = write(fd, buf, len)) < 0) {
+         if (errno == EINTR)
+            continue;
+         return 1;
+      }
+      buf += n;
+      len -= (size_t)n;
+   }
+   return 0;
+}
+
+static void inject_latency(void) {
+
+   struct timespec ts;
+
+   if (latency_ms <= 0)
+      return;
+   ts.tv_sec = latency_ms / 1000;
+   ts.tv_nsec = (latency_ms % 1000) * 1000000L;
+   while (nanosleep(&ts, &ts) && errno == EINTR)
+      ;
+}
+
+static void new_token(char* token) {
+
+   static const char alphabet[] = "abcdefghijklmnopqrstuvwxyz0123456789";
+   unsigned long n;
+   int i;
+
+   pthread_mutex_lock(&token_lock);
+   n = next_token++;
+   pthread_mutex_unlock(&token_lock);
+
+   for (i = TOKEN_LEN - 1; i >= 0; i--) {
+      token[i] = alphabet[n % (sizeof(alphabet) - 1)];
+      n /= sizeof(alphabet) - 1;
+   }
+   token[TOKEN_LEN] = '\0';
+}
+
+/* the "name" of a create request, good enough for the bodies dms sends */
+static void body_name(const Request* req, char* name, size_t size) {
+
+   const char* start;
+   size_t len;
+
+   name[0] = '\0';
+   if (req->body_len == 0 || (start = strstr(req->body, "\"name\"")) == NULL)
+      return;
+   if ((start = strchr(start + 6, '"')) == NULL)
+      return;
+   start++;
+   len = strcspn(start, "\"");
+   if (len >= size)
+      len = size - 1;
+   memcpy(name, start, len);
+   name[len] = '\0';
+}
+
+static void remember(const char* token, const char* name) {
+
+   Snitch* grown;
+
+   pthread_mutex_lock(&token_lock);
+   if (nsnitches == snitches_cap) {
+      snitches_cap = snitches_cap ? snitches_cap * 2 : 256;
+      if ((grown = realloc(snitches, snitches_cap * sizeof(*grown))) == NULL) {
+         pthread_mutex_unlock(&token_lock);
+         return;
+      }
+      snitches = grown;
+   }
+   memset(&snitches[nsnitches], 0, sizeof(*snitches));
+   snprintf(snitches[nsnitches].token, sizeof(snitches->token), "%.*s", TOKEN_LEN, token);
+   snprintf(snitches[nsnitches].name, sizeof(snitches->name), "%s", name);
+   nsnitches++;
+   pthread_mutex_unlock(&token_lock);
+}
+
+/* marks a known snitch paused or deleted, unknown tokens are fine */
+static void forget(const char* token, int deleted) {
+
+   size_t i;
+
+   pthread_mutex_lock(&token_lock);
+   for (i = 0; i < nsnitches; i++) {
+      if (strcmp(snitches[i].token, token) == 0) {
+         if (deleted)
+            snitches[i].deleted = 1;
+         else
+            snitches[i].paused = 1;
+         break;
+      }
+   }
+   pthread_mutex_unlock(&token_lock);
+}
+
+/* a known snitch checked in, unknown tokens are fine */
+static void checked_in(const char* token) {
+
+   size_t i;
+
+   pthread_mutex_lock(&token_lock);
+   for (i = 0; i < nsnitches; i++) {
+      if (strcmp(snitches[i].token, token) == 0) {
+         snitches[i].checked_in = time(NULL);
+         break;
+      }
+   }
+   pthread_mutex_unlock(&token_lock);
+}
+
+/* one snitch, its ETag changes whenever anything shown does */
+static void get(const Request* req, const char* token, Response* res) {
+
+   char etag[64];
+   char at[32];
+   struct tm tm;
+   Snitch s;
+   size_t i;
+
+   pthread_mutex_lock(&token_lock);
+   for (i = 0; i < nsnitches; i++) {
+      if (strcmp(snitches[i].token, token) == 0 && !snitches[i].deleted)
+         break;
+   }
+   if (i < nsnitches)
+      s = snitches[i];
+   pthread_mutex_unlock(&token_lock);
+
+   if (i == nsnitches) {
+      res->status = 404;
+      return;
+   }
+
+   snprintf(etag, sizeof(etag), "\"%s-%d-%ld\"", s.token, s.paused, (long)s.checked_in);
+   snprintf(res->headers, sizeof(res->headers), "ETag: %s\r\n", etag);
+   if (req->if_none_match && strncmp(req->if_none_match, etag, strlen(etag)) == 0) {
+      res->status = 304;
+      return;
+   }
+
+   res->status = 200;
+   if (s.checked_in) {
+      gmtime_r(&s.checked_in, &tm);
+      strftime(at, sizeof(at), "\"%Y-%m-%dT%H:%M:%SZ\"", &tm);
+   } else {
+      snprintf(at, sizeof(at), "null");
+   }
+   snprintf(res->body, sizeof(res->body),
+            "{\"token\":\"%s\",\"href\":\"/v1/snitches/%s\",\"name\":\"%s\","
+            "\"tags\":[\"production\",\"anti-virus\"],\"status\":\"%s\","
+            "\"checked_in_at\":%s,\"interval\":\"daily\"}",
+            s.token, s.token, s.name,
+            s.paused ? "paused" : s.checked_in ? "healthy" : "pending", at);
+}
+
+/* one page of the listing, with a Link to the next while there is one;
+ * tags are accepted but everything created here carries dms's tags */
+static void list(const Request* req, Response* res) {
+
+   const char* page_arg = strstr(req->path, "page=");
+   const char* query = strchr(req->path, '?');
+   char rest[256];
+   const char* host;
+   long page = page_arg ? strtol(page_arg + 5, NULL, 10) : 1;
+   size_t skip;
+   size_t shown = 0;
+   size_t len = 1;
+   size_t i;
+
+   if (page < 1)
+      page = 1;
+   skip = (size_t)(page - 1) * PAGE_SIZE;
+
+   res->status = 200;
+   res->body[0] = '[';
+
+   pthread_mutex_lock(&token_lock);
+   for (i = 0; i < nsnitches && shown < PAGE_SIZE; i++) {
+      if (snitches[i].deleted)
+         continue;
+      if (skip > 0) {
+         skip--;
+         continue;
+      }
+      len += (size_t)snprintf(res->body + len, sizeof(res->body) - len,
+                              "%s{\"token\":\"%s\",\"href\":\"/v1/snitches/%s\",\"name\":\"%s\","
+                              "\"tags\":[\"production\",\"anti-virus\"],\"status\":\"%s\"}",
+                              shown ? "," : "", snitches[i].token, snitches[i].token,
+                              snitches[i].name, snitches[i].paused ? "paused" : "pending");
+      shown++;
+   }
+   for (; i < nsnitches && snitches[i].deleted; i++)
+      ;
+   pthread_mutex_unlock(&token_lock);
+
+   snprintf(res->body + len, sizeof(res->body) - len, "]");
+
+   if (i < nsnitches) {
+      /* carry the other query arguments over, page always comes last */
+      if (page_arg)
+         snprintf(rest, sizeof(rest), "%.*s", (int)(page_arg - query - 1), query + 1);
+      else if (query)
+         snprintf(rest, sizeof(rest), "%s&", query + 1);
+      else
+         rest[0] = '\0';
+      host = req->host ? req->host : "127.0.0.1";
+      snprintf(res->headers, sizeof(res->headers),
+               "Link: <http://%.*s/v1/snitches?%spage=%ld>; rel=\"next\"\r\n",
+               (int)strcspn(host, "\r\n"), host, rest, page + 1);
+   }
+}
+
+/* a fixed one-second window, crude but enough to make dms back off */
+static int api_throttled(void) {
+
+   time_t now = time(NULL);
+   int throttled;
+
+   pthread_mutex_lock(&token_lock);
+   if (now != api_second) {
+      api_second = now;
+      api_count = 0;
+   }
+   throttled = ++api_count > api_rate;
+   pthread_mutex_unlock(&token_lock);
+   return throttled;
+}
+
+/* the token in "/v1/snitches/<token>[/suffix]", or NULL */
+static int snitch_path(const char* path, char* token, size_t size, const char** suffix) {
+
+   static const char prefix[] = "/v1/snitches/";
+   size_t len;
+
+   if (strncmp(path, prefix, sizeof(prefix) - 1) != 0)
+      return 0;
+   path += sizeof(prefix) - 1;
+   len = strcspn(path, "/?");
+   if (len == 0 || len >= size)
+      return 0;
+   memcpy(token, path, len);
+   token[len] = '\0';
+   *suffix = path + len;
+   return 1;
+}
+
+static void route(const Request* req, Response* res) {
+
+   char token[64];
+   const char* suffix;
+   char name[NAME_LEN];
+
+   res->body[0] = '\0';
+   res->headers[0] = '\0';
+
+   if (error_percent > 0 && rand() % 100 < error_percent) {
+      res->status = 500;
+      return;
+   }
+
+   if (api_rate > 0 && strncmp(req->path, "/v1/snitches", 12) == 0 && api_throttled()) {
+      res->status = 429;
+      snprintf(res->headers, sizeof(res->headers), "Retry-After: 1\r\n");
+      snprintf(res->body, sizeof(res->body), "{\"type\":\"rate_limited\"}");
+      return;
+   }
+
+   if (strcmp(req->method, "POST") == 0 && strcmp(req->path, "/v1/snitches") == 0) {
+      new_token(token);
+      body_name(req, name, sizeof(name));
+      remember(token, name);
+      res->status = 201;
+      snprintf(res->body, sizeof(res->body),
+               "{\"token\":\"%s\",\"href\":\"/v1/snitches/%s\",\"status\":\"pending\","
+               "\"check_in_url\":\"https://nosnch.in/%s\"}", token, token, token);
+      return;
+   }
+
+   if (strcmp(req->method, "GET") == 0 && strncmp(req->path, "/v1/snitches", 12) == 0
+       && (req->path[12] == '\0' || req->path[12] == '?')) {
+      list(req, res);
+      return;
+   }
+
+   if (snitch_path(req->path, token, sizeof(token), &suffix)) {
+      if (strcmp(req->method, "DELETE") == 0 && *suffix == '\0') {
+         forget(token, 1);
+         res->status = 204;
+         return;
+      }
+      if (strcmp(req->method, "POST") == 0 && strcmp(suffix, "/pause") == 0) {
+         forget(token, 0);
+         res->status = 204;
+         return;
+      }
+      if (strcmp(req->method, "GET") == 0 && *suffix == '\0') {
+         get(req, token, res);
+         return;
+      }
+      res->status = 404;
+      return;
+   }
+
+   if (strcmp(req->method, "HEAD") == 0 && strcmp(req->path, "/") == 0) {
+      res->status = 200;
+      return;
+   }
+
+   if ((strcmp(req->method, "GET") == 0 || strcmp(req->method, "POST") == 0)
+       && req->path[0] == '/' && req->path[1] && strchr(req->path + 1, '/') == NULL) {
+      snprintf(token, sizeof(token), "%.*s", (int)strcspn(req->path + 1, "?"), req->path + 1);
+      checked_in(token);
+      res->status = 202;
+      snprintf(res->body, sizeof(res->body), "Got it, thanks!");
+      return;
+   }
+
+   res->status = 404;
+}
+
+/* headers points at the CRLF that ends the request line */
+static const char* header_value(char* headers, const char* name) {
+
+   char* line;
+   size_t len = strlen(name);
+
+   for (line = headers; line; line = strstr(line, "\r\n")) {
+      line += 2;
+      if (strncasecmp(line, name, len) == 0 && line[len] == ':')
+         return line + len + 1 + strspn(line + len + 1, " \t");
+   }
+   return NULL;
+}
+
+/* Reads one request into buf. Returns the number of bytes it took, 0 on
+ * a clean close and -1 on error. */
+static ssize_t read_request(int fd, char* buf, size_t* have, Request* req) {
+
+   char* end;
+   char* headers;
+   const char* value;
+   size_t head_len;
+   size_t need;
+   ssize_t n;
+
+   while ((end = memmem(buf, *have, "\r\n\r\n", 4)) == NULL) {
+      if (*have >= MAX_REQUEST - 1)
+         return -1;
+      if ((n = read(fd, buf + *have, MAX_REQUEST - 1 - *have)) <= 0)
+         return n == 0 && *have == 0 ? 0 : -1;
+      *have += (size_t)n;
+   }
+
+   *end = '\0';
+   head_len = (size_t)(end - buf) + 4;
+   headers = strstr(buf, "\r\n");
+
+   req->method = buf;
+   if ((req->path = strchr(buf, ' ')) == NULL)
+      return -1;
+   *req->path++ = '\0';
+   req->path[strcspn(req->path, " \r")] = '\0';
+
+   value = headers ? header_value(headers, "Content-Length") : NULL;
+   req->body_len = value ? strtoul(value, NULL, 10) : 0;
+   req->host = headers ? header_value(headers, "Host") : NULL;
+   req->if_none_match = headers ? header_value(headers, "If-None-Match") : NULL;
+   value = headers ? header_value(headers, "Connection") : NULL;
+   req->keep_alive = !(value && strncasecmp(value, "close", 5) == 0);
+   value = headers ? header_value(headers, "Expect") : NULL;
+   if (value && strncasecmp(value, "100-continue", 12) == 0)
+      write_all(fd, "HTTP/1.1 100 Continue\r\n\r\n", 25);
+
+   need = head_len + req->body_len;
+   if (need >= MAX_REQUEST)
+      return -1;
+   while (*have < need) {
+      if ((n = read(fd, buf + *have, MAX_REQUEST - 1 - *have)) <= 0)
+         return -1;
+      *have += (size_t)n;
+   }
+   req->body = buf + head_len;
+
+   return (ssize_t)need;
+}
+
+static void* serve(void* arg) {
+
+   int fd = (int)(long)arg;
+   char* buf;
+   char head[1024];
+   size_t have = 0;
+   ssize_t used;
+   Request req;
+   Response res;
+   int len;
+
+   if ((buf = malloc(MAX_REQUEST)) == NULL) {
+      close(fd);
+      return NULL;
+   }
+
+   for (;;) {
+      if ((used = read_request(fd, buf, &have, &req)) <= 0)
+         break;
+
+      inject_latency();
+      route(&req, &res);
+
+      len = snprintf(head, sizeof(head),
+                     "HTTP/1.1 %d %s\r\nContent-Type: application/json\r\n"
+                     "Content-Length: %zu\r\n%s%s\r\n",
+                     res.status, reason(res.status), strlen(res.body), res.headers,
+                     req.keep_alive ? "" : "Connection: close\r\n");
+      if (write_all(fd, head, (size_t)len) || write_all(fd, res.body, strlen(res.body)))
+         break;
+      if (!req.keep_alive)
+         break;
+
+      /* keep whatever pipelined bytes followed this request */
+      memmove(buf, buf + used, have - (size_t)used);
+      have -= (size_t)used;
+   }
+
+   free(buf);
+   close(fd);
+   return NULL;
+}
+
+static void usage(void) {
+   fprintf(stderr, "\
+Usage: dms-mock [OPTIONS]\n\
+Options:\n\
+   -p    port to listen on, 0 picks one (default 0)\n\
+   -l    latency to add to every response, in milliseconds\n\
+   -e    percentage of requests answered with a 500\n\
+   -q    API requests per second before answering 429 (default no limit)\n\
+");
+}
+
+int main(int argc, char* argv[]) {
+
+   struct sockaddr_in addr;
+   socklen_t addr_len = sizeof(addr);
+   pthread_attr_t attr;
+   pthread_t thread;
+   int port = 0;
+   int one = 1;
+   int fd;
+   int client;
+   int c;
+
+   while ((c = getopt(argc, argv, "p:l:e:q:h")) != -1) {
+      switch (c) {
+      case 'p':
+         port = atoi(optarg);
+         break;
+      case 'l':
+         latency_ms = atol(optarg);
+         break;
+      case 'q':
+         api_rate = atol(optarg);
+         break;
+      case 'e':
+         error_percent = atoi(optarg);
+         break;
+      default:
+         usage();
+         return 1;
+      }
+   }
+
+   signal(SIGPIPE, SIG_IGN);
+   srand((unsigned)time(NULL));
+
+   if ((fd = socket(AF_INET, SOCK_STREAM, 0)) < 0) {
+      perror("socket");
+      return 1;
+   }
+   setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+
+   memset(&addr, 0, sizeof(addr));
+   addr.sin_family = AF_INET;
+   addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+   addr.sin_port = htons((uint16_t)port);
+   if (bind(fd, (struct sockaddr*)&addr, sizeof(addr)) || listen(fd, 512)) {
+      perror("bind");
+      return 1;
+   }
+   getsockname(fd, (struct sockaddr*)&addr, &addr_len);
+   printf("%d\n", ntohs(addr.sin_port));
+   fflush(stdout);
+
+   pthread_attr_init(&attr);
+   pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+
+   for (;;) {
+      if ((client = accept(fd, NULL, NULL)) < 0) {
+         if (errno == EINTR || errno == ECONNABORTED)
+            continue;
+         perror("accept");
+         return 1;
+      }
+      setsockopt(client, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+      if (pthread_create(&thread, &attr, serve, (void*)(long)client))
+         close(client);
+   }
+}
@@ -0,0 +1,178 @@
+// vim:set et ts=3 sw=3:
+//  _____ _         _____                                 _       
+// |  __ (_)       |  __ \                               | |      
+// | |__) | _ __   | |__) |_ _ _   _ _ __ ___   ___ _ __ | |_ ___ 
+// |  ___/ | '_ \  |  ___/ _` | | | | '_ ` _ \ / _ \ '_ \| __/ __|
+// | |   | | | | | | |  | (_| | |_| | | | | | |  __/ | | | |_\__ \
+// |_|   |_|_| |_| |_|   \__,_|\__, |_| |_| |_|\___|_| |_|\__|___/
+//                              __/ |                             
+//                             |___/                              
+// Copyright (C) 2018 Pin Payments
+// http://pinpayments.com
+// 
+// This software is provided 'as-is', without any express or implied
+// warranty.  In no event will the authors be held liable for any damages
+// arising from the use of this software.
+// 
+// Permission is granted to anyone to use this software for any purpose,
+// including commercial applications, and to alter it and redistribute it
+// freely, subject to the following restrictions:
+// 
+// 1. The origin of this software must not be misrepresented; you must not
+//    claim that you wrote the original software. If you use this software
+//    in a product, an acknowledgment in the product documentation would be
+//    appreciated but is not required.
+// 2. Altered source versions must be plainly marked as such, and must not be
+//    misrepresented as being the original software.
+// 3. This notice may not be removed or altered from any source distribution.
+/*
+ * dms-parse-bench - time to read a configuration with many [snitch NAME]
+ * sections, the way the daemon re-reads it on every reload. The file is
+ * generated into a temporary directory, with half of the sections
+ * behind an Include, and read with read_config_file again and again.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <getopt.h>
+#include <time.h>
+#include <sys/stat.h>
+
+#include <readconf.h>
+
+#define MAX_PATH 256
+
+static double now(void) {
+
+   struct timespec ts;
+
+   clock_gettime(CLOCK_MONOTONIC, &ts);
+   return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static int compare_double(const void* a, const void* b) {
+
+   double x = *(const double*)a;
+   double y = *(const double*)b;
+
+   return (x > y) - (x < y);
+}
+
+static int write_sections(const char* path, size_t first, size_t count, const char* head) {
+
+   static const char* intervals[] = { "15_minute", "hourly", "daily", "3600", "weekly" };
+   FILE* file;
+   size_t i;
+
+   if ((file = fopen(path, "w")) == NULL) {
+      fprintf(stderr, "%s: cannot write\n", path);
+      return 1;
+   }
+   fputs(head, file);
+   for (i = first; i < first + count; i++) {
+      fprintf(file, "\n# snitch %zu\n[snitch job-%06zu]\nInterval %s\nTags batch,host-%zu\nDeadline = \"%zu.5\"\n",
+              i, i, intervals[i % 5], i % 97, i % 10 + 1);
+   }
+   return fclose(file) != 0;
+}
+
+static void usage(void) {
+   fprintf(stderr, "\
+Usage: dms-parse-bench [OPTIONS]\n\
+Options:\n\
+   -s    [snitch NAME] sections in the file (default 10000)\n\
+   -n    times to read it (default 50)\n\
+");
+}
+
+int main(int argc, char* argv[]) {
+
+   char dir[] = "/tmp/dms-parse-bench.XXXXXX";
+   char conf[MAX_PATH];
+   char included[MAX_PATH];
+   char head[MAX_PATH + 64];
+   Options options;
+   double* samples;
+   double start;
+   struct stat st;
+   off_t bytes = 0;
+   size_t sections = 10000;
+   size_t n = 50;
+   size_t found = 0;
+   size_t i;
+   int rv = 0;
+   int c;
+
+   while ((c = getopt(argc, argv, "s:n:h")) != -1) {
+      switch (c) {
+      case 's':
+         sections = strtoul(optarg, NULL, 10);
+         break;
+      case 'n':
+         n = strtoul(optarg, NULL, 10);
+         break;
+      default:
+         usage();
+         return 1;
+      }
+   }
+
+   if (sections < 2 || n == 0) {
+      usage();
+      return 1;
+   }
+
+   if (mkdtemp(dir) == NULL) {
+      fprintf(stderr, "cannot create a temporary directory\n");
+      return 1;
+   }
+   snprintf(conf, sizeof(conf), "%s/dms.conf", dir);
+   snprintf(included, sizeof(included), "%s/snitches.conf", dir);
+   snprintf(head, sizeof(head),
+            "DMSAPIKey bench\nSystemName bench\nCheckInInterval 3600\nInclude snitches.conf\n");
+
+   if (write_sections(included, sections / 2, sections - sections / 2, "")
+       || write_sections(conf, 0, sections / 2, head)) {
+      rv = 1;
+      goto out;
+   }
+
+   if (stat(conf, &st) == 0)
+      bytes += st.st_size;
+   if (stat(included, &st) == 0)
+      bytes += st.st_size;
+
+   if ((samples = calloc(n, sizeof(*samples))) == NULL) {
+      fprintf(stderr, "out of memory\n");
+      rv = 1;
+      goto out;
+   }
+
+   for (i = 0; i < n; i++) {
+      initialize_options(&options);
+      start = now();
+      rv |= read_config_file(conf, &options);
+      samples[i] = now() - start;
+      found = options.nsnitches;
+      free_options(&options);
+   }
+
+   qsort(samples, n, sizeof(*samples), compare_double);
+   printf("%-10s %8s %8s %10s %10s %10s\n", "operation", "sections", "n", "p50 ms", "p99 ms", "MB/s");
+   printf("%-10s %8zu %8zu %10.3f %10.3f %10.1f\n", "parse", found, n,
+          samples[n / 2] * 1e3, samples[(n * 99) / 100] * 1e3, bytes / samples[n / 2] / 1e6);
+   free(samples);
+
+   if (found != sections) {
+      fprintf(stderr, "read %zu of %zu sections\n", found, sections);
+      rv = 1;
+   }
+
+out:
+   unlink(included);
+   unlink(conf);
+   rmdir(dir);
+   return rv;
+}
@@ -0,0 +1,29 @@
+#!/bin/sh
+# Starts dms-mock on a free port, runs dms-bench against it and stops the
+# mock again, then times the configuration parser. MOCK_LATENCY (ms),
+# MOCK_ERRORS (%), BENCH_ITERATIONS, BENCH_CONCURRENCY and BENCH_SECTIONS
+# tune the run.
+
+set -e
+
+port_file=mock.port
+rm -f "$port_file"
+
+./dms-mock -l "${MOCK_LATENCY:-0}" -e "${MOCK_ERRORS:-0}" > "$port_file" &
+mock=$!
+trap 'kill $mock 2>/dev/null' EXIT INT TERM
+
+tries=0
+while [ ! -s "$port_file" ]; do
+   tries=$((tries + 1))
+   if [ $tries -gt 50 ]; then
+      echo "dms-mock did not start" >&2
+      exit 1
+   fi
+   sleep 0.1
+done
+
+./dms-bench -u "http://127.0.0.1:$(head -n 1 "$port_file")" \
+   -n "${BENCH_ITERATIONS:-200}" -j "${BENCH_CONCURRENCY:-32}"
+
+./dms-parse-bench -s "${BENCH_SECTIONS:-10000}"
@@ -0,0 +1,204 @@
+// vim:set et ts=3 sw=3:
+//  _____ _         _____                                 _       
+// |  __ (_)       |  __ \                               | |      
+// | |__) | _ __   | |__) |_ _ _   _ _ __ ___   ___ _ __ | |_ ___ 
+// |  ___/ | '_ \  |  ___/ _` | | | | '_ ` _ \ / _ \ '_ \| __/ __|
+// | |   | | | | | | |  | (_| | |_| | | | | | |  __/ | | | |_\__ \
+// |_|   |_|_| |_| |_|   \__,_|\__, |_| |_| |_|\___|_| |_|\__|___/
+//                              __/ |                             
+//                             |___/                              
+// Copyright (C) 2018 Pin Payments
+// http://pinpayments.com
+// 
+// This software is provided 'as-is', without any express or implied
+// warranty.  In no event will the authors be held liable for any damages
+// arising from the use of this software.
+// 
+// Permission is granted to anyone to use this software for any purpose,
+// including commercial applications, and to alter it and redistribute it
+// freely, subject to the following restrictions:
+// 
+// 1. The origin of this software must not be misrepresented; you must not
+//    claim that you wrote the original software. If you use this software
+//    in a product, an acknowledgment in the product documentation would be
+//    appreciated but is not required.
+// 2. Altered source versions must be plainly marked as such, and must not be
+//    misrepresented as being the original software.
+// 3. This notice may not be removed or altered from any source distribution.
+
+#include <dms-agent.h>
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+#include <unistd.h>
+#include <poll.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+
+#include <dms-daemon.h>
+#include <dms-tokens.h>
+
+#define AGENT_MAX_PENDING 256
+#define AGENT_MAX_DATAGRAM (TOKEN_NAME_LEN + 4)
+#define AGENT_WAIT_MS_MAX 1000
+
+/* one snitch waiting for its window to close */
+typedef struct {
+   char           name[TOKEN_NAME_LEN];
+   long           due_ms;
+   unsigned long  requests;
+} AgentPending;
+
+static long now_ms(void) {
+
+   struct timespec ts;
+
+   clock_gettime(CLOCK_MONOTONIC, &ts);
+   return ts.tv_sec * 1000L + ts.tv_nsec / 1000000L;
+}
+
+static int agent_address(const char* socket_path, struct sockaddr_un* addr) {
+
+   memset(addr, 0, sizeof(*addr));
+   addr->sun_family = AF_UNIX;
+   if (strlen(socket_path) >= sizeof(addr->sun_path)) {
+      fprintf(stderr, "%s: socket path too long\n", socket_path);
+      return 1;
+   }
+   strcpy(addr->sun_path, socket_path);
+   return 0;
+}
+
+/* Hands a check-in for name to the agent without waiting for it. Fails
+ * when no agent is listening or its queue is full, so the caller can
+ * fall back to checking in itself. */
+int dms_agent_send(const char* socket_path, const char* name) {
+
+   struct sockaddr_un addr;
+   char msg[AGENT_MAX_DATAGRAM];
+   int len;
+   int fd;
+   int rv = 1;
+
+   if (agent_address(socket_path, &addr))
+      return 1;
+   len = snprintf(msg, sizeof(msg), "R %s", name);
+   if (len < 0 || (size_t)len >= sizeof(msg))
+      return 1;
+
+   if ((fd = socket(AF_UNIX, SOCK_DGRAM | SOCK_CLOEXEC, 0)) < 0)
+      return 1;
+   if (sendto(fd, msg, (size_t)len, MSG_DONTWAIT, (struct sockaddr*)&addr, sizeof(addr)) == len)
+      rv = 0;
+   close(fd);
+
+   return rv;
+}
+
+static void agent_flush(CURL* curl, AgentPending* pending, size_t i, agent_report_fn report) {
+
+   if (report(curl, pending[i].name)) {
+      fprintf(stderr, "%s: check-in failed (%lu requests)\n", pending[i].name, pending[i].requests);
+   }
+}
+
+/* Listens on a datagram socket for "R <name>" from local producers and
+ * collapses every request for the same snitch that arrives within
+ * window_ms of the first into one check-in through report. Runs until
+ * SIGTERM or SIGINT, checking in whatever is still pending on the way
+ * out. */
+int dms_agent_run(CURL* curl, const char* socket_path, long window_ms, agent_report_fn report) {
+
+   AgentPending pending[AGENT_MAX_PENDING];
+   struct sockaddr_un addr;
+   struct pollfd pfd;
+   char msg[AGENT_MAX_DATAGRAM + 1];
+   size_t npending = 0;
+   size_t i;
+   ssize_t len;
+   long now;
+   long timeout;
+   int fd;
+
+   if (agent_address(socket_path, &addr))
+      return 1;
+
+   dms_daemon_install_signals();
+
+   if ((fd = socket(AF_UNIX, SOCK_DGRAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0)) < 0) {
+      fprintf(stderr, "socket: %s\n", strerror(errno));
+      return 1;
+   }
+   /* a stale socket from an earlier run would make bind fail */
+   unlink(socket_path);
+   if (bind(fd, (struct sockaddr*)&addr, sizeof(addr)) < 0) {
+      fprintf(stderr, "%s: %s\n", socket_path, strerror(errno));
+      close(fd);
+      return 1;
+   }
+   /* the hooks run as the clamav user, the directory decides who gets in */
+   chmod(socket_path, 0666);
+
+   pfd.fd = fd;
+   pfd.events = POLLIN;
+
+   while (!dms_daemon_should_stop()) {
+
+      now = now_ms();
+      timeout = AGENT_WAIT_MS_MAX;
+      for (i = 0; i < npending; i++) {
+         if (pending[i].due_ms - now < timeout)
+            timeout = pending[i].due_ms - now;
+      }
+      if (timeout < 0)
+         timeout = 0;
+
+      if (poll(&pfd, 1, (int)timeout) < 0 && errno != EINTR) {
+         fprintf(stderr, "poll: %s\n", strerror(errno));
+         break;
+      }
+
+      while ((len = recv(fd, msg, sizeof(msg) - 1, 0)) > 0) {
+         msg[len] = '\0';
+         if (len < 3 || msg[0] != 'R' || msg[1] != ' ' || !dms_tokens_valid_name(msg + 2))
+            continue;
+
+         for (i = 0; i < npending; i++) {
+            if (strcmp(pending[i].name, msg + 2) == 0)
+               break;
+         }
+         if (i == npending) {
+            /* out of room, the oldest goes now rather than being lost */
+            if (npending == AGENT_MAX_PENDING) {
+               agent_flush(curl, pending, 0, report);
+               memmove(pending, pending + 1, (--npending) * sizeof(*pending));
+               i = npending;
+            }
+            strcpy(pending[i].name, msg + 2);
+            pending[i].due_ms = now_ms() + window_ms;
+            pending[i].requests = 0;
+            npending++;
+         }
+         pending[i].requests++;
+      }
+
+      /* entries are in arrival order, so are their deadlines */
+      now = now_ms();
+      while (npending > 0 && pending[0].due_ms <= now) {
+         agent_flush(curl, pending, 0, report);
+         memmove(pending, pending + 1, (--npending) * sizeof(*pending));
+      }
+   }
+
+   for (i = 0; i < npending; i++)
+      agent_flush(curl, pending, i, report);
+
+   close(fd);
+   unlink(socket_path);
+
+   return 0;
+}
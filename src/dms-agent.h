@@ -0,0 +1,41 @@
+// vim:set et ts=3 sw=3:
+//  _____ _         _____                                 _       
+// |  __ (_)       |  __ \                               | |      
+// | |__) | _ __   | |__) |_ _ _   _ _ __ ___   ___ _ __ | |_ ___ 
+// |  ___/ | '_ \  |  ___/ _` | | | | '_ ` _ \ / _ \ '_ \| __/ __|
+// | |   | | | | | | |  | (_| | |_| | | | | | |  __/ | | | |_\__ \
+// |_|   |_|_| |_| |_|   \__,_|\__, |_| |_| |_|\___|_| |_|\__|___/
+//                              __/ |                             
+//                             |___/                              
+// Copyright (C) 2018 Pin Payments
+// http://pinpayments.com
+// 
+// This software is provided 'as-is', without any express or implied
+// warranty.  In no event will the authors be held liable for any damages
+// arising from the use of this software.
+// 
+// Permission is granted to anyone to use this software for any purpose,
+// including commercial applications, and to alter it and redistribute it
+// freely, subject to the following restrictions:
+// 
+// 1. The origin of this software must not be misrepresented; you must not
+//    claim that you wrote the original software. If you use this software
+//    in a product, an acknowledgment in the product documentation would be
+//    appreciated but is not required.
+// 2. Altered source versions must be plainly marked as such, and must not be
+//    misrepresented as being the original software.
+// 3. This notice may not be removed or altered from any source distribution.
+
+#ifndef DMS_AGENT_H
+#define DMS_AGENT_H
+
+#include <curl/curl.h>
+
+typedef int (*agent_report_fn)(CURL* curl, const char* name);
+
+/* client side, returns 0 once the agent has the request */
+int   dms_agent_send(const char* socket_path, const char* name);
+
+int   dms_agent_run(CURL* curl, const char* socket_path, long window_ms, agent_report_fn report);
+
+#endif // DMS_AGENT_H
@@ -0,0 +1,215 @@
+// vim:set et ts=3 sw=3:
+//  _____ _         _____                                 _       
+// |  __ (_)       |  __ \                               | |      
+// | |__) | _ __   | |__) |_ _ _   _ _ __ ___   ___ _ __ | |_ ___ 
+// |  ___/ | '_ \  |  ___/ _` | | | | '_ ` _ \ / _ \ '_ \| __/ __|
+// | |   | | | | | | |  | (_| | |_| | | | | | |  __/ | | | |_\__ \
+// |_|   |_|_| |_| |_|   \__,_|\__, |_| |_| |_|\___|_| |_|\__|___/
+//                              __/ |                             
+//                             |___/                              
+// Copyright (C) 2018 Pin Payments
+// http://pinpayments.com
+// 
+// This software is provided 'as-is', without any express or implied
+// warranty.  In no event will the authors be held liable for any damages
+// arising from the use of this software.
+// 
+// Permission is granted to anyone to use this software for any purpose,
+// including commercial applications, and to alter it and redistribute it
+// freely, subject to the following restrictions:
+// 
+// 1. The origin of this software must not be misrepresented; you must not
+//    claim that you wrote the original software. If you use this software
+//    in a product, an acknowledgment in the product documentation would be
+//    appreciated but is not required.
+// 2. Altered source versions must be plainly marked as such, and must not be
+//    misrepresented as being the original software.
+// 3. This notice may not be removed or altered from any source distribution.
+
+#include <dms-body.h>
+
+#include <stdlib.h>
+#include <string.h>
+
+/*
+ * Response bodies as they stream in from libcurl: whole into a buffer
+ * with room for the usual answer built in, or scanned for the one
+ * field a caller wants and dropped. Neither touches the heap for a
+ * response of the size DMS sends.
+ */
+
+/* a throttled attempt is retried, its body must not mix with the next */
+int dms_body_throttled(CURL* curl) {
+
+   long http_status = 0;
+
+   curl_easy_getinfo(curl, CURLINFO_RESPONSE_CODE, &http_status);
+   return http_status == 429;
+}
+
+void dms_body_init(DownloadBuffer* db, CURL* curl) {
+   db->buf = NULL;
+   db->len = db->cap = 0;
+   db->curl = curl;
+}
+
+size_t dms_body_download_cb(const void* ptr, size_t size, size_t nmemb, void* user_data) {
+
+   DownloadBuffer* db = (DownloadBuffer*) user_data;
+   size_t len = size * nmemb;
+   size_t need = db->len + len + 1;
+   size_t cap;
+   char* grown;
+#if LIBCURL_VERSION_NUM >= 0x073700
+   curl_off_t content_length = -1;
+#endif
+
+   if (db->curl && dms_body_throttled(db->curl))
+      return len;
+
+   if (db->buf == NULL) {
+      db->buf = db->arena;
+      db->cap = sizeof(db->arena);
+#if LIBCURL_VERSION_NUM >= 0x073700
+      if (db->curl)
+         curl_easy_getinfo(db->curl, CURLINFO_CONTENT_LENGTH_DOWNLOAD_T, &content_length);
+      if (content_length >= (curl_off_t)sizeof(db->arena)) {
+         if ((db->buf = malloc((size_t)content_length + 1)) == NULL)
+            return 0;
+         db->cap = (size_t)content_length + 1;
+      }
+#endif
+   }
+
+   if (need > db->cap) {
+      for (cap = db->cap * 2; cap < need; cap *= 2)
+         ;
+      if ((grown = malloc(cap)) == NULL)
+         return 0;
+      memcpy(grown, db->buf, db->len);
+      if (db->buf != db->arena)
+         free(db->buf);
+      db->buf = grown;
+      db->cap = cap;
+   }
+
+   memcpy(db->buf + db->len, ptr, len);
+   db->len += len;
+   db->buf[db->len] = '\0';
+
+   return len;
+}
+
+void dms_body_free(DownloadBuffer* db) {
+   if (db && db->buf && db->buf != db->arena)
+      free(db->buf);
+   if (db) {
+      db->buf = NULL;
+      db->len = db->cap = 0;
+   }
+}
+
+void dms_token_stream_init(TokenStream* ts, CURL* curl, char* out, size_t size) {
+   memset(ts, 0, sizeof(*ts));
+   ts->curl = curl;
+   ts->out = out;
+   ts->size = size;
+}
+
+static void token_stream_char(TokenStream* ts, char c) {
+
+   if (ts->in_key) {
+      if (ts->key_len < sizeof(ts->key))
+         ts->key[ts->key_len] = c;
+      ts->key_len++;
+   } else if (ts->capture) {
+      if (ts->len + 1 < ts->size)
+         ts->out[ts->len++] = c;
+      else
+         ts->overflow = 1;
+   }
+}
+
+size_t dms_token_stream_cb(const void* ptr, size_t size, size_t nmemb, void* user_data) {
+
+   TokenStream* ts = (TokenStream*) user_data;
+   const char* p = ptr;
+   size_t len = size * nmemb;
+   size_t i;
+   char c;
+
+   if (ts->curl && dms_body_throttled(ts->curl))
+      return len;
+
+   for (i = 0; i < len; i++) {
+      c = p[i];
+      if (ts->in_string) {
+         if (ts->escape) {
+            /* tokens are plain ASCII, an escape is taken as is */
+            ts->escape = 0;
+            token_stream_char(ts, c);
+         } else if (c == '\\') {
+            ts->escape = 1;
+         } else if (c == '"') {
+            ts->in_string = 0;
+            if (ts->in_key) {
+               ts->in_key = 0;
+               ts->token_key = ts->key_len == 5 && memcmp(ts->key, "token", 5) == 0;
+            } else if (ts->capture) {
+               ts->capture = 0;
+               ts->found = !ts->overflow;
+               ts->out[ts->len] = '\0';
+            }
+         } else {
+            token_stream_char(ts, c);
+         }
+         continue;
+      }
+
+      switch (c) {
+      case '"':
+         ts->in_string = 1;
+         if (ts->depth == 1 && ts->want_key) {
+            ts->want_key = 0;
+            ts->in_key = 1;
+            ts->key_len = 0;
+         } else if (ts->depth == 1 && ts->after_colon && ts->token_key && !ts->found) {
+            ts->capture = 1;
+            ts->len = 0;
+         }
+         ts->after_colon = 0;
+         break;
+      case '{':
+      case '[':
+         ts->depth++;
+         ts->want_key = ts->depth == 1 && c == '{';
+         ts->after_colon = 0;
+         break;
+      case '}':
+      case ']':
+         ts->depth--;
+         break;
+      case ':':
+         ts->after_colon = ts->depth == 1;
+         break;
+      case ',':
+         if (ts->depth == 1) {
+            ts->want_key = 1;
+            ts->token_key = 0;
+         }
+         ts->after_colon = 0;
+         break;
+      case ' ':
+      case '\t':
+      case '\r':
+      case '\n':
+         break;
+      default:
+         /* a number, true, false or null */
+         ts->after_colon = 0;
+         break;
+      }
+   }
+
+   return len;
+}
@@ -0,0 +1,78 @@
+// vim:set et ts=3 sw=3:
+//  _____ _         _____                                 _       
+// |  __ (_)       |  __ \                               | |      
+// | |__) | _ __   | |__) |_ _ _   _ _ __ ___   ___ _ __ | |_ ___ 
+// |  ___/ | '_ \  |  ___/ _` | | | | '_ ` _ \ / _ \ '_ \| __/ __|
+// | |   | | | | | | |  | (_| | |_| | | | | | |  __/ | | | |_\__ \
+// |_|   |_|_| |_| |_|   \__,_|\__, |_| |_| |_|\___|_| |_|\__|___/
+//                              __/ |                             
+//                             |___/                              
+// Copyright (C) 2018 Pin Payments
+// http://pinpayments.com
+// 
+// This software is provided 'as-is', without any express or implied
+// warranty.  In no event will the authors be held liable for any damages
+// arising from the use of this software.
+// 
+// Permission is granted to anyone to use this software for any purpose,
+// including commercial applications, and to alter it and redistribute it
+// freely, subject to the following restrictions:
+// 
+// 1. The origin of this software must not be misrepresented; you must not
+//    claim that you wrote the original software. If you use this software
+//    in a product, an acknowledgment in the product documentation would be
+//    appreciated but is not required.
+// 2. Altered source versions must be plainly marked as such, and must not be
+//    misrepresented as being the original software.
+// 3. This notice may not be removed or altered from any source distribution.
+
+#ifndef DMS_BODY_H
+#define DMS_BODY_H
+
+#include <stddef.h>
+#include <curl/curl.h>
+
+/* Responses land in the arena inside the buffer itself when they fit,
+ * which the ones from DMS do; a larger Content-Length gets one heap
+ * block of that size, and only a body of unknown length grows. */
+#define DOWNLOAD_ARENA 2048
+
+typedef struct {
+   char*   buf;
+   size_t  len;
+   size_t  cap;
+   CURL*   curl;             /* NULL outside of a transfer */
+   char    arena[DOWNLOAD_ARENA];
+} DownloadBuffer;
+
+/* picks the top-level "token" out of a create response as it streams
+ * past, straight into the caller's storage */
+typedef struct {
+   CURL*    curl;
+   char*    out;
+   size_t   size;
+   size_t   len;
+   int      depth;
+   int      in_string;
+   int      escape;
+   int      in_key;
+   int      want_key;         /* the next string at depth 1 is a key */
+   int      after_colon;      /* and the next value belongs to it */
+   int      token_key;        /* that key was "token" */
+   int      capture;
+   int      found;
+   int      overflow;
+   char     key[8];
+   size_t   key_len;
+} TokenStream;
+
+int     dms_body_throttled(CURL* curl);
+
+void    dms_body_init(DownloadBuffer* db, CURL* curl);
+size_t  dms_body_download_cb(const void* ptr, size_t size, size_t nmemb, void* user_data);
+void    dms_body_free(DownloadBuffer* db);
+
+void    dms_token_stream_init(TokenStream* ts, CURL* curl, char* out, size_t size);
+size_t  dms_token_stream_cb(const void* ptr, size_t size, size_t nmemb, void* user_data);
+
+#endif // DMS_BODY_H
@@ -0,0 +1,428 @@
+// vim:set et ts=3 sw=3:
+//  _____ _         _____                                 _       
+// |  __ (_)       |  __ \                               | |      
+// | |__) | _ __   | |__) |_ _ _   _ _ __ ___   ___ _ __ | |_ ___ 
+// |  ___/ | '_ \  |  ___/ _` | | | | '_ ` _ \ / _ \ '_ \| __/ __|
+// | |   | | | | | | |  | (_| | |_| | | | | | |  __/ | | | |_\__ \
+// |_|   |_|_| |_| |_|   \__,_|\__, |_| |_| |_|\___|_| |_|\__|___/
+//                              __/ |                             
+//                             |___/                              
+// Copyright (C) 2018 Pin Payments
+// http://pinpayments.com
+// 
+// This software is provided 'as-is', without any express or implied
+// warranty.  In no event will the authors be held liable for any damages
+// arising from the use of this software.
+// 
+// Permission is granted to anyone to use this software for any purpose,
+// including commercial applications, and to alter it and redistribute it
+// freely, subject to the following restrictions:
+// 
+// 1. The origin of this software must not be misrepresented; you must not
+//    claim that you wrote the original software. If you use this software
+//    in a product, an acknowledgment in the product documentation would be
+//    appreciated but is not required.
+// 2. Altered source versions must be plainly marked as such, and must not be
+//    misrepresented as being the original software.
+// 3. This notice may not be removed or altered from any source distribution.
+
+#include <dms-cache.h>
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <config.h>
+
+/*
+ * Resolver and TLS state carried from one dms run to the next. At start
+ * up the cache file is loaded into a share handle that every dms_crud_*
+ * request uses; at exit whatever the share learned is written back.
+ *
+ *    dns <host> <port> <address> <expires>
+ *    tls <valid-until> <hex shmac> <hex session data> <session key>
+ *
+ * libcurl does not expose DNS TTLs, so addresses are kept for a fixed
+ * time after they were first seen. The loaded ones are pinned into the
+ * share with CURLOPT_RESOLVE, where they would never expire, so the
+ * list is rebuilt before a request whenever one has run out or refused
+ * a connection, with a "-host:port" entry that unpins it. TLS sessions
+ * need a libcurl with curl_easy_ssls_export(); without it only
+ * addresses are cached.
+ */
+
+#define MAX_DNS_ENTRIES 16
+#define MAX_HOST 256
+#define MAX_ADDR 64
+#define MAX_TLS_ENTRIES 16
+
+typedef struct {
+   char  host[MAX_HOST];
+   long  port;
+   char  addr[MAX_ADDR];
+   long  expires;
+   int   pinned;        /* handed to libcurl through CURLOPT_RESOLVE */
+} DnsEntry;
+
+typedef struct {
+   char*          key;
+   unsigned char* shmac;
+   size_t         shmac_len;
+   unsigned char* sdata;
+   size_t         sdata_len;
+   long           valid_until;
+} TlsEntry;
+
+static CURLSH* share = NULL;
+static struct curl_slist* resolve = NULL;
+static DnsEntry dns[MAX_DNS_ENTRIES];
+static int ndns = 0;
+static long ttl = 0;
+/* resolve has to be rebuilt before it is applied again */
+static int resolve_stale = 0;
+
+static void add_resolve(const DnsEntry* entry) {
+
+   char line[MAX_HOST + MAX_ADDR + 32];
+
+   /* IPv6 addresses go in brackets */
+   snprintf(line, sizeof(line), strchr(entry->addr, ':') ? "%s:%ld:[%s]" : "%s:%ld:%s",
+            entry->host, entry->port, entry->addr);
+   resolve = curl_slist_append(resolve, line);
+}
+
+static void add_unpin(const DnsEntry* entry) {
+
+   char line[MAX_HOST + 32];
+
+   snprintf(line, sizeof(line), "-%s:%ld", entry->host, entry->port);
+   resolve = curl_slist_append(resolve, line);
+}
+
+/* The pins still good, and an unpin for each that is not. An unpin is
+ * only needed once, by the next request, after that the list is made
+ * again without it. */
+static void rebuild_resolve(long now) {
+
+   int i;
+
+   curl_slist_free_all(resolve);
+   resolve = NULL;
+   resolve_stale = 0;
+
+   for (i = 0; i < ndns; i++) {
+      if (!dns[i].pinned)
+         continue;
+      if (dns[i].expires > now) {
+         add_resolve(&dns[i]);
+      } else {
+         add_unpin(&dns[i]);
+         dns[i].pinned = 0;
+         resolve_stale = 1;
+      }
+   }
+}
+
+static int pin_expired(long now) {
+
+   int i;
+
+   for (i = 0; i < ndns; i++) {
+      if (dns[i].pinned && dns[i].expires <= now)
+         return 1;
+   }
+   return 0;
+}
+
+static void load_dns(char* line, long now) {
+
+   DnsEntry entry;
+
+   if (ndns == MAX_DNS_ENTRIES)
+      return;
+   if (sscanf(line, "dns %255s %ld %63s %ld", entry.host, &entry.port, entry.addr, &entry.expires) != 4)
+      return;
+   if (entry.expires <= now)
+      return;
+
+   entry.pinned = 1;
+   dns[ndns++] = entry;
+   add_resolve(&entry);
+}
+
+#ifdef HAVE_CURL_EASY_SSLS_EXPORT
+static int hex_decode(const char* hex, unsigned char** out, size_t* len) {
+
+   size_t n = strlen(hex);
+   size_t i;
+   unsigned int byte;
+
+   if (n % 2)
+      return 1;
+   if ((*out = malloc(n / 2 + 1)) == NULL)
+      return 1;
+   for (i = 0; i < n / 2; i++) {
+      if (sscanf(hex + 2 * i, "%2x", &byte) != 1) {
+         free(*out);
+         return 1;
+      }
+      (*out)[i] = (unsigned char)byte;
+   }
+   *len = n / 2;
+   return 0;
+}
+
+static void hex_write(FILE* file, const unsigned char* data, size_t len) {
+
+   size_t i;
+
+   for (i = 0; i < len; i++)
+      fprintf(file, "%02x", data[i]);
+}
+
+static void load_tls(CURL* curl, char* line, long now) {
+
+   char* fields[4];
+   char* save = NULL;
+   unsigned char* shmac;
+   unsigned char* sdata;
+   size_t shmac_len;
+   size_t sdata_len;
+   int i;
+
+   strtok_r(line, " ", &save);
+   for (i = 0; i < 3; i++) {
+      if ((fields[i] = strtok_r(NULL, " ", &save)) == NULL)
+         return;
+   }
+   /* the session key is the rest of the line */
+   fields[3] = save;
+   if (!fields[3] || !*fields[3] || strtol(fields[0], NULL, 10) <= now)
+      return;
+
+   if (hex_decode(fields[1], &shmac, &shmac_len))
+      return;
+   if (hex_decode(fields[2], &sdata, &sdata_len)) {
+      free(shmac);
+      return;
+   }
+
+   curl_easy_ssls_import(curl, fields[3], shmac, shmac_len, sdata, sdata_len);
+
+   free(shmac);
+   free(sdata);
+}
+#endif
+
+/* Sets up the share handle and primes it from filename. A missing or
+ * unreadable cache only means a cold start. */
+int dms_cache_load(const char* filename, long dns_ttl) {
+
+   FILE* file;
+   CURL* curl = NULL;
+   char* line = NULL;
+   size_t cap = 0;
+   ssize_t len;
+   long now = (long)time(NULL);
+
+   if ((share = curl_share_init()) == NULL) {
+      fprintf(stderr, "CURL share initialization failed\n");
+      return 1;
+   }
+   curl_share_setopt(share, CURLSHOPT_SHARE, CURL_LOCK_DATA_DNS);
+   curl_share_setopt(share, CURLSHOPT_SHARE, CURL_LOCK_DATA_SSL_SESSION);
+   ttl = dns_ttl;
+
+   if ((file = fopen(filename, "r")) == NULL)
+      return 0;
+
+#ifdef HAVE_CURL_EASY_SSLS_EXPORT
+   /* sessions are imported through a handle attached to the share */
+   if ((curl = curl_easy_init()) != NULL)
+      curl_easy_setopt(curl, CURLOPT_SHARE, share);
+#endif
+
+   while ((len = getline(&line, &cap, file)) > 0) {
+      line[strcspn(line, "\r\n")] = '\0';
+      if (strncmp(line, "dns ", 4) == 0) {
+         load_dns(line, now);
+      }
+#ifdef HAVE_CURL_EASY_SSLS_EXPORT
+      else if (strncmp(line, "tls ", 4) == 0 && curl) {
+         load_tls(curl, line, now);
+      }
+#endif
+   }
+
+   free(line);
+   fclose(file);
+   if (curl)
+      curl_easy_cleanup(curl);
+
+   return 0;
+}
+
+#ifdef HAVE_CURL_EASY_SSLS_EXPORT
+static CURLcode export_tls(CURL* curl, void* user, const char* key,
+                           const unsigned char* shmac, size_t shmac_len,
+                           const unsigned char* sdata, size_t sdata_len,
+                           curl_off_t valid_until, int ietf_tls_id,
+                           const char* alpn, size_t earlydata_max) {
+
+   FILE* file = (FILE*)user;
+
+   if (strchr(key, '\n'))
+      return CURLE_OK;
+
+   fprintf(file, "tls %ld ", (long)valid_until);
+   hex_write(file, shmac, shmac_len);
+   fputc(' ', file);
+   hex_write(file, sdata, sdata_len);
+   fprintf(file, " %s\n", key);
+
+   return CURLE_OK;
+}
+#endif
+
+/* Writes the cache next to filename and renames it into place. */
+int dms_cache_save(const char* filename) {
+
+   char tmp[PATH_MAX];
+   FILE* file;
+   CURL* curl;
+   long now = (long)time(NULL);
+   int fd;
+   int i;
+
+   if (!share)
+      return 0;
+
+   /* session keys inside, for our eyes only */
+   snprintf(tmp, sizeof(tmp), "%s.%ld.tmp", filename, (long)getpid());
+   if ((fd = open(tmp, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0600)) < 0
+       || (file = fdopen(fd, "w")) == NULL) {
+      fprintf(stderr, "could not write %s: %s\n", tmp, strerror(errno));
+      if (fd >= 0) {
+         close(fd);
+         unlink(tmp);
+      }
+      return 1;
+   }
+
+   for (i = 0; i < ndns; i++) {
+      if (dns[i].expires > now && dns[i].addr[0])
+         fprintf(file, "dns %s %ld %s %ld\n", dns[i].host, dns[i].port, dns[i].addr, dns[i].expires);
+   }
+
+#ifdef HAVE_CURL_EASY_SSLS_EXPORT
+   if ((curl = curl_easy_init()) != NULL) {
+      curl_easy_setopt(curl, CURLOPT_SHARE, share);
+      curl_easy_ssls_export(curl, export_tls, file);
+      curl_easy_cleanup(curl);
+   }
+#else
+   (void)curl;
+#endif
+
+   if (fclose(file) || rename(tmp, filename)) {
+      fprintf(stderr, "could not replace %s\n", filename);
+      unlink(tmp);
+      return 1;
+   }
+   return 0;
+}
+
+void dms_cache_free(void) {
+   if (share)
+      curl_share_cleanup(share);
+   curl_slist_free_all(resolve);
+   share = NULL;
+   resolve = NULL;
+   resolve_stale = 0;
+   ndns = 0;
+}
+
+/* called for every request handle before it is performed, and again
+ * before each retry */
+void dms_cache_apply(CURL* curl) {
+
+   long now = (long)time(NULL);
+
+   if (!share)
+      return;
+   curl_easy_setopt(curl, CURLOPT_SHARE, share);
+   if (resolve_stale || pin_expired(now))
+      rebuild_resolve(now);
+   curl_easy_setopt(curl, CURLOPT_RESOLVE, resolve);
+}
+
+static DnsEntry* find_dns(const char* host, long port) {
+
+   int i;
+
+   for (i = 0; i < ndns; i++) {
+      if (dns[i].port == port && strcmp(dns[i].host, host) == 0)
+         return &dns[i];
+   }
+   return NULL;
+}
+
+/* called once a request completed, remembers where its host lives */
+void dms_cache_record(CURL* curl, CURLcode rc) {
+
+   CURLU* url;
+   char* effective = NULL;
+   char* host = NULL;
+   char* port = NULL;
+   char* ip = NULL;
+   DnsEntry* entry;
+   long now = (long)time(NULL);
+
+   if (!share)
+      return;
+
+   curl_easy_getinfo(curl, CURLINFO_EFFECTIVE_URL, &effective);
+   if (!effective || (url = curl_url()) == NULL)
+      return;
+
+   if (curl_url_set(url, CURLUPART_URL, effective, 0) != CURLUE_OK
+       || curl_url_get(url, CURLUPART_HOST, &host, 0) != CURLUE_OK
+       || curl_url_get(url, CURLUPART_PORT, &port, CURLU_DEFAULT_PORT) != CURLUE_OK)
+      goto out;
+
+   entry = find_dns(host, strtol(port, NULL, 10));
+
+   if (rc == CURLE_COULDNT_CONNECT) {
+      /* the cached address is no good, resolve again next time */
+      if (entry)
+         entry->expires = 0;
+      goto out;
+   }
+
+   if (rc != CURLE_OK || (entry && entry->expires > now))
+      goto out;
+
+   curl_easy_getinfo(curl, CURLINFO_PRIMARY_IP, &ip);
+   if (!ip || !*ip || strlen(host) >= MAX_HOST || strlen(ip) >= MAX_ADDR)
+      goto out;
+
+   if (!entry) {
+      if (ndns == MAX_DNS_ENTRIES)
+         goto out;
+      entry = &dns[ndns++];
+   }
+   strcpy(entry->host, host);
+   entry->port = strtol(port, NULL, 10);
+   strcpy(entry->addr, ip);
+   entry->expires = now + ttl;
+
+out:
+   curl_free(host);
+   curl_free(port);
+   curl_url_cleanup(url);
+}
@@ -0,0 +1,259 @@
+// vim:set et ts=3 sw=3:
+//  _____ _         _____                                 _       
+// |  __ (_)       |  __ \                               | |      
+// | |__) | _ __   | |__) |_ _ _   _ _ __ ___   ___ _ __ | |_ ___ 
+// |  ___/ | '_ \  |  ___/ _` | | | | '_ ` _ \ / _ \ '_ \| __/ __|
+// | |   | | | | | | |  | (_| | |_| | | | | | |  __/ | | | |_\__ \
+// |_|   |_|_| |_| |_|   \__,_|\__, |_| |_| |_|\___|_| |_|\__|___/
+//                              __/ |                             
+//                             |___/                              
+// Copyright (C) 2018 Pin Payments
+// http://pinpayments.com
+// 
+// This software is provided 'as-is', without any express or implied
+// warranty.  In no event will the authors be held liable for any damages
+// arising from the use of this software.
+// 
+// Permission is granted to anyone to use this software for any purpose,
+// including commercial applications, and to alter it and redistribute it
+// freely, subject to the following restrictions:
+// 
+// 1. The origin of this software must not be misrepresented; you must not
+//    claim that you wrote the original software. If you use this software
+//    in a product, an acknowledgment in the product documentation would be
+//    appreciated but is not required.
+// 2. Altered source versions must be plainly marked as such, and must not be
+//    misrepresented as being the original software.
+// 3. This notice may not be removed or altered from any source distribution.
+
+#include <dms-clamd.h>
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+#include <fcntl.h>
+#include <netdb.h>
+#include <poll.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+
+/* STATS is a few hundred bytes per pool; anything past this is the
+ * memory statistics at the end, which we read and drop */
+#define CLAMD_REPLY_MAX 4096
+#define CLAMD_HOST_MAX 256
+
+static long long now_us(void) {
+
+   struct timespec ts;
+
+   clock_gettime(CLOCK_MONOTONIC, &ts);
+   return ts.tv_sec * 1000000LL + ts.tv_nsec / 1000;
+}
+
+static int remaining_ms(long long deadline_us) {
+
+   long long left = deadline_us - now_us();
+
+   return left > 0 ? (int)((left + 999) / 1000) : 0;
+}
+
+static int wait_for(int fd, short events, long long deadline_us) {
+
+   struct pollfd pfd;
+   int rv;
+
+   pfd.fd = fd;
+   pfd.events = events;
+   do {
+      rv = poll(&pfd, 1, remaining_ms(deadline_us));
+   } while (rv < 0 && errno == EINTR);
+
+   return rv == 1 ? 0 : 1;
+}
+
+/* "/path/to/clamd.ctl" for a local socket, "host:port" for TCP */
+static int clamd_connect(const char* address, long long deadline_us) {
+
+   struct sockaddr_un sun;
+   struct addrinfo hints;
+   struct addrinfo* res = NULL;
+   char host[CLAMD_HOST_MAX];
+   const char* port;
+   socklen_t len;
+   int err = 0;
+   int fd;
+
+   if (address[0] == '/') {
+      memset(&sun, 0, sizeof(sun));
+      sun.sun_family = AF_UNIX;
+      if (strlen(address) >= sizeof(sun.sun_path))
+         return -1;
+      strcpy(sun.sun_path, address);
+      if ((fd = socket(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0)) < 0)
+         return -1;
+      if (connect(fd, (struct sockaddr*)&sun, sizeof(sun)) < 0 && errno != EINPROGRESS && errno != EAGAIN)
+         goto error;
+   } else {
+      if ((port = strrchr(address, ':')) == NULL || (size_t)(port - address) >= sizeof(host))
+         return -1;
+      memcpy(host, address, (size_t)(port - address));
+      host[port - address] = '\0';
+      port++;
+
+      memset(&hints, 0, sizeof(hints));
+      hints.ai_socktype = SOCK_STREAM;
+      if (getaddrinfo(host, port, &hints, &res) != 0)
+         return -1;
+      if ((fd = socket(res->ai_family, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0)) < 0) {
+         freeaddrinfo(res);
+         return -1;
+      }
+      if (connect(fd, res->ai_addr, res->ai_addrlen) < 0 && errno != EINPROGRESS) {
+         freeaddrinfo(res);
+         goto error;
+      }
+      freeaddrinfo(res);
+   }
+
+   if (wait_for(fd, POLLOUT, deadline_us))
+      goto error;
+   len = sizeof(err);
+   if (getsockopt(fd, SOL_SOCKET, SO_ERROR, &err, &len) < 0 || err != 0)
+      goto error;
+
+   return fd;
+error:
+   close(fd);
+   return -1;
+}
+
+/* Sends one z-command and reads the NUL-terminated reply into buf,
+ * keeping the first size - 1 bytes. Returns the bytes kept, -1 on
+ * failure or when the deadline passes. */
+static ssize_t clamd_command(const char* address, const char* command, char* buf, size_t size, long long deadline_us) {
+
+   char discard[512];
+   size_t have = 0;
+   size_t len = strlen(command) + 1;
+   ssize_t n;
+   char* end;
+   int fd;
+
+   if ((fd = clamd_connect(address, deadline_us)) < 0)
+      return -1;
+
+   while (len > 0) {
+      if ((n = send(fd, command, len, MSG_NOSIGNAL)) < 0) {
+         if (errno == EAGAIN && wait_for(fd, POLLOUT, deadline_us) == 0)
+            continue;
+         goto error;
+      }
+      command += n;
+      len -= (size_t)n;
+   }
+
+   for (;;) {
+      if (wait_for(fd, POLLIN, deadline_us))
+         goto error;
+      if (have < size - 1)
+         n = recv(fd, buf + have, size - 1 - have, 0);
+      else
+         n = recv(fd, discard, sizeof(discard), 0);
+      if (n < 0 && (errno == EAGAIN || errno == EINTR))
+         continue;
+      if (n <= 0)
+         break;
+      if (have < size - 1) {
+         end = memchr(buf + have, '\0', (size_t)n);
+         have += (size_t)n;
+         if (end) {
+            have = (size_t)(end - buf);
+            break;
+         }
+      } else if (memchr(discard, '\0', (size_t)n)) {
+         break;
+      }
+   }
+
+   close(fd);
+   buf[have] = '\0';
+   return (ssize_t)have;
+error:
+   close(fd);
+   return -1;
+}
+
+/* the number after label on the same line, e.g. "idle" in
+ * "THREADS: live 1  idle 0 max 12 idle-timeout 30" */
+static unsigned field(const char* line, const char* label) {
+
+   const char* p = line;
+   size_t len = strlen(label);
+
+   while ((p = strstr(p, label)) != NULL) {
+      if ((p == line || p[-1] == ' ') && p[len] == ' ')
+         return (unsigned)strtoul(p + len, NULL, 10);
+      p += len;
+   }
+   return 0;
+}
+
+/* sums THREADS and QUEUE over every pool, in place */
+static void parse_stats(char* reply, ClamdHealth* health) {
+
+   char* line;
+   char* next;
+
+   for (line = reply; line && *line; line = next) {
+      if ((next = strchr(line, '\n')) != NULL)
+         *next++ = '\0';
+
+      if (strncmp(line, "POOLS:", 6) == 0) {
+         health->pools = (unsigned)strtoul(line + 6, NULL, 10);
+      } else if (strncmp(line, "THREADS:", 8) == 0) {
+         health->threads_live += field(line, "live");
+         health->threads_idle += field(line, "idle");
+         health->threads_max += field(line, "max");
+      } else if (strncmp(line, "QUEUE:", 6) == 0) {
+         health->queue += (unsigned)strtoul(line + 6, NULL, 10);
+      }
+   }
+}
+
+/* Asks clamd at address for zPING and zSTATS, both within budget_ms,
+ * and fills in health from the replies. Nothing is allocated past the
+ * address lookup for TCP. */
+int dms_clamd_probe(const char* address, long budget_ms, ClamdHealth* health) {
+
+   char reply[CLAMD_REPLY_MAX];
+   long long start = now_us();
+   long long deadline_us = start + budget_ms * 1000LL;
+   long long pinged;
+
+   memset(health, 0, sizeof(*health));
+
+   if (clamd_command(address, "zPING", reply, sizeof(reply), deadline_us) < 0
+       || strcmp(reply, "PONG") != 0) {
+      fprintf(stderr, "%s: no PONG within %ldms\n", address, budget_ms);
+      return 1;
+   }
+   pinged = now_us();
+   health->ping_ms = (pinged - start) / 1000.0;
+
+   if (clamd_command(address, "zSTATS", reply, sizeof(reply), deadline_us) < 0) {
+      fprintf(stderr, "%s: no STATS within %ldms\n", address, budget_ms);
+      return 1;
+   }
+   health->stats_ms = (now_us() - pinged) / 1000.0;
+
+   parse_stats(reply, health);
+   if (health->threads_max == 0) {
+      fprintf(stderr, "%s: unexpected STATS reply\n", address);
+      return 1;
+   }
+
+   return 0;
+}
@@ -29,146 +29,430 @@
 #include <dms-crud.h>
 
 #include <stdint.h>
+#include <stdlib.h>
 #include <string.h>
 #include <curl/curl.h>
 #include <jansson.h>
 #include <limits.h>
+#include <strings.h>
+#include <time.h>
+#include <errno.h>
 
 #include <dms.h>
+#include <dms-body.h>
+#include <dms-cache.h>
+#include <dms-ratelimit.h>
+#include <dms-stats.h>
 
 #define MAX_URL 256
-#define MAX_HEADER 64
 #define CURL_TIMEOUT_SECONDS 30
-
-struct download_buffer {
-   void*   buf;
-   size_t  len;
+#define DEADLINE_MIN_ATTEMPT_MS 100
+/* attempts at an API call that keeps being throttled, without a deadline */
+#define THROTTLED_MAX_ATTEMPTS 5
+
+/* seconds an idle connection may sit in the cache and still be reused,
+ * 0 keeps the libcurl default */
+static long conn_max_idle = 0;
+
+/* end-to-end budget of one blocking request in milliseconds, retries
+ * included; 0 makes a single attempt with CURL_TIMEOUT_SECONDS */
+static long deadline_ms = 0;
+
+/* requests the service answered, and those that failed on the way or
+ * with a server error, for the circuit breaker in front of us */
+static unsigned long outcomes_ok = 0;
+static unsigned long outcomes_failed = 0;
+
+/* base URLs, overridable to point at a test server */
+static const char* api_url = DMS_API_URL;
+static const char* check_in_url_base = DMS_CHECK_IN_URL;
+
+/* splits the top-level JSON array of a listing into its objects as the
+ * bytes arrive, so only one snitch is held in memory at a time */
+struct list_stream {
+   dms_crud_list_cb  cb;
+   void*             user;
+   CURL*             curl;
+   int               depth;
+   int               in_string;
+   int               escape;
+   int               stopped;
+   char*             obj;
+   size_t            obj_len;
+   size_t            obj_cap;
+   char              next[MAX_URL * 2];
 };
 
-struct upload_buffer {
-   const void*  buf;
-   size_t		   len;
-   size_t		   pos;
-};
+static int list_emit(struct list_stream* ls) {
 
-static size_t download_data_cb(const void* ptr, size_t size, size_t nmemb, void* user_data) {
+   json_t* val;
+   json_error_t json_err;
+   int rv = 0;
 
-   struct download_buffer* db = (struct download_buffer*) user_data;
-   size_t len = size * nmemb;
-   size_t oldlen;
-   size_t newlen;
-   void* newmem;
-   static const unsigned char zero = 0;
+   val = json_loadb(ls->obj, ls->obj_len, 0, &json_err);
+   ls->obj_len = 0;
+   if (!json_is_object(val)) {
+      json_decref(val);
+      return 0;
+   }
+   rv = ls->cb(val, ls->user);
+   json_decref(val);
+   return rv;
+}
 
-   oldlen = db->len;
-   newlen = oldlen + len;
+static size_t list_data_cb(const void* ptr, size_t size, size_t nmemb, void* user_data) {
 
-   newmem = realloc(db->buf, newlen + 1);
-   if (!newmem)
-      return 0;
+   struct list_stream* ls = (struct list_stream*) user_data;
+   const char* p = ptr;
+   size_t len = size * nmemb;
+   size_t i;
+   char* grown;
+   char c;
+
+   if (dms_body_throttled(ls->curl))
+      return len;
+
+   for (i = 0; i < len; i++) {
+      c = p[i];
+
+      if (ls->depth >= 2 || (ls->depth == 1 && c == '{')) {
+         if (ls->obj_len == ls->obj_cap) {
+            ls->obj_cap = ls->obj_cap ? ls->obj_cap * 2 : 1024;
+            if ((grown = realloc(ls->obj, ls->obj_cap)) == NULL)
+               return 0;
+            ls->obj = grown;
+         }
+         ls->obj[ls->obj_len++] = c;
+      }
 
-   db->buf = newmem;
-   db->len = newlen;
-   memcpy((unsigned char*) db->buf + oldlen, ptr, len);
-   memcpy((unsigned char*) db->buf + newlen, &zero, 1);	/* null terminate */
+      if (ls->in_string) {
+         if (ls->escape)
+            ls->escape = 0;
+         else if (c == '\\')
+            ls->escape = 1;
+         else if (c == '"')
+            ls->in_string = 0;
+         continue;
+      }
+
+      switch (c) {
+      case '"':
+         ls->in_string = 1;
+         break;
+      case '{':
+      case '[':
+         ls->depth++;
+         break;
+      case '}':
+      case ']':
+         ls->depth--;
+         if (ls->depth == 1 && c == '}' && list_emit(ls)) {
+            ls->stopped = 1;
+            return 0;
+         }
+         break;
+      }
+   }
 
    return len;
 }
 
-static size_t upload_data_cb(void *ptr, size_t size, size_t nmemb, void *user_data) {
+/* picks the rel="next" target out of a Link header */
+static size_t list_header_cb(const char* ptr, size_t size, size_t nmemb, void* user_data) {
 
-   struct upload_buffer *ub = (struct upload_buffer *) user_data;
+   struct list_stream* ls = (struct list_stream*) user_data;
    size_t len = size * nmemb;
+   char line[MAX_URL * 4];
+   char* open;
+   char* close;
+   char* comma;
+
+   if (len < 5 || len >= sizeof(line) || strncasecmp(ptr, "Link:", 5) != 0)
+      return len;
+
+   memcpy(line, ptr, len);
+   line[len] = '\0';
+
+   for (open = strchr(line, '<'); open; open = strchr(close, '<')) {
+      if ((close = strchr(open, '>')) == NULL)
+         break;
+      *close++ = '\0';
+      if ((comma = strchr(close, ',')) != NULL)
+         *comma = '\0';
+      if (strstr(close, "rel=\"next\"") && strlen(open + 1) < sizeof(ls->next)) {
+         strcpy(ls->next, open + 1);
+         break;
+      }
+      if (comma == NULL)
+         break;
+      close = comma + 1;
+   }
+
+   return len;
+}
+
+void dms_crud_set_urls(const char* api, const char* check_in) {
+   api_url = api ? api : DMS_API_URL;
+   check_in_url_base = check_in ? check_in : DMS_CHECK_IN_URL;
+}
+
+/* sends everything through a dms-relay at base, e.g. http://relay:8080 */
+void dms_crud_set_relay(const char* base) {
 
-   if (len > ub->len - ub->pos)
-      len = ub->len - ub->pos;
+   static char relay_api_url[MAX_URL];
+   static char relay_check_in_url[MAX_URL];
+   size_t len = strlen(base);
+
+   while (len > 0 && base[len - 1] == '/')
+      len--;
+   snprintf(relay_api_url, sizeof(relay_api_url), "%.*s/v1/snitches", (int)len, base);
+   snprintf(relay_check_in_url, sizeof(relay_check_in_url), "%.*s", (int)len, base);
+
+   api_url = relay_api_url;
+   check_in_url_base = relay_check_in_url;
+}
+
+void dms_crud_set_keepalive(long max_idle) {
+   conn_max_idle = max_idle;
+}
+
+/* Every request starts from a clean handle, so nothing one sets (a
+ * custom method, a POST body, headers, callbacks into a stack frame
+ * long gone) carries over into the next. The live connections and the
+ * DNS and TLS session caches survive a reset. */
+void dms_crud_reset(CURL* curl) {
+
+   curl_easy_reset(curl);
+}
 
-   if (len) {
-      memcpy(ptr, ((unsigned char*)ub->buf) + ub->pos, len);
-      ub->pos += len;
+void dms_crud_set_deadline(long ms) {
+   deadline_ms = ms > 0 ? ms : 0;
+}
+
+static long now_ms(void) {
+
+   struct timespec ts;
+
+   clock_gettime(CLOCK_MONOTONIC, &ts);
+   return ts.tv_sec * 1000L + ts.tv_nsec / 1000000L;
+}
+
+/* the whole budget goes to the transfer, but connecting only gets half
+ * of it so a dead address still leaves time for another attempt; curl
+ * itself splits the connect timeout across the resolved addresses */
+static void setup_timeouts(CURL* curl, long budget_ms) {
+
+   if (budget_ms <= 0) {
+      curl_easy_setopt(curl, CURLOPT_CONNECTTIMEOUT, (long)CURL_TIMEOUT_SECONDS);
+      curl_easy_setopt(curl, CURLOPT_TIMEOUT, (long)CURL_TIMEOUT_SECONDS);
+      return;
+   }
+   curl_easy_setopt(curl, CURLOPT_CONNECTTIMEOUT_MS, budget_ms > 1 ? budget_ms / 2 : 1L);
+   curl_easy_setopt(curl, CURLOPT_TIMEOUT_MS, budget_ms);
+}
+
+static void setup_connection(CURL* curl) {
+
+   dms_cache_apply(curl);
+   setup_timeouts(curl, deadline_ms);
+
+   curl_easy_setopt(curl, CURLOPT_TCP_KEEPALIVE, 1L);
+   if (conn_max_idle > 0) {
+      curl_easy_setopt(curl, CURLOPT_TCP_KEEPIDLE, conn_max_idle < 60 ? conn_max_idle : 60L);
+      curl_easy_setopt(curl, CURLOPT_MAXAGE_CONN, conn_max_idle);
    }
+}
 
-   return len;
+/* seconds a 429 asked us to hold off for, 0 if it didn't say */
+static long retry_after(CURL* curl) {
+
+#if LIBCURL_VERSION_NUM >= 0x074200
+   curl_off_t secs = 0;
+
+   if (curl_easy_getinfo(curl, CURLINFO_RETRY_AFTER, &secs) == CURLE_OK && secs > 0)
+      return (long)secs;
+#endif
+   return 0;
 }
 
-static int seek_data_cb(void *user_data, curl_off_t offset, int origin) {
+/* every finished attempt ends up here */
+static void record(CURL* curl, StatsOp op, CURLcode rc) {
 
-   struct upload_buffer *ub = (struct upload_buffer *) user_data;
+   long http_status = 0;
 
-   switch (origin) {
-   case SEEK_SET:
-      ub->pos = (size_t) offset;
-      break;
-   case SEEK_CUR:
-      ub->pos += (size_t) offset;
-      break;
-   case SEEK_END:
-      ub->pos = ub->len + (size_t) offset;
-      break;
+   dms_cache_record(curl, rc);
+   dms_stats_record(curl, op, rc);
+
+   if (rc == CURLE_OK)
+      curl_easy_getinfo(curl, CURLINFO_RESPONSE_CODE, &http_status);
+   if (rc != CURLE_OK || http_status == 429 || http_status >= 500)
+      outcomes_failed++;
+   else
+      outcomes_ok++;
+
+   /* only the API is rate limited, check-ins go elsewhere */
+   if (op != STATS_CHECK_IN && rc == CURLE_OK)
+      dms_ratelimit_feedback(http_status, http_status == 429 ? retry_after(curl) : 0);
+}
+
+void dms_crud_outcomes(unsigned long* ok, unsigned long* failed) {
+   *ok = outcomes_ok;
+   *failed = outcomes_failed;
+}
+
+/* worth another go: the network failed us, or the service said so */
+static int retryable(CURL* curl, CURLcode rc, int idempotent) {
+
+   long http_status = 0;
+   long sent = 0;
+
+   switch (rc) {
+   case CURLE_OK:
+      curl_easy_getinfo(curl, CURLINFO_RESPONSE_CODE, &http_status);
+      /* a throttled request was turned away, even a create can go again */
+      if (http_status == 429)
+         return 1;
+      return idempotent && http_status >= 500;
+   case CURLE_COULDNT_RESOLVE_HOST:
+   case CURLE_COULDNT_CONNECT:
+   case CURLE_OPERATION_TIMEDOUT:
+   case CURLE_SSL_CONNECT_ERROR:
+   case CURLE_SEND_ERROR:
+   case CURLE_RECV_ERROR:
+   case CURLE_GOT_NOTHING:
+   case CURLE_PARTIAL_FILE:
+      if (idempotent)
+         return 1;
+      /* anything else is only safe to repeat if it never left */
+      curl_easy_getinfo(curl, CURLINFO_REQUEST_SIZE, &sent);
+      return sent == 0;
    default:
-      return 1; /* CURL_SEEKFUNC_FAIL */
+      return 0;
    }
+}
 
-   return 0; /* CURL_SEEKFUNC_OK */
+static int throttled(CURL* curl, CURLcode rc) {
+   return rc == CURLE_OK && dms_body_throttled(curl);
 }
 
-static void download_buffer_free(struct download_buffer* db) {
-   if (db && db->len) {
-      free(db->buf);
-      memset(db, 0, sizeof(*db));
+/* Runs a blocking request inside the deadline. Each attempt gets the
+ * budget that is left, failures that are safe to repeat are retried
+ * after a short jittered pause. API calls also wait for the shared
+ * rate limiter, and are retried when throttled even without a
+ * deadline. Attempts before the last are recorded here, the last one
+ * is left to the caller. */
+static CURLcode perform_within_deadline(CURL* curl, StatsOp op, int idempotent) {
+
+   struct timespec pause;
+   long start = now_ms();
+   long left;
+   long wait_ms;
+   int attempt;
+   CURLcode rc;
+
+   for (attempt = 0; ; attempt++) {
+      if (op != STATS_CHECK_IN
+          && dms_ratelimit_wait(deadline_ms ? deadline_ms - (now_ms() - start) : -1L))
+         return CURLE_OPERATION_TIMEDOUT;
+
+      rc = curl_easy_perform(curl);
+
+      if (!retryable(curl, rc, idempotent))
+         return rc;
+
+      if (deadline_ms == 0) {
+         /* the limiter above does the backing off */
+         if (op == STATS_CHECK_IN || !throttled(curl, rc) || attempt + 1 >= THROTTLED_MAX_ATTEMPTS)
+            return rc;
+         record(curl, op, rc);
+         continue;
+      }
+
+      /* 50ms, 100ms, 200ms... with jitter, never more than a quarter
+       * of what is left */
+      left = deadline_ms - (now_ms() - start);
+      wait_ms = (50L << (attempt < 6 ? attempt : 6)) / 2;
+      wait_ms += rand() % (wait_ms + 1);
+      if (wait_ms > left / 4)
+         wait_ms = left / 4;
+      if (left - wait_ms < DEADLINE_MIN_ATTEMPT_MS)
+         return rc;
+
+      record(curl, op, rc);
+
+      pause.tv_sec = wait_ms / 1000;
+      pause.tv_nsec = (wait_ms % 1000) * 1000000L;
+      while (nanosleep(&pause, &pause) && errno == EINTR)
+         ;
+
+      /* an address that refused us is not tried again */
+      dms_cache_apply(curl);
+      setup_timeouts(curl, left - wait_ms);
    }
 }
 
-json_t* dms_crud_create(CURL* curl, const char* pass, const char* req, const int* verbose) {
+static CURLcode perform(CURL* curl, StatsOp op, int idempotent) {
 
-   char hdr_len[MAX_HEADER];
-   struct download_buffer download_data = { 0 };
-   struct upload_buffer upload_data;
-   struct curl_slist* headers = NULL;
-   json_t* val = NULL;
-   json_error_t json_err;
-   char* res_buf;
-   char curl_err_str[CURL_ERROR_SIZE] = { 0 };
-   long http_status;
-   int rc = 0;
+   CURLcode rc = perform_within_deadline(curl, op, idempotent);
+
+   record(curl, op, rc);
+   return rc;
+}
 
+/* the same two headers on every create, and never freed by curl, so
+ * they need not be built for each request */
+static char create_content_type[] = "Content-Type: application/json";
+static char create_user_agent[] = "User-Agent: dms";
+static struct curl_slist create_headers[] = {
+   { create_content_type, &create_headers[1] },
+   { create_user_agent, NULL }
+};
+
+/* everything a create needs but where the response goes */
+static void create_prepare(CURL* curl, const char* pass, const char* req, const int* verbose) {
+
+   dms_crud_reset(curl);
    if (verbose) {
-      curl_easy_setopt(curl, CURLOPT_VERBOSE, (*verbose));
+      curl_easy_setopt(curl, CURLOPT_VERBOSE, (long)(*verbose));
    }
 
-   curl_easy_setopt(curl, CURLOPT_SSL_VERIFYPEER, 1);
-   curl_easy_setopt(curl, CURLOPT_NOSIGNAL, 1);
-   curl_easy_setopt(curl, CURLOPT_WRITEFUNCTION, download_data_cb);
-   curl_easy_setopt(curl, CURLOPT_WRITEDATA, &download_data);
-   curl_easy_setopt(curl, CURLOPT_READFUNCTION, upload_data_cb);
-   curl_easy_setopt(curl, CURLOPT_READDATA, &upload_data);
-   curl_easy_setopt(curl, CURLOPT_SEEKFUNCTION, seek_data_cb);
-   curl_easy_setopt(curl, CURLOPT_SEEKDATA, &upload_data);
-   curl_easy_setopt(curl, CURLOPT_CONNECTTIMEOUT, CURL_TIMEOUT_SECONDS);
-   curl_easy_setopt(curl, CURLOPT_TIMEOUT, CURL_TIMEOUT_SECONDS);
-   curl_easy_setopt(curl, CURLOPT_ERRORBUFFER, curl_err_str);
+   curl_easy_setopt(curl, CURLOPT_SSL_VERIFYPEER, 1L);
+   curl_easy_setopt(curl, CURLOPT_NOSIGNAL, 1L);
+   setup_connection(curl);
 
    if (pass) {
       curl_easy_setopt(curl, CURLOPT_USERPWD, pass);
       curl_easy_setopt(curl, CURLOPT_HTTPAUTH, CURLAUTH_BASIC);
    }
 
-   curl_easy_setopt(curl, CURLOPT_POST, 1);
-   curl_easy_setopt(curl, CURLOPT_URL, DMS_API_URL);
+   curl_easy_setopt(curl, CURLOPT_POST, 1L);
+   curl_easy_setopt(curl, CURLOPT_URL, api_url);
+
+   /* sent from req itself, so a retried attempt sends it again */
+   curl_easy_setopt(curl, CURLOPT_POSTFIELDS, req);
+   curl_easy_setopt(curl, CURLOPT_POSTFIELDSIZE, (long)strlen(req));
+
+   /* POSTFIELDSIZE takes care of Content-Length */
+   curl_easy_setopt(curl, CURLOPT_HTTPHEADER, create_headers);
+}
 
-   upload_data.buf = req;
-   upload_data.len = strlen(req);
-   upload_data.pos = 0;
+json_t* dms_crud_create(CURL* curl, const char* pass, const char* req, const int* verbose) {
 
-   curl_easy_setopt(curl, CURLOPT_POSTFIELDSIZE, upload_data.len);
+   DownloadBuffer download_data;
+   json_t* val = NULL;
+   json_error_t json_err;
+   char curl_err_str[CURL_ERROR_SIZE] = { 0 };
+   long http_status;
+   int rc = 0;
 
-   headers = curl_slist_append(headers, "Content-Type: application/json");
-   headers = curl_slist_append(headers, hdr_len);
-   headers = curl_slist_append(headers, "User-Agent: dms");
+   create_prepare(curl, pass, req, verbose);
 
-   curl_easy_setopt(curl, CURLOPT_HTTPHEADER, headers);
+   dms_body_init(&download_data, curl);
+   curl_easy_setopt(curl, CURLOPT_WRITEFUNCTION, dms_body_download_cb);
+   curl_easy_setopt(curl, CURLOPT_WRITEDATA, &download_data);
+   curl_easy_setopt(curl, CURLOPT_ERRORBUFFER, curl_err_str);
 
-   rc = curl_easy_perform(curl);
+   rc = perform(curl, STATS_CREATE, 0);
    if (rc) {
       curl_easy_getinfo(curl, CURLINFO_RESPONSE_CODE, &http_status);
       if (http_status == 404) {
@@ -182,49 +466,408 @@ json_t* dms_crud_create(CURL* curl, const char* pass, const char* req, const int
 
    val = json_loads(download_data.buf, 0, &json_err);
 
-   curl_slist_free_all(headers);
-   download_buffer_free(&download_data);
+   /* both live in this frame */
+   curl_easy_setopt(curl, CURLOPT_ERRORBUFFER, NULL);
+   curl_easy_setopt(curl, CURLOPT_WRITEDATA, NULL);
+   dms_body_free(&download_data);
 
    return val;
 }
 
-int dms_crud_check_in(CURL* curl, const char* token, const int* verbose) {
+/* Creates a snitch and copies its token into token, without building
+ * the response as JSON or holding it anywhere. */
+int dms_crud_create_token(CURL* curl, const char* pass, const char* req, char* token, size_t size, const int* verbose) {
+
+   TokenStream ts;
+   long http_status = 0;
+   CURLcode rc;
+
+   create_prepare(curl, pass, req, verbose);
+
+   dms_token_stream_init(&ts, curl, token, size);
+   curl_easy_setopt(curl, CURLOPT_WRITEFUNCTION, dms_token_stream_cb);
+   curl_easy_setopt(curl, CURLOPT_WRITEDATA, &ts);
+
+   rc = perform(curl, STATS_CREATE, 0);
+   curl_easy_setopt(curl, CURLOPT_WRITEDATA, NULL);
+
+   if (rc != CURLE_OK) {
+      fprintf(stderr, "HTTP request failed: %s\n", curl_easy_strerror(rc));
+      return 1;
+   }
+   curl_easy_getinfo(curl, CURLINFO_RESPONSE_CODE, &http_status);
+   if (http_status != 201) {
+      fprintf(stderr, "Unexpected HTTP status %ld\n", http_status);
+      return 1;
+   }
+   if (!ts.found) {
+      fprintf(stderr, ts.overflow ? "token is larger than supported size\n" : "token is not a string\n");
+      return 1;
+   }
+
+   return 0;
+}
+
+/* A create on a handle the caller drives, the token streaming into
+ * token as it does for dms_crud_create_token. *stream carries the state
+ * of the transfer over to dms_crud_create_done, which releases it. */
+int dms_crud_create_setup(CURL* curl, const char* pass, const char* req, char* token, size_t size, void** stream, const int* verbose) {
+
+   TokenStream* ts;
+
+   if ((ts = malloc(sizeof(*ts))) == NULL)
+      return 1;
+
+   create_prepare(curl, pass, req, verbose);
+
+   dms_token_stream_init(ts, curl, token, size);
+   curl_easy_setopt(curl, CURLOPT_WRITEFUNCTION, dms_token_stream_cb);
+   curl_easy_setopt(curl, CURLOPT_WRITEDATA, ts);
+   *stream = ts;
+
+   return 0;
+}
+
+int dms_crud_create_done(CURL* curl, CURLcode rc, void* stream) {
+
+   TokenStream* ts = (TokenStream*) stream;
+   long http_status = 0;
+   int found = ts->found;
+   int overflow = ts->overflow;
+
+   curl_easy_setopt(curl, CURLOPT_WRITEDATA, NULL);
+   free(ts);
+   record(curl, STATS_CREATE, rc);
+
+   if (rc != CURLE_OK) {
+      fprintf(stderr, "HTTP request failed: %s\n", curl_easy_strerror(rc));
+      return rc;
+   }
+   curl_easy_getinfo(curl, CURLINFO_RESPONSE_CODE, &http_status);
+   if (http_status != 201) {
+      fprintf(stderr, "Unexpected HTTP status %ld\n", http_status);
+      return 1;
+   }
+   if (!found) {
+      fprintf(stderr, overflow ? "token is larger than supported size\n" : "token is not a string\n");
+      return 1;
+   }
+
+   return 0;
+}
+
+/* check-ins answer with a line of text nobody needs to see */
+static size_t discard_cb(const void* ptr, size_t size, size_t nmemb, void* user_data) {
+
+   return size * nmemb;
+}
+
+static void check_in_prepare(CURL* curl, const char* url, const int* verbose) {
+
+   dms_crud_reset(curl);
+   if (verbose) {
+      curl_easy_setopt(curl, CURLOPT_VERBOSE, (long)(*verbose));
+   }
+   curl_easy_setopt(curl, CURLOPT_URL, url);
+   curl_easy_setopt(curl, CURLOPT_WRITEFUNCTION, discard_cb);
+   curl_easy_setopt(curl, CURLOPT_NOSIGNAL, 1L);
+   setup_connection(curl);
+}
+
+int dms_crud_check_in_setup(CURL* curl, const char* token, const int* verbose) {
 
    char check_in_url[MAX_URL];
-   long http_status;
+
+   snprintf(check_in_url, MAX_URL, "%s/%s", check_in_url_base, token);
+   check_in_prepare(curl, check_in_url, verbose);
+
+   return 0;
+}
+
+int dms_crud_check_in_done(CURL* curl, CURLcode rc) {
+
+   long http_status = 0;
+
+   record(curl, STATS_CHECK_IN, rc);
+
+   if (rc != CURLE_OK) {
+      fprintf(stderr, "HTTP request failed: %s\n", curl_easy_strerror(rc));
+      return rc;
+   }
+
+   curl_easy_getinfo(curl, CURLINFO_RESPONSE_CODE, &http_status);
+   if (http_status != 202) {
+      fprintf(stderr, "Unexpected HTTP status %ld\n", http_status);
+      return 1;
+   }
+
+   return 0;
+}
+
+/* A check-in carrying a message (m=) and the exit status (s=) of
+ * whatever it reports on, both shown with the check-in on DMS. A non-zero
+ * status makes DMS treat the check-in as a failure. */
+int dms_crud_check_in_message(CURL* curl, const char* token, const char* message, int exit_status, const int* verbose) {
+
+   char check_in_url[MAX_URL * 4];
+   char* escaped;
+
+   if ((escaped = curl_easy_escape(curl, message, 0)) == NULL) {
+      fprintf(stderr, "out of memory\n");
+      return 1;
+   }
+   snprintf(check_in_url, sizeof(check_in_url), "%s/%s?m=%s&s=%d",
+            check_in_url_base, token, escaped, exit_status);
+   curl_free(escaped);
+
+   check_in_prepare(curl, check_in_url, verbose);
+
+   return dms_crud_check_in_done(curl, perform_within_deadline(curl, STATS_CHECK_IN, 1));
+}
+
+/* A HEAD on the check-in host, outside any snitch, so the connection and
+ * TLS session are in place on curl for the check-in that follows. Not a
+ * check-in itself and not recorded; any response will do. */
+int dms_crud_check_in_warm(CURL* curl, const int* verbose) {
+
+   char url[MAX_URL];
+   CURLcode rc;
+
+   snprintf(url, sizeof(url), "%s/", check_in_url_base);
+   check_in_prepare(curl, url, verbose);
+   curl_easy_setopt(curl, CURLOPT_NOBODY, 1L);
+   rc = curl_easy_perform(curl);
+   curl_easy_setopt(curl, CURLOPT_NOBODY, 0L);
+   curl_easy_setopt(curl, CURLOPT_HTTPGET, 1L);
+
+   return rc != CURLE_OK;
+}
+
+int dms_crud_check_in(CURL* curl, const char* token, const int* verbose) {
+
+   dms_crud_check_in_setup(curl, token, verbose);
+
+   return dms_crud_check_in_done(curl, perform_within_deadline(curl, STATS_CHECK_IN, 1));
+}
+
+/* Streams every snitch carrying all of tags (comma separated, NULL for
+ * any) to cb, following the API's rel="next" links page by page. A
+ * non-zero return from cb stops the listing early without an error. */
+int dms_crud_list(CURL* curl, const char* pass, const char* tags, dms_crud_list_cb cb, void* user, const int* verbose) {
+
+   struct list_stream ls;
+   char url[MAX_URL * 2];
+   char* escaped = NULL;
+   long http_status = 0;
+   CURLcode rc;
+   int rv = 0;
+
+   memset(&ls, 0, sizeof(ls));
+   ls.cb = cb;
+   ls.user = user;
+   ls.curl = curl;
+
+   if (tags && *tags) {
+      escaped = curl_easy_escape(curl, tags, 0);
+      snprintf(url, sizeof(url), "%s?tags=%s", api_url, escaped);
+      curl_free(escaped);
+   } else {
+      snprintf(url, sizeof(url), "%s", api_url);
+   }
+
+   dms_crud_reset(curl);
+   while (url[0]) {
+      if (verbose) {
+         curl_easy_setopt(curl, CURLOPT_VERBOSE, (long)(*verbose));
+      }
+      if (pass) {
+         curl_easy_setopt(curl, CURLOPT_USERPWD, pass);
+         curl_easy_setopt(curl, CURLOPT_HTTPAUTH, CURLAUTH_BASIC);
+      }
+      curl_easy_setopt(curl, CURLOPT_URL, url);
+      curl_easy_setopt(curl, CURLOPT_SSL_VERIFYPEER, 1L);
+      curl_easy_setopt(curl, CURLOPT_NOSIGNAL, 1L);
+      setup_connection(curl);
+      curl_easy_setopt(curl, CURLOPT_WRITEFUNCTION, list_data_cb);
+      curl_easy_setopt(curl, CURLOPT_WRITEDATA, &ls);
+      curl_easy_setopt(curl, CURLOPT_HEADERFUNCTION, list_header_cb);
+      curl_easy_setopt(curl, CURLOPT_HEADERDATA, &ls);
+
+      ls.next[0] = '\0';
+      ls.depth = ls.in_string = ls.escape = 0;
+      ls.obj_len = 0;
+
+      /* pages stream into the callback, a retry must not repeat one.
+       * The write error from the callback stopping us early is our
+       * doing, not the server's, and must not count as a failure. */
+      rc = perform_within_deadline(curl, STATS_LIST, 0);
+      if (ls.stopped && rc == CURLE_WRITE_ERROR)
+         rc = CURLE_OK;
+      record(curl, STATS_LIST, rc);
+      curl_easy_getinfo(curl, CURLINFO_RESPONSE_CODE, &http_status);
+
+      if (ls.stopped)
+         break;
+      if (rc != CURLE_OK) {
+         fprintf(stderr, "HTTP request failed: %s\n", curl_easy_strerror(rc));
+         rv = rc;
+         break;
+      }
+      if (http_status != 200) {
+         fprintf(stderr, "Unexpected HTTP status %ld\n", http_status);
+         rv = 1;
+         break;
+      }
+
+      memcpy(url, ls.next, sizeof(ls.next));
+   }
+
+   /* the callbacks point into this frame, don't leave them on the handle */
+   curl_easy_setopt(curl, CURLOPT_WRITEFUNCTION, NULL);
+   curl_easy_setopt(curl, CURLOPT_WRITEDATA, NULL);
+   curl_easy_setopt(curl, CURLOPT_HEADERFUNCTION, NULL);
+   curl_easy_setopt(curl, CURLOPT_HEADERDATA, NULL);
+
+   free(ls.obj);
+   return rv;
+}
+
+/* the body and ETag of the last response a get saw, earlier attempts
+ * are dropped as the next one's status line comes in */
+struct get_response {
+   DownloadBuffer          body;
+   char*                   etag;
+   size_t                  etag_size;
+};
+
+static size_t get_header_cb(const char* ptr, size_t size, size_t nmemb, void* user_data) {
+
+   struct get_response* gr = (struct get_response*) user_data;
+   size_t len = size * nmemb;
+   size_t n;
+
+   if (len >= 5 && strncmp(ptr, "HTTP/", 5) == 0) {
+      gr->body.len = 0;
+      gr->etag[0] = '\0';
+      return len;
+   }
+   if (len < 5 || strncasecmp(ptr, "ETag:", 5) != 0)
+      return len;
+
+   ptr += 5;
+   len -= 5;
+   while (len > 0 && (*ptr == ' ' || *ptr == '\t')) {
+      ptr++;
+      len--;
+   }
+   for (n = len; n > 0 && (ptr[n - 1] == '\r' || ptr[n - 1] == '\n' || ptr[n - 1] == ' '); n--)
+      ;
+   /* one too long to send back is as good as none */
+   if (n < gr->etag_size) {
+      memcpy(gr->etag, ptr, n);
+      gr->etag[n] = '\0';
+   }
+
+   return size * nmemb;
+}
+
+/* Fetches the snitch behind token into *snitch, and its ETag into
+ * etag_out. Given the ETag of an earlier copy, asks only for changes:
+ * a 304 leaves *snitch NULL and etag_out as it was. Bodies come
+ * compressed when the server is willing. */
+int dms_crud_get(CURL* curl, const char* pass, const char* token, const char* etag,
+                 json_t** snitch, char* etag_out, size_t etag_size, const int* verbose) {
+
+   struct get_response gr;
+   struct curl_slist* headers = NULL;
+   char get_url[MAX_URL];
+   char if_none_match[MAX_URL];
+   char fresh_etag[MAX_URL];
+   json_error_t json_err;
+   long http_status = 0;
+   CURLcode rc;
    int rv = 0;
 
-   snprintf(check_in_url, MAX_URL, "https://nosnch.in/%s", token);
+   *snitch = NULL;
+   snprintf(get_url, MAX_URL, "%s/%s", api_url, token);
 
+   dms_crud_reset(curl);
    if (verbose) {
-      curl_easy_setopt(curl, CURLOPT_VERBOSE, (*verbose));
+      curl_easy_setopt(curl, CURLOPT_VERBOSE, (long)(*verbose));
+   }
+
+   if (pass) {
+      curl_easy_setopt(curl, CURLOPT_USERPWD, pass);
+      curl_easy_setopt(curl, CURLOPT_HTTPAUTH, CURLAUTH_BASIC);
+   }
+
+   curl_easy_setopt(curl, CURLOPT_URL, get_url);
+   curl_easy_setopt(curl, CURLOPT_SSL_VERIFYPEER, 1L);
+   curl_easy_setopt(curl, CURLOPT_NOSIGNAL, 1L);
+   setup_connection(curl);
+   curl_easy_setopt(curl, CURLOPT_ACCEPT_ENCODING, "gzip");
+
+   if (etag && *etag) {
+      snprintf(if_none_match, sizeof(if_none_match), "If-None-Match: %s", etag);
+      if ((headers = curl_slist_append(NULL, if_none_match)) == NULL)
+         return 1;
+      curl_easy_setopt(curl, CURLOPT_HTTPHEADER, headers);
+   }
+
+   dms_body_init(&gr.body, curl);
+   gr.etag = fresh_etag;
+   gr.etag_size = sizeof(fresh_etag);
+   fresh_etag[0] = '\0';
+   curl_easy_setopt(curl, CURLOPT_WRITEFUNCTION, dms_body_download_cb);
+   curl_easy_setopt(curl, CURLOPT_WRITEDATA, &gr.body);
+   curl_easy_setopt(curl, CURLOPT_HEADERFUNCTION, get_header_cb);
+   curl_easy_setopt(curl, CURLOPT_HEADERDATA, &gr);
+
+   rc = perform(curl, STATS_GET, 1);
+
+   /* all of these live in this frame */
+   curl_easy_setopt(curl, CURLOPT_HTTPHEADER, NULL);
+   curl_easy_setopt(curl, CURLOPT_WRITEDATA, NULL);
+   curl_easy_setopt(curl, CURLOPT_HEADERFUNCTION, NULL);
+   curl_easy_setopt(curl, CURLOPT_HEADERDATA, NULL);
+   curl_slist_free_all(headers);
+
+   if (rc != CURLE_OK) {
+      fprintf(stderr, "HTTP request failed: %s\n", curl_easy_strerror(rc));
+      rv = rc;
+      goto out;
    }
-   curl_easy_setopt(curl, CURLOPT_URL, check_in_url);
-   curl_easy_setopt(curl, CURLOPT_NOSIGNAL, 1);
-   curl_easy_setopt(curl, CURLOPT_CONNECTTIMEOUT, CURL_TIMEOUT_SECONDS);
-   curl_easy_setopt(curl, CURLOPT_TIMEOUT, CURL_TIMEOUT_SECONDS);
 
-   rv = curl_easy_perform(curl);
    curl_easy_getinfo(curl, CURLINFO_RESPONSE_CODE, &http_status);
-   if (http_status != 202) {
+   if (http_status == 304 && etag && *etag) {
+      goto out;
+   }
+   if (http_status != 200) {
       fprintf(stderr, "Unexpected HTTP status %ld\n", http_status);
-      return rv;
+      rv = 1;
+      goto out;
    }
+   if (!gr.body.buf || (*snitch = json_loads(gr.body.buf, 0, &json_err)) == NULL) {
+      fprintf(stderr, "No data received from DMS\n");
+      rv = 1;
+      goto out;
+   }
+   snprintf(etag_out, etag_size, "%s", fresh_etag);
 
+out:
+   dms_body_free(&gr.body);
    return rv;
 }
 
-int dms_crud_delete(CURL* curl, const char* pass, const char* token, const int* verbose) {
+int dms_crud_delete_setup(CURL* curl, const char* pass, const char* token, const int* verbose) {
  
    char delete_url[MAX_URL]; 
-   char curl_err_str[CURL_ERROR_SIZE] = { 0 };
-   long http_status;
-   int rc = 0;
 
-   snprintf(delete_url, MAX_URL, "%s/%s", DMS_API_URL, token);
+   snprintf(delete_url, MAX_URL, "%s/%s", api_url, token);
 
+   dms_crud_reset(curl);
    if (verbose) {
-      curl_easy_setopt(curl, CURLOPT_VERBOSE, (*verbose));
+      curl_easy_setopt(curl, CURLOPT_VERBOSE, (long)(*verbose));
    }
 
    if (pass) {
@@ -234,33 +877,49 @@ int dms_crud_delete(CURL* curl, const char* pass, const char* token, const int*
 
    curl_easy_setopt(curl, CURLOPT_URL, delete_url);
    curl_easy_setopt(curl, CURLOPT_CUSTOMREQUEST, "DELETE");
-   curl_easy_setopt(curl, CURLOPT_SSL_VERIFYPEER, 1);
-   curl_easy_setopt(curl, CURLOPT_NOSIGNAL, 1);
-   curl_easy_setopt(curl, CURLOPT_CONNECTTIMEOUT, CURL_TIMEOUT_SECONDS);
-   curl_easy_setopt(curl, CURLOPT_TIMEOUT, CURL_TIMEOUT_SECONDS);
+   curl_easy_setopt(curl, CURLOPT_SSL_VERIFYPEER, 1L);
+   curl_easy_setopt(curl, CURLOPT_NOSIGNAL, 1L);
+   setup_connection(curl);
+
+   return 0;
+}
+
+int dms_crud_delete_done(CURL* curl, CURLcode rc) {
+
+   long http_status = 0;
+
+   record(curl, STATS_DELETE, rc);
+
+   if (rc != CURLE_OK) {
+      fprintf(stderr, "HTTP request failed: %s\n", curl_easy_strerror(rc));
+      return rc;
+   }
 
-   rc = curl_easy_perform(curl);
    curl_easy_getinfo(curl, CURLINFO_RESPONSE_CODE, &http_status);
-   if (rc) {
-      if (http_status == 404) {
-         fprintf(stderr, "HTTP request failed: %s\n", curl_err_str);
-      }
+   if (http_status < 200 || http_status > 299) {
+      fprintf(stderr, "Unexpected HTTP status %ld\n", http_status);
+      return 1;
    }
 
-   return rc;
+   return 0;
 }
 
-int dms_crud_pause(CURL* curl, const char* pass, const char* token, const int* verbose) {
+int dms_crud_delete(CURL* curl, const char* pass, const char* token, const int* verbose) {
+
+   dms_crud_delete_setup(curl, pass, token, verbose);
+
+   return dms_crud_delete_done(curl, perform_within_deadline(curl, STATS_DELETE, 1));
+}
+
+int dms_crud_pause_setup(CURL* curl, const char* pass, const char* token, const int* verbose) {
 
    char pause_url[MAX_URL];
-   char curl_err_str[CURL_ERROR_SIZE] = { 0 };
-   long http_status;
-   int rc = 0;
 
-   snprintf(pause_url, MAX_URL, "%s/%s/pause", DMS_API_URL, token);
+   snprintf(pause_url, MAX_URL, "%s/%s/pause", api_url, token);
 
+   dms_crud_reset(curl);
    if (verbose) {
-      curl_easy_setopt(curl, CURLOPT_VERBOSE, (*verbose));
+      curl_easy_setopt(curl, CURLOPT_VERBOSE, (long)(*verbose));
    }
 
    if (pass) {
@@ -268,21 +927,41 @@ int dms_crud_pause(CURL* curl, const char* pass, const char* token, const int* v
       curl_easy_setopt(curl, CURLOPT_HTTPAUTH, CURLAUTH_BASIC);
    }
 
-   curl_easy_setopt(curl, CURLOPT_POST, 1);
+   curl_easy_setopt(curl, CURLOPT_POST, 1L);
    curl_easy_setopt(curl, CURLOPT_POSTFIELDS, "");
-   curl_easy_setopt(curl, CURLOPT_SSL_VERIFYPEER, 1);
-   curl_easy_setopt(curl, CURLOPT_NOSIGNAL, 1);
-   curl_easy_setopt(curl, CURLOPT_CONNECTTIMEOUT, CURL_TIMEOUT_SECONDS);
-   curl_easy_setopt(curl, CURLOPT_TIMEOUT, CURL_TIMEOUT_SECONDS);
+   curl_easy_setopt(curl, CURLOPT_SSL_VERIFYPEER, 1L);
+   curl_easy_setopt(curl, CURLOPT_NOSIGNAL, 1L);
+   setup_connection(curl);
    curl_easy_setopt(curl, CURLOPT_URL, pause_url);
 
    curl_easy_setopt(curl, CURLOPT_POSTFIELDSIZE, 0L);
 
-   rc = curl_easy_perform(curl);
+   return 0;
+}
+
+int dms_crud_pause_done(CURL* curl, CURLcode rc) {
+
+   long http_status = 0;
+
+   record(curl, STATS_PAUSE, rc);
+
+   if (rc != CURLE_OK) {
+      fprintf(stderr, "HTTP request failed: %s\n", curl_easy_strerror(rc));
+      return rc;
+   }
+
    curl_easy_getinfo(curl, CURLINFO_RESPONSE_CODE, &http_status);
    if (http_status != 204) {
       fprintf(stderr, "Unexpected HTTP status %ld\n", http_status);
+      return 1;
    }
 
-   return rc;
+   return 0;
+}
+
+int dms_crud_pause(CURL* curl, const char* pass, const char* token, const int* verbose) {
+
+   dms_crud_pause_setup(curl, pass, token, verbose);
+
+   return dms_crud_pause_done(curl, perform_within_deadline(curl, STATS_PAUSE, 1));
 }
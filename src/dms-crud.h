@@ -32,9 +32,46 @@
 #include <curl/curl.h>
 #include <jansson.h>
 
+typedef int (*dms_crud_list_cb)(json_t* snitch, void* user);
+
 json_t*  dms_crud_create(CURL* curl, const char* pass, const char* req, const int* verbose);
+int      dms_crud_create_token(CURL* curl, const char* pass, const char* req, char* token, size_t size, const int* verbose);
 int      dms_crud_delete(CURL* curl, const char* pass, const char* token, const int* verbose);
 int      dms_crud_check_in(CURL* curl, const char* token, const int* verbose);
+int      dms_crud_check_in_message(CURL* curl, const char* token, const char* message, int exit_status, const int* verbose);
+int      dms_crud_check_in_warm(CURL* curl, const int* verbose);
 int      dms_crud_pause(CURL* curl, const char* pass, const char* token, const int* verbose);
+int      dms_crud_list(CURL* curl, const char* pass, const char* tags, dms_crud_list_cb cb, void* user, const int* verbose);
+
+/* fetches one snitch; with etag, only if it changed since, leaving
+ * *snitch NULL when it did not */
+int      dms_crud_get(CURL* curl, const char* pass, const char* token, const char* etag,
+                      json_t** snitch, char* etag_out, size_t etag_size, const int* verbose);
+
+/* NULL restores DMS_API_URL and DMS_CHECK_IN_URL; the strings must stay
+ * valid while requests are made */
+void     dms_crud_set_urls(const char* api, const char* check_in);
+
+/* keep connections (and their TLS sessions) around for up to max_idle
+ * seconds between requests on the same handle */
+void     dms_crud_set_keepalive(long max_idle);
+
+/* sends everything through a dms-relay at base */
+void     dms_crud_set_relay(const char* base);
+void     dms_crud_outcomes(unsigned long* ok, unsigned long* failed);
+void     dms_crud_set_deadline(long ms);
+void     dms_crud_reset(CURL* curl);
+
+/* check-in, create, delete and pause split in two, so callers driving
+ * their own transfer (e.g. on a multi handle) share the same request
+ * and status handling */
+int      dms_crud_check_in_setup(CURL* curl, const char* token, const int* verbose);
+int      dms_crud_check_in_done(CURL* curl, CURLcode rc);
+int      dms_crud_create_setup(CURL* curl, const char* pass, const char* req, char* token, size_t size, void** stream, const int* verbose);
+int      dms_crud_create_done(CURL* curl, CURLcode rc, void* stream);
+int      dms_crud_delete_setup(CURL* curl, const char* pass, const char* token, const int* verbose);
+int      dms_crud_delete_done(CURL* curl, CURLcode rc);
+int      dms_crud_pause_setup(CURL* curl, const char* pass, const char* token, const int* verbose);
+int      dms_crud_pause_done(CURL* curl, CURLcode rc);
 
 #endif // DMS_CRUD_H
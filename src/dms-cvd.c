@@ -0,0 +1,131 @@
+// vim:set et ts=3 sw=3:
+//  _____ _         _____                                 _       
+// |  __ (_)       |  __ \                               | |      
+// | |__) | _ __   | |__) |_ _ _   _ _ __ ___   ___ _ __ | |_ ___ 
+// |  ___/ | '_ \  |  ___/ _` | | | | '_ ` _ \ / _ \ '_ \| __/ __|
+// | |   | | | | | | |  | (_| | |_| | | | | | |  __/ | | | |_\__ \
+// |_|   |_|_| |_| |_|   \__,_|\__, |_| |_| |_|\___|_| |_|\__|___/
+//                              __/ |                             
+//                             |___/                              
+// Copyright (C) 2018 Pin Payments
+// http://pinpayments.com
+// 
+// This software is provided 'as-is', without any express or implied
+// warranty.  In no event will the authors be held liable for any damages
+// arising from the use of this software.
+// 
+// Permission is granted to anyone to use this software for any purpose,
+// including commercial applications, and to alter it and redistribute it
+// freely, subject to the following restrictions:
+// 
+// 1. The origin of this software must not be misrepresented; you must not
+//    claim that you wrote the original software. If you use this software
+//    in a product, an acknowledgment in the product documentation would be
+//    appreciated but is not required.
+// 2. Altered source versions must be plainly marked as such, and must not be
+//    misrepresented as being the original software.
+// 3. This notice may not be removed or altered from any source distribution.
+
+#include <dms-cvd.h>
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <limits.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#define CVD_HEADER_LEN 512
+#define CVD_MAGIC "ClamAV-VDB:"
+
+/* Field n of the colon separated header, e.g.
+ * "ClamAV-VDB:07 Mar 2024 07-25 -0500:27206:2055396:90:<md5>:<dsig>:<builder>:1709814314"
+ * (the build time uses '-' between hours and minutes, so it stays one
+ * field). Parsed straight out of the mapping. */
+static unsigned long long header_field(const char* header, int n, int* found) {
+
+   const char* p = header;
+   const char* end = header + CVD_HEADER_LEN;
+   unsigned long long value = 0;
+   int i;
+
+   *found = 0;
+   for (i = 0; i < n; i++) {
+      while (p < end && *p != ':')
+         p++;
+      if (p == end)
+         return 0;
+      p++;
+   }
+   while (p < end && *p == ' ')
+      p++;
+   for (; p < end && *p >= '0' && *p <= '9'; p++) {
+      value = value * 10 + (unsigned long long)(*p - '0');
+      *found = 1;
+   }
+   return value;
+}
+
+/* Maps just the header and nothing of the database behind it. */
+int dms_cvd_read(const char* filename, CvdHeader* header) {
+
+   struct stat st;
+   const char* map;
+   int has_version;
+   int has_stime;
+   int has;
+   int fd;
+
+   if ((fd = open(filename, O_RDONLY | O_CLOEXEC)) < 0)
+      return 1;
+   if (fstat(fd, &st) < 0 || st.st_size < CVD_HEADER_LEN) {
+      close(fd);
+      return 1;
+   }
+   map = mmap(NULL, CVD_HEADER_LEN, PROT_READ, MAP_PRIVATE, fd, 0);
+   close(fd);
+   if (map == MAP_FAILED)
+      return 1;
+
+   if (memcmp(map, CVD_MAGIC, sizeof(CVD_MAGIC) - 1) != 0) {
+      munmap((void*)map, CVD_HEADER_LEN);
+      fprintf(stderr, "%s: not a signature database\n", filename);
+      return 1;
+   }
+
+   header->version = (unsigned)header_field(map, 2, &has_version);
+   header->signatures = (unsigned)header_field(map, 3, &has);
+   header->functionality = (unsigned)header_field(map, 4, &has);
+   header->stime = (long long)header_field(map, 8, &has_stime);
+   munmap((void*)map, CVD_HEADER_LEN);
+
+   if (!has_version || !has_stime) {
+      fprintf(stderr, "%s: malformed header\n", filename);
+      return 1;
+   }
+   return 0;
+}
+
+/* name.cld is what freshclam leaves after applying diffs, name.cvd a
+ * full download; whichever has the higher version is current. */
+int dms_cvd_find(const char* directory, const char* name, CvdHeader* header) {
+
+   static const char* const extensions[] = { "cld", "cvd" };
+   char path[PATH_MAX];
+   CvdHeader candidate;
+   int found = 0;
+   size_t i;
+
+   for (i = 0; i < sizeof(extensions) / sizeof(extensions[0]); i++) {
+      snprintf(path, sizeof(path), "%s/%s.%s", directory, name, extensions[i]);
+      if (dms_cvd_read(path, &candidate))
+         continue;
+      if (!found || candidate.version > header->version)
+         *header = candidate;
+      found = 1;
+   }
+
+   return found ? 0 : 1;
+}
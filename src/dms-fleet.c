@@ -0,0 +1,296 @@
+// vim:set et ts=3 sw=3:
+//  _____ _         _____                                 _       
+// |  __ (_)       |  __ \                               | |      
+// | |__) | _ __   | |__) |_ _ _   _ _ __ ___   ___ _ __ | |_ ___ 
+// |  ___/ | '_ \  |  ___/ _` | | | | '_ ` _ \ / _ \ '_ \| __/ __|
+// | |   | | | | | | |  | (_| | |_| | | | | | |  __/ | | | |_\__ \
+// |_|   |_|_| |_| |_|   \__,_|\__, |_| |_| |_|\___|_| |_|\__|___/
+//                              __/ |                             
+//                             |___/                              
+// Copyright (C) 2018 Pin Payments
+// http://pinpayments.com
+// 
+// This software is provided 'as-is', without any express or implied
+// warranty.  In no event will the authors be held liable for any damages
+// arising from the use of this software.
+// 
+// Permission is granted to anyone to use this software for any purpose,
+// including commercial applications, and to alter it and redistribute it
+// freely, subject to the following restrictions:
+// 
+// 1. The origin of this software must not be misrepresented; you must not
+//    claim that you wrote the original software. If you use this software
+//    in a product, an acknowledgment in the product documentation would be
+//    appreciated but is not required.
+// 2. Altered source versions must be plainly marked as such, and must not be
+//    misrepresented as being the original software.
+// 3. This notice may not be removed or altered from any source distribution.
+
+#include <dms-fleet.h>
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+#include <curl/curl.h>
+
+#include <dms-crud.h>
+#include <dms-ratelimit.h>
+#include <dms-tokens.h>
+
+#define MAX_LINE 512
+#define WAIT_MS_MAX 1000
+/* tries per entry when the API keeps throttling us */
+#define THROTTLED_MAX_ATTEMPTS 5
+
+int dms_fleet_load(const char* filename, FleetEntry** entries, size_t* count) {
+
+   FILE* file;
+   char line[MAX_LINE];
+   FleetEntry* list = NULL;
+   FleetEntry* grown;
+   size_t n = 0;
+   size_t cap = 0;
+   char* tok;
+
+   if ((file = fopen(filename, "r")) == NULL) {
+      fprintf(stderr, "%s is missing or unreadable\n", filename);
+      return 1;
+   }
+
+   while (fgets(line, sizeof(line), file)) {
+      tok = line + strspn(line, " \t");
+      tok[strcspn(tok, " \t\r\n")] = '\0';
+      /* blank lines and comments */
+      if (*tok == '\0' || *tok == '#')
+         continue;
+
+      if (n == cap) {
+         cap = cap ? cap * 2 : 64;
+         if ((grown = realloc(list, cap * sizeof(*list))) == NULL) {
+            fprintf(stderr, "out of memory\n");
+            goto error;
+         }
+         list = grown;
+      }
+      memset(&list[n], 0, sizeof(list[n]));
+      if ((list[n].token = strdup(tok)) == NULL) {
+         fprintf(stderr, "out of memory\n");
+         goto error;
+      }
+      n++;
+   }
+   fclose(file);
+
+   *entries = list;
+   *count = n;
+   return 0;
+error:
+   fclose(file);
+   dms_fleet_free(list, n);
+   return 1;
+}
+
+void dms_fleet_free(FleetEntry* entries, size_t count) {
+
+   size_t i;
+
+   for (i = 0; i < count; i++) {
+      free(entries[i].token);
+      free(entries[i].request);
+   }
+   free(entries);
+}
+
+static int fleet_start(CURLM* multi, CURL* curl, FleetOp op, const char* pass, FleetEntry* entries, size_t i, const int* verbose) {
+
+   switch (op) {
+   case FLEET_CHECK_IN:
+      dms_crud_check_in_setup(curl, entries[i].token, verbose);
+      break;
+   case FLEET_PAUSE:
+      dms_crud_pause_setup(curl, pass, entries[i].token, verbose);
+      break;
+   case FLEET_DELETE:
+      dms_crud_delete_setup(curl, pass, entries[i].token, verbose);
+      break;
+   case FLEET_CREATE:
+      entries[i].token[0] = '\0';
+      if (dms_crud_create_setup(curl, pass, entries[i].request, entries[i].token, TOKEN_VALUE_LEN,
+                                &entries[i].stream, verbose))
+         return 1;
+      break;
+   }
+   curl_easy_setopt(curl, CURLOPT_PRIVATE, (void*)&entries[i]);
+
+   if (curl_multi_add_handle(multi, curl) != CURLM_OK) {
+      if (op == FLEET_CREATE)
+         dms_crud_create_done(curl, CURLE_FAILED_INIT, entries[i].stream);
+      return 1;
+   }
+   return 0;
+}
+
+static int fleet_done(CURL* curl, FleetOp op, CURLcode rc, FleetEntry* entry) {
+
+   switch (op) {
+   case FLEET_CREATE:
+      return dms_crud_create_done(curl, rc, entry->stream);
+   case FLEET_PAUSE:
+      return dms_crud_pause_done(curl, rc);
+   case FLEET_DELETE:
+      return dms_crud_delete_done(curl, rc);
+   default:
+      return dms_crud_check_in_done(curl, rc);
+   }
+}
+
+static void sleep_ms(long ms) {
+
+   struct timespec ts;
+
+   ts.tv_sec = ms / 1000;
+   ts.tv_nsec = (ms % 1000) * 1000000L;
+   while (nanosleep(&ts, &ts) && errno == EINTR)
+      ;
+}
+
+/* Runs op for every entry on one multi handle, keeping at most
+ * max_inflight transfers open at a time. Easy handles are recycled as
+ * transfers finish so connections stay in the shared cache. API
+ * operations draw from the shared rate limiter and go to the back of
+ * the queue when throttled. pass is only needed for those. Returns the
+ * number of failures. */
+int dms_fleet_run(FleetEntry* entries, size_t count, FleetOp op, const char* pass, int max_inflight, const int* verbose) {
+
+   CURLM* multi;
+   CURL** pool;
+   CURL** idle;
+   CURLMsg* msg;
+   FleetEntry* entry;
+   size_t* queue = NULL;
+   size_t head = 0;
+   size_t queued = 0;
+   size_t next;
+   size_t done = 0;
+   long throttle = 0;
+   int nidle = 0;
+   int npool;
+   int running = 0;
+   int msgs;
+   int failed = 0;
+   int numfds;
+   long timeout;
+   int i;
+
+   if (count == 0)
+      return 0;
+
+   if (max_inflight < 1)
+      max_inflight = 1;
+   npool = (size_t)max_inflight < count ? max_inflight : (int)count;
+
+   if ((multi = curl_multi_init()) == NULL) {
+      fprintf(stderr, "CURL multi initialization failed\n");
+      return (int)count;
+   }
+
+   pool = calloc(npool, sizeof(*pool));
+   idle = calloc(npool, sizeof(*idle));
+   queue = calloc(count, sizeof(*queue));
+   if (!pool || !idle || !queue) {
+      fprintf(stderr, "out of memory\n");
+      failed = (int)count;
+      goto out;
+   }
+
+   for (i = 0; i < npool; i++) {
+      if ((pool[i] = curl_easy_init()) == NULL) {
+         fprintf(stderr, "CURL initialization failed\n");
+         failed = (int)count;
+         goto out;
+      }
+      idle[nidle++] = pool[i];
+   }
+
+   /* a ring of entry indexes, each one is in it at most once */
+   for (next = 0; next < count; next++)
+      queue[next] = next;
+   queued = count;
+
+   while (done < count) {
+
+      throttle = 0;
+      while (nidle > 0 && queued > 0) {
+         if (op != FLEET_CHECK_IN && (throttle = dms_ratelimit_acquire()) > 0)
+            break;
+         next = queue[head];
+         head = (head + 1) % count;
+         queued--;
+         entries[next].attempts++;
+         if (fleet_start(multi, idle[nidle - 1], op, pass, entries, next, verbose)) {
+            entries[next].rc = 1;
+            failed++;
+            done++;
+         } else {
+            nidle--;
+         }
+      }
+
+      curl_multi_perform(multi, &running);
+
+      while ((msg = curl_multi_info_read(multi, &msgs)) != NULL) {
+         if (msg->msg != CURLMSG_DONE)
+            continue;
+
+         curl_easy_getinfo(msg->easy_handle, CURLINFO_PRIVATE, (char**)&entry);
+         curl_easy_getinfo(msg->easy_handle, CURLINFO_RESPONSE_CODE, &entry->http_status);
+         curl_easy_getinfo(msg->easy_handle, CURLINFO_TOTAL_TIME, &entry->seconds);
+         entry->rc = fleet_done(msg->easy_handle, op, msg->data.result, entry);
+
+         curl_multi_remove_handle(multi, msg->easy_handle);
+         idle[nidle++] = msg->easy_handle;
+
+         if (entry->rc && op != FLEET_CHECK_IN && entry->http_status == 429
+             && entry->attempts < THROTTLED_MAX_ATTEMPTS) {
+            queue[(head + queued) % count] = (size_t)(entry - entries);
+            queued++;
+            continue;
+         }
+         if (entry->rc)
+            failed++;
+         done++;
+      }
+
+      if (running) {
+         curl_multi_timeout(multi, &timeout);
+         if (timeout < 0 || timeout > WAIT_MS_MAX)
+            timeout = WAIT_MS_MAX;
+         if (throttle > 0 && throttle < timeout)
+            timeout = throttle;
+         curl_multi_wait(multi, NULL, 0, (int)timeout, &numfds);
+      } else if (throttle > 0) {
+         sleep_ms(throttle < WAIT_MS_MAX ? throttle : WAIT_MS_MAX);
+      }
+   }
+
+out:
+   if (pool) {
+      for (i = 0; i < npool; i++) {
+         if (pool[i])
+            curl_easy_cleanup(pool[i]);
+      }
+   }
+   free(pool);
+   free(idle);
+   free(queue);
+   curl_multi_cleanup(multi);
+
+   return failed;
+}
+
+int dms_fleet_check_in(FleetEntry* entries, size_t count, int max_inflight, const int* verbose) {
+
+   return dms_fleet_run(entries, count, FLEET_CHECK_IN, NULL, max_inflight, verbose);
+}
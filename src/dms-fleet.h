@@ -0,0 +1,58 @@
+// vim:set et ts=3 sw=3:
+//  _____ _         _____                                 _       
+// |  __ (_)       |  __ \                               | |      
+// | |__) | _ __   | |__) |_ _ _   _ _ __ ___   ___ _ __ | |_ ___ 
+// |  ___/ | '_ \  |  ___/ _` | | | | '_ ` _ \ / _ \ '_ \| __/ __|
+// | |   | | | | | | |  | (_| | |_| | | | | | |  __/ | | | |_\__ \
+// |_|   |_|_| |_| |_|   \__,_|\__, |_| |_| |_|\___|_| |_|\__|___/
+//                              __/ |                             
+//                             |___/                              
+// Copyright (C) 2018 Pin Payments
+// http://pinpayments.com
+// 
+// This software is provided 'as-is', without any express or implied
+// warranty.  In no event will the authors be held liable for any damages
+// arising from the use of this software.
+// 
+// Permission is granted to anyone to use this software for any purpose,
+// including commercial applications, and to alter it and redistribute it
+// freely, subject to the following restrictions:
+// 
+// 1. The origin of this software must not be misrepresented; you must not
+//    claim that you wrote the original software. If you use this software
+//    in a product, an acknowledgment in the product documentation would be
+//    appreciated but is not required.
+// 2. Altered source versions must be plainly marked as such, and must not be
+//    misrepresented as being the original software.
+// 3. This notice may not be removed or altered from any source distribution.
+
+#ifndef DMS_FLEET_H
+#define DMS_FLEET_H
+
+#include <stddef.h>
+
+typedef enum {
+   FLEET_CHECK_IN,
+   FLEET_PAUSE,
+   FLEET_DELETE,
+   FLEET_CREATE
+} FleetOp;
+
+/* for FLEET_CREATE, request is the body and the new token goes into
+ * token, which then needs TOKEN_VALUE_LEN bytes */
+typedef struct {
+   char*    token;
+   char*    request;
+   void*    stream;        /* of the create in flight */
+   int      rc;            /* 0 once the request was accepted */
+   long     http_status;
+   double   seconds;       /* time spent on this transfer */
+   int      attempts;
+} FleetEntry;
+
+int   dms_fleet_load(const char* filename, FleetEntry** entries, size_t* count);
+void  dms_fleet_free(FleetEntry* entries, size_t count);
+int   dms_fleet_run(FleetEntry* entries, size_t count, FleetOp op, const char* pass, int max_inflight, const int* verbose);
+int   dms_fleet_check_in(FleetEntry* entries, size_t count, int max_inflight, const int* verbose);
+
+#endif // DMS_FLEET_H
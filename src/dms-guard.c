@@ -0,0 +1,215 @@
+// vim:set et ts=3 sw=3:
+//  _____ _         _____                                 _       
+// |  __ (_)       |  __ \                               | |      
+// | |__) | _ __   | |__) |_ _ _   _ _ __ ___   ___ _ __ | |_ ___ 
+// |  ___/ | '_ \  |  ___/ _` | | | | '_ ` _ \ / _ \ '_ \| __/ __|
+// | |   | | | | | | |  | (_| | |_| | | | | | |  __/ | | | |_\__ \
+// |_|   |_|_| |_| |_|   \__,_|\__, |_| |_| |_|\___|_| |_|\__|___/
+//                              __/ |                             
+//                             |___/                              
+// Copyright (C) 2018 Pin Payments
+// http://pinpayments.com
+// 
+// This software is provided 'as-is', without any express or implied
+// warranty.  In no event will the authors be held liable for any damages
+// arising from the use of this software.
+// 
+// Permission is granted to anyone to use this software for any purpose,
+// including commercial applications, and to alter it and redistribute it
+// freely, subject to the following restrictions:
+// 
+// 1. The origin of this software must not be misrepresented; you must not
+//    claim that you wrote the original software. If you use this software
+//    in a product, an acknowledgment in the product documentation would be
+//    appreciated but is not required.
+// 2. Altered source versions must be plainly marked as such, and must not be
+//    misrepresented as being the original software.
+// 3. This notice may not be removed or altered from any source distribution.
+
+#include <dms-guard.h>
+
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/file.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#define FLIGHT_RECORD_LEN 32
+#define BREAKER_MAGIC "DMSBRK1"
+
+typedef struct {
+   char      magic[8];
+   uint32_t  failures;      /* in a row, across all processes */
+   uint32_t  reserved;
+   int64_t   open_until;    /* wall clock, 0 while closed */
+} BreakerState;
+
+static BreakerState* breaker = NULL;
+static long breaker_threshold = 0;
+static long breaker_cooldown = 0;
+
+/* the result the last leader left behind: "<generation> <rc>" */
+static int flight_read(int fd, uint32_t* generation, int* rc) {
+
+   char buf[FLIGHT_RECORD_LEN + 1];
+   ssize_t n;
+   unsigned long gen;
+
+   if ((n = pread(fd, buf, FLIGHT_RECORD_LEN, 0)) <= 0)
+      return 1;
+   buf[n] = '\0';
+   if (sscanf(buf, "%lu %d", &gen, rc) != 2)
+      return 1;
+   *generation = (uint32_t)gen;
+   return 0;
+}
+
+/* Single-flight on filename. The first caller becomes the leader and
+ * holds an exclusive flock while it works. Callers arriving meanwhile
+ * wait on a shared lock and take the leader's result, unless it died
+ * without leaving one, in which case the next of them leads. */
+GuardRole dms_guard_begin(const char* filename, GuardFlight* flight, int* rc) {
+
+   uint32_t before = 0;
+   uint32_t after = 0;
+   int before_rc;
+
+   if ((flight->fd = open(filename, O_RDWR | O_CREAT | O_CLOEXEC, 0644)) < 0) {
+      fprintf(stderr, "%s: %s\n", filename, strerror(errno));
+      return GUARD_ERROR;
+   }
+
+   for (;;) {
+      if (flock(flight->fd, LOCK_EX | LOCK_NB) == 0) {
+         if (flight_read(flight->fd, &flight->generation, &before_rc))
+            flight->generation = 0;
+         return GUARD_LEADER;
+      }
+      if (errno != EWOULDBLOCK && errno != EINTR)
+         break;
+
+      if (flight_read(flight->fd, &before, &before_rc))
+         before = 0;
+      while (flock(flight->fd, LOCK_SH) < 0) {
+         if (errno != EINTR)
+            goto error;
+      }
+      if (flight_read(flight->fd, &after, rc) == 0 && after != before) {
+         close(flight->fd);
+         flight->fd = -1;
+         return GUARD_FOLLOWER;
+      }
+      flock(flight->fd, LOCK_UN);
+   }
+
+error:
+   fprintf(stderr, "%s: %s\n", filename, strerror(errno));
+   close(flight->fd);
+   flight->fd = -1;
+   return GUARD_ERROR;
+}
+
+/* publishes rc to the waiting followers and lets them go */
+void dms_guard_end(GuardFlight* flight, int rc) {
+
+   char buf[FLIGHT_RECORD_LEN];
+
+   if (flight->fd < 0)
+      return;
+
+   /* padded to a fixed size so one pwrite replaces the whole record */
+   memset(buf, ' ', sizeof(buf));
+   snprintf(buf, sizeof(buf), "%lu %d", (unsigned long)(flight->generation + 1), rc);
+   buf[strlen(buf)] = ' ';
+   buf[sizeof(buf) - 1] = '\n';
+   if (pwrite(flight->fd, buf, sizeof(buf), 0) != sizeof(buf))
+      fprintf(stderr, "failed to record result: %s\n", strerror(errno));
+
+   close(flight->fd);
+   flight->fd = -1;
+}
+
+/* A threshold of 0 leaves the breaker closed for good. Failing to map
+ * the state only disables it. */
+int dms_breaker_open(const char* filename, long threshold, long cooldown) {
+
+   struct stat st;
+   void* map;
+   int fd;
+
+   breaker_threshold = threshold;
+   breaker_cooldown = cooldown;
+   if (threshold <= 0)
+      return 0;
+
+   if ((fd = open(filename, O_RDWR | O_CREAT | O_CLOEXEC, 0644)) < 0)
+      return 1;
+   if (fstat(fd, &st) || ((size_t)st.st_size < sizeof(BreakerState)
+                          && ftruncate(fd, sizeof(BreakerState)))) {
+      close(fd);
+      return 1;
+   }
+   map = mmap(NULL, sizeof(BreakerState), PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+   close(fd);
+   if (map == MAP_FAILED)
+      return 1;
+
+   breaker = map;
+   if (breaker->magic[0] == '\0')
+      memcpy(breaker->magic, BREAKER_MAGIC, sizeof(BREAKER_MAGIC));
+   if (memcmp(breaker->magic, BREAKER_MAGIC, sizeof(BREAKER_MAGIC)) != 0) {
+      dms_breaker_close();
+      return 1;
+   }
+   return 0;
+}
+
+void dms_breaker_close(void) {
+   if (breaker)
+      munmap(breaker, sizeof(BreakerState));
+   breaker = NULL;
+}
+
+/* Closed, or the cooldown is over and this caller won the probe. The
+ * winner moves open_until a cooldown ahead with a compare-and-swap, so
+ * every other process keeps failing fast while the probe is out; its
+ * success closes the breaker, its failure reopens it, and a probe that
+ * never reports is followed by another after the cooldown. */
+int dms_breaker_allow(void) {
+
+   int64_t open_until;
+   int64_t now;
+
+   if (breaker == NULL)
+      return 1;
+   if ((open_until = __atomic_load_n(&breaker->open_until, __ATOMIC_ACQUIRE)) == 0)
+      return 1;
+   now = (int64_t)time(NULL);
+   if (now < open_until)
+      return 0;
+   return __atomic_compare_exchange_n(&breaker->open_until, &open_until, now + breaker_cooldown,
+                                      0, __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE);
+}
+
+void dms_breaker_record(int failed) {
+
+   uint32_t failures;
+
+   if (breaker == NULL)
+      return;
+
+   if (!failed) {
+      __atomic_store_n(&breaker->failures, 0, __ATOMIC_RELAXED);
+      __atomic_store_n(&breaker->open_until, 0, __ATOMIC_RELEASE);
+      return;
+   }
+
+   failures = __atomic_add_fetch(&breaker->failures, 1, __ATOMIC_ACQ_REL);
+   if (failures >= (uint32_t)breaker_threshold) {
+      __atomic_store_n(&breaker->open_until, (int64_t)time(NULL) + breaker_cooldown, __ATOMIC_RELEASE);
+   }
+}
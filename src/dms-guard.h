@@ -0,0 +1,56 @@
+// vim:set et ts=3 sw=3:
+//  _____ _         _____                                 _       
+// |  __ (_)       |  __ \                               | |      
+// | |__) | _ __   | |__) |_ _ _   _ _ __ ___   ___ _ __ | |_ ___ 
+// |  ___/ | '_ \  |  ___/ _` | | | | '_ ` _ \ / _ \ '_ \| __/ __|
+// | |   | | | | | | |  | (_| | |_| | | | | | |  __/ | | | |_\__ \
+// |_|   |_|_| |_| |_|   \__,_|\__, |_| |_| |_|\___|_| |_|\__|___/
+//                              __/ |                             
+//                             |___/                              
+// Copyright (C) 2018 Pin Payments
+// http://pinpayments.com
+// 
+// This software is provided 'as-is', without any express or implied
+// warranty.  In no event will the authors be held liable for any damages
+// arising from the use of this software.
+// 
+// Permission is granted to anyone to use this software for any purpose,
+// including commercial applications, and to alter it and redistribute it
+// freely, subject to the following restrictions:
+// 
+// 1. The origin of this software must not be misrepresented; you must not
+//    claim that you wrote the original software. If you use this software
+//    in a product, an acknowledgment in the product documentation would be
+//    appreciated but is not required.
+// 2. Altered source versions must be plainly marked as such, and must not be
+//    misrepresented as being the original software.
+// 3. This notice may not be removed or altered from any source distribution.
+
+#ifndef DMS_GUARD_H
+#define DMS_GUARD_H
+
+#include <stdint.h>
+
+/* one invocation's claim on an operation, see dms_guard_begin() */
+typedef struct {
+   int         fd;
+   uint32_t    generation;
+} GuardFlight;
+
+typedef enum {
+   GUARD_LEADER,     /* go ahead, then hand the result to dms_guard_end() */
+   GUARD_FOLLOWER,   /* someone else did it, their result is in rc */
+   GUARD_ERROR
+} GuardRole;
+
+GuardRole   dms_guard_begin(const char* filename, GuardFlight* flight, int* rc);
+void        dms_guard_end(GuardFlight* flight, int rc);
+
+/* consecutive failures after which outbound calls stop for cooldown
+ * seconds, shared by every dms process through a small mapped file */
+int         dms_breaker_open(const char* filename, long threshold, long cooldown);
+void        dms_breaker_close(void);
+int         dms_breaker_allow(void);
+void        dms_breaker_record(int failed);
+
+#endif // DMS_GUARD_H
@@ -0,0 +1,354 @@
+// vim:set et ts=3 sw=3:
+//  _____ _         _____                                 _       
+// |  __ (_)       |  __ \                               | |      
+// | |__) | _ __   | |__) |_ _ _   _ _ __ ___   ___ _ __ | |_ ___ 
+// |  ___/ | '_ \  |  ___/ _` | | | | '_ ` _ \ / _ \ '_ \| __/ __|
+// | |   | | | | | | |  | (_| | |_| | | | | | |  __/ | | | |_\__ \
+// |_|   |_|_| |_| |_|   \__,_|\__, |_| |_| |_|\___|_| |_|\__|___/
+//                              __/ |                             
+//                             |___/                              
+// Copyright (C) 2018 Pin Payments
+// http://pinpayments.com
+// 
+// This software is provided 'as-is', without any express or implied
+// warranty.  In no event will the authors be held liable for any damages
+// arising from the use of this software.
+// 
+// Permission is granted to anyone to use this software for any purpose,
+// including commercial applications, and to alter it and redistribute it
+// freely, subject to the following restrictions:
+// 
+// 1. The origin of this software must not be misrepresented; you must not
+//    claim that you wrote the original software. If you use this software
+//    in a product, an acknowledgment in the product documentation would be
+//    appreciated but is not required.
+// 2. Altered source versions must be plainly marked as such, and must not be
+//    misrepresented as being the original software.
+// 3. This notice may not be removed or altered from any source distribution.
+
+#include <dms-outbox.h>
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/file.h>
+#include <sys/stat.h>
+
+/*
+ * The outbox is an append-only text file with one record per line:
+ *
+ *    <op> <token> <attempts> <not-before>
+ *
+ * Producers append a record with a single O_APPEND write, which is atomic
+ * for records this small, so concurrent dms runs never interleave. The
+ * file is only rewritten by a drain, which renames it out of the way
+ * first and appends whatever still has to wait back to a fresh outbox.
+ * Producers hold a shared lock on <outbox>.append from open to write and
+ * the drain takes it exclusively around the rename, so no record can
+ * land in a file the drain has already claimed.
+ */
+
+#define MAX_RECORD 512
+#define MAX_TOKEN 256
+#define SYNC_BLOCK 4096
+
+#define BACKOFF_BASE_SECONDS 60
+#define BACKOFF_MAX_SECONDS (6 * 3600)
+#define MAX_ATTEMPTS 16
+
+typedef struct {
+   char  op;
+   char  token[MAX_TOKEN];
+   unsigned attempts;
+   long  not_before;
+} OutboxRecord;
+
+static int format_record(char* buf, size_t size, const OutboxRecord* rec) {
+   return snprintf(buf, size, "%c %s %u %ld\n", rec->op, rec->token, rec->attempts, rec->not_before);
+}
+
+static void sync_dir(const char* filename) {
+
+   char dir[PATH_MAX];
+   char* slash;
+   int fd;
+
+   strncpy(dir, filename, sizeof(dir) - 1);
+   dir[sizeof(dir) - 1] = '\0';
+   if ((slash = strrchr(dir, '/')) == NULL)
+      strcpy(dir, ".");
+   else if (slash == dir)
+      dir[1] = '\0';
+   else
+      *slash = '\0';
+
+   if ((fd = open(dir, O_RDONLY | O_DIRECTORY)) >= 0) {
+      fsync(fd);
+      close(fd);
+   }
+}
+
+/* shared for appending, exclusive for claiming the outbox; -1 if the
+ * lock file can't be had, which leaves the outbox unguarded as before */
+static int append_lock(const char* filename, int op) {
+
+   char lock[PATH_MAX];
+   int fd;
+
+   snprintf(lock, sizeof(lock), "%s.append", filename);
+   if ((fd = open(lock, O_RDWR | O_CREAT | O_CLOEXEC, 0600)) < 0)
+      return -1;
+   while (flock(fd, op) < 0) {
+      if (errno != EINTR) {
+         close(fd);
+         return -1;
+      }
+   }
+   return fd;
+}
+
+static void append_unlock(int fd) {
+   if (fd >= 0)
+      close(fd);
+}
+
+/* One write per call. The data is flushed when the file is created and
+ * whenever the append crosses a SYNC_BLOCK boundary, so a power loss costs
+ * at most a block worth of queued records and a crash costs nothing. */
+static int append_records(const char* filename, const char* buf, size_t len) {
+
+   struct stat st;
+   int lock_fd;
+   int fd;
+   int rv = 0;
+
+   lock_fd = append_lock(filename, LOCK_SH);
+   if ((fd = open(filename, O_WRONLY | O_APPEND | O_CREAT | O_CLOEXEC, 0600)) < 0) {
+      fprintf(stderr, "could not open outbox %s: %s\n", filename, strerror(errno));
+      append_unlock(lock_fd);
+      return 1;
+   }
+
+   if (write(fd, buf, len) != (ssize_t)len) {
+      fprintf(stderr, "could not write outbox %s\n", filename);
+      rv = 1;
+   } else if (fstat(fd, &st) == 0) {
+      if ((size_t)st.st_size == len) {
+         fdatasync(fd);
+         sync_dir(filename);
+      } else if ((st.st_size - len) / SYNC_BLOCK != st.st_size / SYNC_BLOCK) {
+         fdatasync(fd);
+      }
+   }
+
+   close(fd);
+   append_unlock(lock_fd);
+   return rv;
+}
+
+int dms_outbox_append(const char* filename, OutboxOp op, const char* token) {
+
+   OutboxRecord rec;
+   char line[MAX_RECORD];
+   int len;
+
+   if (strlen(token) >= MAX_TOKEN)
+      return 1;
+
+   rec.op = (char)op;
+   strcpy(rec.token, token);
+   rec.attempts = 0;
+   rec.not_before = 0;
+
+   len = format_record(line, sizeof(line), &rec);
+   return append_records(filename, line, (size_t)len);
+}
+
+static int parse_record(char* line, OutboxRecord* rec) {
+
+   char op;
+   unsigned attempts;
+   long not_before;
+   int n = 0;
+
+   if (sscanf(line, "%c %255s %u %ld%n", &op, rec->token, &attempts, &not_before, &n) != 4 || n == 0)
+      return 1;
+   if (op != OUTBOX_CHECK_IN && op != OUTBOX_PAUSE)
+      return 1;
+
+   rec->op = op;
+   rec->attempts = attempts;
+   rec->not_before = not_before;
+   return 0;
+}
+
+/* Reads the claimed spool, merging records for the same operation and
+ * token into one. Torn or unknown lines are dropped. */
+static int load_records(const char* filename, OutboxRecord** records, size_t* count) {
+
+   FILE* file;
+   char line[MAX_RECORD];
+   OutboxRecord rec;
+   OutboxRecord* list = NULL;
+   OutboxRecord* grown;
+   size_t n = 0;
+   size_t cap = 0;
+   size_t i;
+
+   if ((file = fopen(filename, "r")) == NULL)
+      return errno == ENOENT ? 0 : 1;
+
+   while (fgets(line, sizeof(line), file)) {
+      if (parse_record(line, &rec))
+         continue;
+
+      for (i = 0; i < n; i++) {
+         if (list[i].op == rec.op && strcmp(list[i].token, rec.token) == 0)
+            break;
+      }
+      if (i < n) {
+         if (rec.attempts > list[i].attempts)
+            list[i].attempts = rec.attempts;
+         if (rec.not_before < list[i].not_before)
+            list[i].not_before = rec.not_before;
+         continue;
+      }
+
+      if (n == cap) {
+         cap = cap ? cap * 2 : 16;
+         if ((grown = realloc(list, cap * sizeof(*list))) == NULL) {
+            fclose(file);
+            free(list);
+            return 1;
+         }
+         list = grown;
+      }
+      list[n++] = rec;
+   }
+   fclose(file);
+
+   *records = list;
+   *count = n;
+   return 0;
+}
+
+/* exponential backoff with jitter: a random point in the upper half of
+ * the current window */
+static long backoff(unsigned attempts) {
+
+   long window = BACKOFF_BASE_SECONDS;
+
+   while (attempts-- > 1 && window < BACKOFF_MAX_SECONDS)
+      window *= 2;
+   if (window > BACKOFF_MAX_SECONDS)
+      window = BACKOFF_MAX_SECONDS;
+
+   return window / 2 + random() % (window / 2 + 1);
+}
+
+/* Sends every queued operation that is due. Queued check-ins for fresh,
+ * the token the caller is about to check in anyway, are dropped rather
+ * than sent twice. Only one drain runs at a time; a concurrent caller
+ * returns straight away. */
+int dms_outbox_drain(const char* filename, CURL* curl, outbox_send_fn send, const char* fresh) {
+
+   static int seeded = 0;
+   char draining[PATH_MAX];
+   char lock[PATH_MAX];
+   char line[MAX_RECORD];
+   char* out = NULL;
+   size_t out_len = 0;
+   OutboxRecord* records = NULL;
+   size_t count = 0;
+   size_t i;
+   time_t now;
+   int lock_fd;
+   int append_fd;
+   int renamed;
+   int rv = 0;
+   int len;
+
+   snprintf(draining, sizeof(draining), "%s.draining", filename);
+   snprintf(lock, sizeof(lock), "%s.lock", filename);
+
+   /* cheap way out for the common case */
+   if (access(filename, F_OK) && access(draining, F_OK))
+      return 0;
+
+   if ((lock_fd = open(lock, O_RDWR | O_CREAT | O_CLOEXEC, 0600)) < 0)
+      return 1;
+   if (flock(lock_fd, LOCK_EX | LOCK_NB)) {
+      close(lock_fd);
+      return 0;
+   }
+
+   /* a leftover draining file means a previous drain died, finish it
+    * first; otherwise wait out the appends in progress and claim */
+   if (access(draining, F_OK)) {
+      append_fd = append_lock(filename, LOCK_EX);
+      renamed = rename(filename, draining) == 0;
+      if (!renamed)
+         rv = errno == ENOENT ? 0 : 1;
+      append_unlock(append_fd);
+      if (!renamed)
+         goto out;
+   }
+
+   if (load_records(draining, &records, &count)) {
+      fprintf(stderr, "could not read outbox %s\n", draining);
+      rv = 1;
+      goto out;
+   }
+
+   if (!seeded) {
+      srandom((unsigned)time(NULL) ^ (unsigned)getpid());
+      seeded = 1;
+   }
+
+   now = time(NULL);
+   out = malloc(count * MAX_RECORD + 1);
+   if (count && !out) {
+      rv = 1;
+      goto out;
+   }
+
+   for (i = 0; i < count; i++) {
+      if (fresh && records[i].op == OUTBOX_CHECK_IN && strcmp(records[i].token, fresh) == 0)
+         continue;
+
+      if (records[i].not_before <= now) {
+         if (send(curl, (OutboxOp)records[i].op, records[i].token) == 0)
+            continue;
+
+         if (++records[i].attempts >= MAX_ATTEMPTS) {
+            fprintf(stderr, "giving up on queued '%c' after %u attempts\n",
+                    records[i].op, records[i].attempts);
+            continue;
+         }
+         records[i].not_before = now + backoff(records[i].attempts);
+      }
+
+      len = format_record(line, sizeof(line), &records[i]);
+      memcpy(out + out_len, line, (size_t)len);
+      out_len += (size_t)len;
+   }
+
+   if (out_len && append_records(filename, out, out_len)) {
+      /* keep the draining file, the next drain picks it up again */
+      rv = 1;
+      goto out;
+   }
+   unlink(draining);
+
+out:
+   free(out);
+   free(records);
+   flock(lock_fd, LOCK_UN);
+   close(lock_fd);
+   return rv;
+}
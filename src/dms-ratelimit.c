@@ -0,0 +1,261 @@
+// vim:set et ts=3 sw=3:
+//  _____ _         _____                                 _       
+// |  __ (_)       |  __ \                               | |      
+// | |__) | _ __   | |__) |_ _ _   _ _ __ ___   ___ _ __ | |_ ___ 
+// |  ___/ | '_ \  |  ___/ _` | | | | '_ ` _ \ / _ \ '_ \| __/ __|
+// | |   | | | | | | |  | (_| | |_| | | | | | |  __/ | | | |_\__ \
+// |_|   |_|_| |_| |_|   \__,_|\__, |_| |_| |_|\___|_| |_|\__|___/
+//                              __/ |                             
+//                             |___/                              
+// Copyright (C) 2018 Pin Payments
+// http://pinpayments.com
+// 
+// This software is provided 'as-is', without any express or implied
+// warranty.  In no event will the authors be held liable for any damages
+// arising from the use of this software.
+// 
+// Permission is granted to anyone to use this software for any purpose,
+// including commercial applications, and to alter it and redistribute it
+// freely, subject to the following restrictions:
+// 
+// 1. The origin of this software must not be misrepresented; you must not
+//    claim that you wrote the original software. If you use this software
+//    in a product, an acknowledgment in the product documentation would be
+//    appreciated but is not required.
+// 2. Altered source versions must be plainly marked as such, and must not be
+//    misrepresented as being the original software.
+// 3. This notice may not be removed or altered from any source distribution.
+
+#include <dms-ratelimit.h>
+
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/file.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#define RATELIMIT_MAGIC "DMSRTL2"
+#define BOOT_ID_FILE "/proc/sys/kernel/random/boot_id"
+#define BOOT_ID_LEN 40
+
+/* requests per second: where we start, and the bounds we adapt within */
+#define RATE_INITIAL 5.0
+#define RATE_MIN 0.2
+#define RATE_MAX 1000.0
+
+/* how long to back off on a 429 that doesn't say */
+#define RETRY_AFTER_DEFAULT 1
+
+typedef struct {
+   char              magic[8];
+   char              boot_id[BOOT_ID_LEN];
+   pthread_mutex_t   lock;          /* process-shared and robust, this boot only */
+   double            rate;
+   double            tokens;
+   long long         refilled_ns;   /* CLOCK_MONOTONIC */
+   long long         blocked_ns;    /* nothing goes out before this */
+} RateLimit;
+
+static RateLimit* limit = NULL;
+
+static long long now_ns(void) {
+
+   struct timespec ts;
+
+   clock_gettime(CLOCK_MONOTONIC, &ts);
+   return ts.tv_sec * 1000000000LL + ts.tv_nsec;
+}
+
+static int init_lock(pthread_mutex_t* lock) {
+
+   pthread_mutexattr_t attr;
+   int rv;
+
+   pthread_mutexattr_init(&attr);
+   pthread_mutexattr_setpshared(&attr, PTHREAD_PROCESS_SHARED);
+   pthread_mutexattr_setrobust(&attr, PTHREAD_MUTEX_ROBUST);
+   rv = pthread_mutex_init(lock, &attr);
+   pthread_mutexattr_destroy(&attr);
+   return rv;
+}
+
+/* Robust mutexes only recover from owners that die on the running
+ * kernel; one held when the host went down would block every process
+ * after the reboot, so the lock is only trusted from the boot it was
+ * made in. Empty if the kernel won't tell, which then always matches. */
+static void read_boot_id(char* boot_id) {
+
+   ssize_t n = 0;
+   int fd;
+
+   memset(boot_id, 0, BOOT_ID_LEN);
+   if ((fd = open(BOOT_ID_FILE, O_RDONLY | O_CLOEXEC)) < 0)
+      return;
+   n = read(fd, boot_id, BOOT_ID_LEN - 1);
+   close(fd);
+   if (n < 0)
+      n = 0;
+   boot_id[n] = '\0';
+   boot_id[strcspn(boot_id, "\n")] = '\0';
+}
+
+/* a holder that died mid-update can at worst leave the bucket a little
+ * off, which the next refill corrects, so the state is taken as is */
+static void lock(void) {
+   if (pthread_mutex_lock(&limit->lock) == EOWNERDEAD)
+      pthread_mutex_consistent(&limit->lock);
+}
+
+static void unlock(void) {
+   pthread_mutex_unlock(&limit->lock);
+}
+
+/* The state is created under a flock so two first runs can't both
+ * initialize the mutex, and so is the mutex made again by the first
+ * run after a reboot. Failing to map it only disables limiting. */
+int dms_ratelimit_open(const char* filename) {
+
+   struct stat st;
+   RateLimit* map;
+   char boot_id[BOOT_ID_LEN];
+   int fd;
+
+   if ((fd = open(filename, O_RDWR | O_CREAT | O_CLOEXEC, 0644)) < 0)
+      return 1;
+   if (flock(fd, LOCK_EX) < 0 || fstat(fd, &st) < 0)
+      goto error;
+   if ((size_t)st.st_size < sizeof(RateLimit) && ftruncate(fd, sizeof(RateLimit)) < 0)
+      goto error;
+
+   map = mmap(NULL, sizeof(RateLimit), PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+   if (map == MAP_FAILED)
+      goto error;
+
+   read_boot_id(boot_id);
+   if (memcmp(map->magic, RATELIMIT_MAGIC, sizeof(RATELIMIT_MAGIC)) != 0) {
+      if (init_lock(&map->lock)) {
+         munmap(map, sizeof(RateLimit));
+         goto error;
+      }
+      map->rate = RATE_INITIAL;
+      map->tokens = 1.0;
+      map->refilled_ns = now_ns();
+      map->blocked_ns = 0;
+      memcpy(map->boot_id, boot_id, BOOT_ID_LEN);
+      memcpy(map->magic, RATELIMIT_MAGIC, sizeof(RATELIMIT_MAGIC));
+   } else if (memcmp(map->boot_id, boot_id, BOOT_ID_LEN) != 0) {
+      /* nobody from this boot can be holding it, the rate still holds */
+      if (init_lock(&map->lock)) {
+         munmap(map, sizeof(RateLimit));
+         goto error;
+      }
+      map->refilled_ns = now_ns();
+      map->blocked_ns = 0;
+      memcpy(map->boot_id, boot_id, BOOT_ID_LEN);
+   }
+
+   close(fd);
+   limit = map;
+   return 0;
+error:
+   close(fd);
+   return 1;
+}
+
+void dms_ratelimit_close(void) {
+   if (limit)
+      munmap(limit, sizeof(RateLimit));
+   limit = NULL;
+}
+
+/* Takes a token if there is one. Returns 0 when the caller may go, or
+ * the milliseconds until it should ask again. */
+long dms_ratelimit_acquire(void) {
+
+   long long now;
+   long long wait_ns;
+   double burst;
+
+   if (limit == NULL)
+      return 0;
+
+   now = now_ns();
+   lock();
+
+   /* the clock restarts with every boot, the file doesn't */
+   if (limit->refilled_ns > now || limit->blocked_ns > now + 3600000000000LL) {
+      limit->refilled_ns = now;
+      limit->blocked_ns = 0;
+   }
+
+   burst = limit->rate < 1.0 ? 1.0 : limit->rate;
+   limit->tokens += (now - limit->refilled_ns) / 1e9 * limit->rate;
+   if (limit->tokens > burst)
+      limit->tokens = burst;
+   limit->refilled_ns = now;
+
+   if (limit->blocked_ns > now) {
+      wait_ns = limit->blocked_ns - now;
+   } else if (limit->tokens >= 1.0) {
+      limit->tokens -= 1.0;
+      wait_ns = 0;
+   } else {
+      wait_ns = (long long)((1.0 - limit->tokens) / limit->rate * 1e9);
+   }
+
+   unlock();
+
+   return wait_ns > 0 ? (long)(wait_ns / 1000000) + 1 : 0;
+}
+
+/* Blocks until a token is ours, giving up once that would take longer
+ * than max_ms (negative waits as long as it takes). */
+int dms_ratelimit_wait(long max_ms) {
+
+   struct timespec ts;
+   long waited = 0;
+   long wait;
+
+   while ((wait = dms_ratelimit_acquire()) > 0) {
+      if (max_ms >= 0 && waited + wait > max_ms)
+         return 1;
+      ts.tv_sec = wait / 1000;
+      ts.tv_nsec = (wait % 1000) * 1000000L;
+      while (nanosleep(&ts, &ts) && errno == EINTR)
+         ;
+      waited += wait;
+   }
+   return 0;
+}
+
+/* Additive increase, one request per second for every rate's worth of
+ * answers, multiplicative decrease on a 429, which also holds everyone
+ * back for Retry-After seconds. */
+void dms_ratelimit_feedback(long http_status, long retry_after) {
+
+   long long until;
+
+   if (limit == NULL)
+      return;
+
+   lock();
+   if (http_status == 429) {
+      limit->rate /= 2;
+      if (limit->rate < RATE_MIN)
+         limit->rate = RATE_MIN;
+      limit->tokens = 0;
+      until = now_ns() + (retry_after > 0 ? retry_after : RETRY_AFTER_DEFAULT) * 1000000000LL;
+      if (until > limit->blocked_ns)
+         limit->blocked_ns = until;
+   } else if (http_status > 0 && http_status < 500) {
+      limit->rate += 1.0 / limit->rate;
+      if (limit->rate > RATE_MAX)
+         limit->rate = RATE_MAX;
+   }
+   unlock();
+}
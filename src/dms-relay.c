@@ -0,0 +1,830 @@
+// vim:set et ts=3 sw=3:
+//  _____ _         _____                                 _       
+// |  __ (_)       |  __ \                               | |      
+// | |__) | _ __   | |__) |_ _ _   _ _ __ ___   ___ _ __ | |_ ___ 
+// |  ___/ | '_ \  |  ___/ _` | | | | '_ ` _ \ / _ \ '_ \| __/ __|
+// | |   | | | | | | |  | (_| | |_| | | | | | |  __/ | | | |_\__ \
+// |_|   |_|_| |_| |_|   \__,_|\__, |_| |_| |_|\___|_| |_|\__|___/
+//                              __/ |                             
+//                             |___/                              
+// Copyright (C) 2018 Pin Payments
+// http://pinpayments.com
+// 
+// This software is provided 'as-is', without any express or implied
+// warranty.  In no event will the authors be held liable for any damages
+// arising from the use of this software.
+// 
+// Permission is granted to anyone to use this software for any purpose,
+// including commercial applications, and to alter it and redistribute it
+// freely, subject to the following restrictions:
+// 
+// 1. The origin of this software must not be misrepresented; you must not
+//    claim that you wrote the original software. If you use this software
+//    in a product, an acknowledgment in the product documentation would be
+//    appreciated but is not required.
+// 2. Altered source versions must be plainly marked as such, and must not be
+//    misrepresented as being the original software.
+// 3. This notice may not be removed or altered from any source distribution.
+
+/*
+ * dms-relay - forwards check-in and API requests from dms clients that
+ * can't reach the internet themselves. Clients talk plain HTTP/1.1 to
+ * the relay (Relay http://host:port in their dms.conf); upstream the
+ * relay keeps a few persistent HTTP/2 connections and multiplexes every
+ * request over them, applying one rate limit and retrying failures.
+ *
+ *    /v1/snitches...   forwarded to APIURL
+ *    /<token>          forwarded to CheckInURL
+ */
+
+#define _GNU_SOURCE
+
+#include <dms.h>
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <errno.h>
+#include <signal.h>
+#include <time.h>
+#include <unistd.h>
+#include <getopt.h>
+#include <fcntl.h>
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <sys/socket.h>
+
+#include <curl/curl.h>
+
+#include <readconf.h>
+#include <dms-daemon.h>
+#include <config.h>
+
+#define RELAY_ADDRESS "127.0.0.1"
+#define RELAY_PORT 8080
+#define DEFAULT_RATE 50
+#define DEFAULT_BURST 100
+#define DEFAULT_CONNECTIONS 2
+#define MAX_CLIENTS 1024
+#define MAX_INFLIGHT 256
+#define MAX_REQUEST 16384
+#define MAX_URL 512
+#define MAX_ATTEMPTS 4
+#define UPSTREAM_TIMEOUT_SECONDS 30
+#define WAIT_MS_MAX 1000
+
+typedef struct Relayed Relayed;
+
+typedef struct {
+   int        fd;
+   char       in[MAX_REQUEST];
+   size_t     have;
+   char*      out;
+   size_t     out_len;
+   size_t     out_pos;
+   int        keep_alive;
+   Relayed*   pending;      /* the request being relayed for this client */
+} Client;
+
+struct Relayed {
+   Client*              client;        /* NULL once the client went away */
+   CURL*                curl;
+   struct curl_slist*   headers;
+   char                 method[8];
+   char                 url[MAX_URL];
+   char                 host[256];     /* how the client reached us */
+   char*                body;
+   size_t               body_len;
+   char*                resp;
+   size_t               resp_len;
+   char                 resp_headers[MAX_URL * 2];   /* passed back as they came, CRLF ended */
+   size_t               resp_headers_len;
+   int                  idempotent;
+   int                  attempts;
+   long                 not_before_ms;
+   Relayed*             next;
+};
+
+Options options;
+
+static const char* upstream_api = DMS_API_URL;
+static const char* upstream_check_in = DMS_CHECK_IN_URL;
+
+/* request headers that go upstream as they came */
+static const char* const forward_request[] = {
+   "Authorization", "Content-Type", "If-None-Match", "Accept-Encoding", NULL
+};
+/* and response headers that come back; Link is rewritten on the way */
+static const char* const forward_response[] = {
+   "ETag", "Content-Encoding", "Retry-After", NULL
+};
+
+static Client* clients[MAX_CLIENTS];
+static int nclients = 0;
+
+/* waiting for their turn, in arrival order */
+static Relayed* queue_head = NULL;
+static Relayed* queue_tail = NULL;
+static int inflight = 0;
+
+/* token bucket shared by every upstream request */
+static double rate = DEFAULT_RATE;
+static double burst = DEFAULT_BURST;
+static double bucket = DEFAULT_BURST;
+static long bucket_ms = 0;
+
+static long now_ms(void) {
+
+   struct timespec ts;
+
+   clock_gettime(CLOCK_MONOTONIC, &ts);
+   return ts.tv_sec * 1000L + ts.tv_nsec / 1000000L;
+}
+
+static const char* reason(long status) {
+   switch (status) {
+   case 200: return "OK";
+   case 201: return "Created";
+   case 202: return "Accepted";
+   case 204: return "No Content";
+   case 304: return "Not Modified";
+   case 400: return "Bad Request";
+   case 401: return "Unauthorized";
+   case 404: return "Not Found";
+   case 429: return "Too Many Requests";
+   case 502: return "Bad Gateway";
+   case 503: return "Service Unavailable";
+   }
+   return status < 300 ? "OK" : "Error";
+}
+
+static void enqueue(Relayed* r) {
+
+   r->next = NULL;
+   if (queue_tail)
+      queue_tail->next = r;
+   else
+      queue_head = r;
+   queue_tail = r;
+}
+
+static void relayed_free(Relayed* r) {
+
+   if (r->curl)
+      curl_easy_cleanup(r->curl);
+   curl_slist_free_all(r->headers);
+   free(r->body);
+   free(r->resp);
+   free(r);
+}
+
+/* headers are whole CRLF ended lines from upstream, or NULL; a 304 has
+ * no body to describe, it goes back with those alone */
+static void client_respond(Client* c, long status, const char* type, const char* headers, const char* body, size_t len) {
+
+   char head[MAX_URL * 2 + 256];
+   char entity[128];
+   int head_len;
+
+   entity[0] = '\0';
+   if (status != 304)
+      snprintf(entity, sizeof(entity), "Content-Type: %s\r\nContent-Length: %zu\r\n",
+               type ? type : "text/plain", len);
+   head_len = snprintf(head, sizeof(head), "HTTP/1.1 %ld %s\r\n%s%s%s\r\n",
+                       status, reason(status), entity, headers ? headers : "",
+                       c->keep_alive ? "" : "Connection: close\r\n");
+   if (head_len < 0 || (size_t)head_len >= sizeof(head)) {
+      c->keep_alive = 0;
+      return;
+   }
+   if ((c->out = malloc((size_t)head_len + len)) == NULL) {
+      c->keep_alive = 0;
+      return;
+   }
+   memcpy(c->out, head, (size_t)head_len);
+   if (len)
+      memcpy(c->out + head_len, body, len);
+   c->out_len = (size_t)head_len + len;
+   c->out_pos = 0;
+}
+
+static size_t upstream_data_cb(const void* ptr, size_t size, size_t nmemb, void* user_data) {
+
+   Relayed* r = (Relayed*) user_data;
+   size_t len = size * nmemb;
+   char* grown;
+
+   if ((grown = realloc(r->resp, r->resp_len + len)) == NULL)
+      return 0;
+   r->resp = grown;
+   memcpy(r->resp + r->resp_len, ptr, len);
+   r->resp_len += len;
+   return len;
+}
+
+static void resp_header_add(Relayed* r, const char* name, const char* value) {
+
+   size_t left = sizeof(r->resp_headers) - r->resp_headers_len;
+   int n;
+
+   n = snprintf(r->resp_headers + r->resp_headers_len, left, "%s: %s\r\n", name, value);
+   if (n > 0 && (size_t)n < left)
+      r->resp_headers_len += (size_t)n;
+   else
+      r->resp_headers[r->resp_headers_len] = '\0';
+}
+
+/* Picks the headers the client needs back out of the final response.
+ * Listings keep paging through the relay: the upstream API prefix of a
+ * Link header is swapped for the address the client used. */
+static size_t upstream_header_cb(const char* ptr, size_t size, size_t nmemb, void* user_data) {
+
+   Relayed* r = (Relayed*) user_data;
+   size_t len = size * nmemb;
+   size_t api_len = strlen(upstream_api);
+   const char* const* name;
+   const char* at;
+   const char* v;
+   char line[MAX_URL];
+   char link[MAX_URL];
+   char* colon;
+
+   /* a new status line, the headers of any interim response are void */
+   if (len >= 5 && strncmp(ptr, "HTTP/", 5) == 0) {
+      r->resp_headers_len = 0;
+      r->resp_headers[0] = '\0';
+      return len;
+   }
+   if (len >= sizeof(line) || (colon = memchr(ptr, ':', len)) == NULL)
+      return len;
+   memcpy(line, ptr, len);
+   line[len] = '\0';
+   line[strcspn(line, "\r\n")] = '\0';
+   line[colon - ptr] = '\0';
+   v = line + (colon - ptr) + 1;
+   v += strspn(v, " \t");
+
+   if (strcasecmp(line, "Link") == 0) {
+      if ((at = strstr(v, upstream_api)) != NULL) {
+         snprintf(link, sizeof(link), "%.*shttp://%s/v1/snitches%s",
+                  (int)(at - v), v, r->host, at + api_len);
+         resp_header_add(r, "Link", link);
+      } else {
+         resp_header_add(r, "Link", v);
+      }
+      return len;
+   }
+   for (name = forward_response; *name; name++) {
+      if (strcasecmp(line, *name) == 0) {
+         resp_header_add(r, *name, v);
+         break;
+      }
+   }
+   return len;
+}
+
+static int upstream_start(CURLM* multi, Relayed* r) {
+
+   if ((r->curl = r->curl ? r->curl : curl_easy_init()) == NULL)
+      return 1;
+
+   curl_easy_setopt(r->curl, CURLOPT_URL, r->url);
+   curl_easy_setopt(r->curl, CURLOPT_VERBOSE, (long)options.verbose);
+   curl_easy_setopt(r->curl, CURLOPT_NOSIGNAL, 1L);
+   curl_easy_setopt(r->curl, CURLOPT_HTTP_VERSION, (long)CURL_HTTP_VERSION_2TLS);
+   /* wait for a connection that can multiplex rather than open another */
+   curl_easy_setopt(r->curl, CURLOPT_PIPEWAIT, 1L);
+   curl_easy_setopt(r->curl, CURLOPT_TCP_KEEPALIVE, 1L);
+   curl_easy_setopt(r->curl, CURLOPT_TIMEOUT, (long)UPSTREAM_TIMEOUT_SECONDS);
+   curl_easy_setopt(r->curl, CURLOPT_HTTPHEADER, r->headers);
+   curl_easy_setopt(r->curl, CURLOPT_WRITEFUNCTION, upstream_data_cb);
+   curl_easy_setopt(r->curl, CURLOPT_WRITEDATA, r);
+   curl_easy_setopt(r->curl, CURLOPT_HEADERFUNCTION, upstream_header_cb);
+   curl_easy_setopt(r->curl, CURLOPT_HEADERDATA, r);
+   curl_easy_setopt(r->curl, CURLOPT_PRIVATE, (void*)r);
+
+   if (strcmp(r->method, "GET") == 0) {
+      curl_easy_setopt(r->curl, CURLOPT_HTTPGET, 1L);
+   } else {
+      curl_easy_setopt(r->curl, CURLOPT_POSTFIELDS, r->body ? r->body : "");
+      curl_easy_setopt(r->curl, CURLOPT_POSTFIELDSIZE, (long)r->body_len);
+      if (strcmp(r->method, "POST") != 0)
+         curl_easy_setopt(r->curl, CURLOPT_CUSTOMREQUEST, r->method);
+   }
+
+   r->resp_len = 0;
+   r->resp_headers_len = 0;
+   r->resp_headers[0] = '\0';
+   r->attempts++;
+
+   return curl_multi_add_handle(multi, r->curl) != CURLM_OK;
+}
+
+static void refill(void) {
+
+   long now = now_ms();
+
+   bucket += (now - bucket_ms) * rate / 1000.0;
+   if (bucket > burst)
+      bucket = burst;
+   bucket_ms = now;
+}
+
+/* Starts whatever is due while the bucket has tokens. Returns how long
+ * until the next queued request could go, or -1 if nothing waits. */
+static long dispatch(CURLM* multi) {
+
+   Relayed* r;
+   Relayed* prev = NULL;
+   Relayed* next;
+   long now = now_ms();
+   long wait = -1;
+   long until;
+
+   refill();
+
+   for (r = queue_head; r; r = next) {
+      next = r->next;
+
+      if (r->client == NULL) {
+         /* nobody is waiting for the answer any more */
+      } else if (r->not_before_ms > now) {
+         until = r->not_before_ms - now;
+         if (wait < 0 || until < wait)
+            wait = until;
+         prev = r;
+         continue;
+      } else if (bucket < 1.0 || inflight >= MAX_INFLIGHT) {
+         until = bucket < 1.0 ? (long)((1.0 - bucket) * 1000.0 / rate) + 1 : WAIT_MS_MAX;
+         if (wait < 0 || until < wait)
+            wait = until;
+         break;
+      } else if (upstream_start(multi, r) == 0) {
+         bucket -= 1.0;
+         inflight++;
+      } else {
+         client_respond(r->client, 502, NULL, NULL, "", 0);
+         r->client->pending = NULL;
+         r->client = NULL;
+      }
+
+      /* unlink r, it is either running or done */
+      if (prev)
+         prev->next = next;
+      else
+         queue_head = next;
+      if (queue_tail == r)
+         queue_tail = prev;
+      if (r->client == NULL)
+         relayed_free(r);
+   }
+
+   return wait;
+}
+
+static int retryable(Relayed* r, CURLcode rc, long status) {
+
+   long sent = 0;
+
+   if (r->client == NULL || r->attempts >= MAX_ATTEMPTS)
+      return 0;
+   if (rc == CURLE_OK)
+      return r->idempotent && (status == 429 || status >= 500);
+   if (r->idempotent)
+      return 1;
+   /* a create is only safe to repeat if it never left */
+   curl_easy_getinfo(r->curl, CURLINFO_REQUEST_SIZE, &sent);
+   return sent == 0;
+}
+
+static void finished(CURLM* multi) {
+
+   CURLMsg* msg;
+   Relayed* r;
+   char* type = NULL;
+   long status = 0;
+   long backoff;
+   int msgs;
+
+   while ((msg = curl_multi_info_read(multi, &msgs)) != NULL) {
+      if (msg->msg != CURLMSG_DONE)
+         continue;
+
+      curl_easy_getinfo(msg->easy_handle, CURLINFO_PRIVATE, (char**)&r);
+      curl_easy_getinfo(msg->easy_handle, CURLINFO_RESPONSE_CODE, &status);
+      curl_multi_remove_handle(multi, msg->easy_handle);
+      inflight--;
+
+      if (retryable(r, msg->data.result, status)) {
+         backoff = 100L << (r->attempts - 1);
+         r->not_before_ms = now_ms() + backoff / 2 + rand() % (backoff / 2 + 1);
+         enqueue(r);
+         continue;
+      }
+
+      if (r->client) {
+         if (msg->data.result != CURLE_OK) {
+            if (options.verbose)
+               fprintf(stderr, "%s: %s\n", r->url, curl_easy_strerror(msg->data.result));
+            client_respond(r->client, 502, NULL, NULL, "", 0);
+         } else {
+            curl_easy_getinfo(r->curl, CURLINFO_CONTENT_TYPE, &type);
+            client_respond(r->client, status, type, r->resp_headers, r->resp, r->resp_len);
+         }
+         r->client->pending = NULL;
+      }
+      relayed_free(r);
+   }
+}
+
+/* headers points at the CRLF that ends the request line */
+static const char* header_value(char* headers, const char* name, size_t* len) {
+
+   char* line;
+   const char* value;
+   size_t name_len = strlen(name);
+
+   for (line = headers; line; line = strstr(line, "\r\n")) {
+      line += 2;
+      if (strncasecmp(line, name, name_len) == 0 && line[name_len] == ':') {
+         value = line + name_len + 1;
+         value += strspn(value, " \t");
+         *len = strcspn(value, "\r\n");
+         return value;
+      }
+   }
+   return NULL;
+}
+
+/* Turns the next buffered request into a Relayed. Returns the bytes it
+ * took, 0 if it is still incomplete and -1 for garbage. */
+static ssize_t parse_request(Client* c, Relayed** out) {
+
+   Relayed* r;
+   char* end;
+   char* headers;
+   char* path;
+   const char* const* name;
+   const char* value;
+   char line[MAX_URL];
+   size_t head_len;
+   size_t body_len = 0;
+   size_t len;
+
+   *out = NULL;
+   if ((end = memmem(c->in, c->have, "\r\n\r\n", 4)) == NULL)
+      return c->have >= sizeof(c->in) ? -1 : 0;
+   head_len = (size_t)(end - c->in) + 4;
+   end[2] = '\0';
+
+   headers = strstr(c->in, "\r\n");
+   if ((value = header_value(headers, "Content-Length", &len)) != NULL)
+      body_len = strtoul(value, NULL, 10);
+   if (head_len + body_len > sizeof(c->in))
+      return -1;
+   if (c->have < head_len + body_len) {
+      end[2] = '\r';
+      return 0;
+   }
+
+   if ((r = calloc(1, sizeof(*r))) == NULL)
+      return -1;
+   r->client = c;
+
+   /* request line */
+   len = strcspn(c->in, " ");
+   if (len == 0 || len >= sizeof(r->method) || c->in[len] != ' ')
+      goto error;
+   memcpy(r->method, c->in, len);
+   path = c->in + len + 1;
+   len = strcspn(path, " \r");
+   if (len == 0 || path[0] != '/')
+      goto error;
+   path[len] = '\0';
+
+   value = header_value(headers, "Connection", &len);
+   c->keep_alive = !(value && strncasecmp(value, "close", 5) == 0);
+   if ((value = header_value(headers, "Host", &len)) != NULL && len < sizeof(r->host)) {
+      memcpy(r->host, value, len);
+   } else {
+      snprintf(r->host, sizeof(r->host), "%s", RELAY_ADDRESS);
+   }
+
+   if (strncmp(path, "/v1/snitches", 12) == 0 && (path[12] == '\0' || strchr("/?", path[12]))) {
+      snprintf(r->url, sizeof(r->url), "%s%s", upstream_api, path + 12);
+      /* only a create is not safe to repeat */
+      r->idempotent = !(strcmp(r->method, "POST") == 0 && (path[12] == '\0' || path[12] == '?'));
+   } else if (path[1] && strchr(path + 1, '/') == NULL) {
+      snprintf(r->url, sizeof(r->url), "%s%s", upstream_check_in, path);
+      r->idempotent = 1;
+   } else {
+      r->url[0] = '\0';
+   }
+
+   /* the credentials, validators and body go upstream as they came; a
+    * compressed answer comes back as it is, libcurl only decodes what
+    * it asked for itself */
+   for (name = forward_request; *name; name++) {
+      if ((value = header_value(headers, *name, &len)) != NULL) {
+         snprintf(line, sizeof(line), "%s: %.*s", *name, (int)len, value);
+         r->headers = curl_slist_append(r->headers, line);
+      }
+   }
+   r->headers = curl_slist_append(r->headers, "User-Agent: dms-relay");
+   r->headers = curl_slist_append(r->headers, "Expect:");
+
+   if (body_len) {
+      if ((r->body = malloc(body_len)) == NULL)
+         goto error;
+      memcpy(r->body, c->in + head_len, body_len);
+      r->body_len = body_len;
+   }
+
+   *out = r;
+   return (ssize_t)(head_len + body_len);
+error:
+   relayed_free(r);
+   return -1;
+}
+
+static void client_close(Client* c) {
+
+   if (c->pending)
+      c->pending->client = NULL;
+   close(c->fd);
+   c->fd = -1;
+}
+
+/* takes the next request off the input while the client has none running */
+static void client_process(Client* c) {
+
+   Relayed* r;
+   ssize_t used;
+
+   if (c->pending || c->out || c->have == 0)
+      return;
+
+   if ((used = parse_request(c, &r)) < 0) {
+      c->keep_alive = 0;
+      client_respond(c, 400, NULL, NULL, "", 0);
+      c->have = 0;
+      return;
+   }
+   if (used == 0)
+      return;
+
+   memmove(c->in, c->in + used, c->have - (size_t)used);
+   c->have -= (size_t)used;
+
+   if (r->url[0] == '\0') {
+      client_respond(c, 404, NULL, NULL, "", 0);
+      relayed_free(r);
+      return;
+   }
+   c->pending = r;
+   enqueue(r);
+}
+
+static void client_read(Client* c) {
+
+   ssize_t n;
+
+   n = read(c->fd, c->in + c->have, sizeof(c->in) - c->have);
+   if (n == 0 || (n < 0 && errno != EAGAIN && errno != EINTR)) {
+      client_close(c);
+      return;
+   }
+   if (n > 0)
+      c->have += (size_t)n;
+   client_process(c);
+}
+
+static void client_write(Client* c) {
+
+   ssize_t n;
+
+   n = write(c->fd, c->out + c->out_pos, c->out_len - c->out_pos);
+   if (n < 0) {
+      if (errno != EAGAIN && errno != EINTR)
+         client_close(c);
+      return;
+   }
+   c->out_pos += (size_t)n;
+   if (c->out_pos < c->out_len)
+      return;
+
+   free(c->out);
+   c->out = NULL;
+   if (!c->keep_alive) {
+      client_close(c);
+      return;
+   }
+   /* a pipelined request may already be waiting */
+   client_process(c);
+}
+
+static void accept_clients(int listen_fd) {
+
+   Client* c;
+   int fd;
+   int one = 1;
+
+   while ((fd = accept4(listen_fd, NULL, NULL, SOCK_NONBLOCK | SOCK_CLOEXEC)) >= 0) {
+      if (nclients == MAX_CLIENTS || (c = calloc(1, sizeof(*c))) == NULL) {
+         close(fd);
+         continue;
+      }
+      setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+      c->fd = fd;
+      c->keep_alive = 1;
+      clients[nclients++] = c;
+   }
+}
+
+static int listen_on(const char* address, int port) {
+
+   struct sockaddr_in addr;
+   int one = 1;
+   int fd;
+
+   memset(&addr, 0, sizeof(addr));
+   addr.sin_family = AF_INET;
+   addr.sin_port = htons((uint16_t)port);
+   if (inet_pton(AF_INET, address, &addr.sin_addr) != 1) {
+      fprintf(stderr, "%s: not an IPv4 address\n", address);
+      return -1;
+   }
+
+   if ((fd = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0)) < 0) {
+      fprintf(stderr, "socket: %s\n", strerror(errno));
+      return -1;
+   }
+   setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+   if (bind(fd, (struct sockaddr*)&addr, sizeof(addr)) < 0 || listen(fd, 512) < 0) {
+      fprintf(stderr, "%s:%d: %s\n", address, port, strerror(errno));
+      close(fd);
+      return -1;
+   }
+   return fd;
+}
+
+static void print_usage(void) {
+   static char const usage[] = "\
+Usage: dms-relay [OPTIONS]\n\
+Options:\n\
+   -l    address to listen on (default " RELAY_ADDRESS ")\n\
+   -p    port to listen on (default 8080)\n\
+   -r    upstream requests per second (default 50)\n\
+   -b    burst of upstream requests allowed above the rate (default 100)\n\
+   -c    upstream connections per host (default 2)\n\
+   -v    display version information and exit\n\
+   -h    display this help text and exit\n\
+";
+
+   printf(usage);
+}
+
+int main(int argc, char* argv[]) {
+
+   struct curl_waitfd fds[MAX_CLIENTS + 1];
+   CURLM* multi;
+   const char* address = RELAY_ADDRESS;
+   char conf_file[PATH_MAX];
+   char* env;
+   int port = RELAY_PORT;
+   long connections = DEFAULT_CONNECTIONS;
+   int listen_fd;
+   int running;
+   int numfds;
+   long timeout;
+   long wait;
+   int nfds;
+   int i;
+   int j;
+   int c;
+
+   while ((c = getopt(argc, argv, "l:p:r:b:c:vh")) != -1) {
+      switch (c) {
+      case 'l':
+         address = optarg;
+         break;
+      case 'p':
+         port = (int)strtol(optarg, NULL, 10);
+         break;
+      case 'r':
+         rate = strtod(optarg, NULL);
+         break;
+      case 'b':
+         burst = strtod(optarg, NULL);
+         break;
+      case 'c':
+         connections = strtol(optarg, NULL, 10);
+         break;
+      case 'v':
+         printf("dms-relay " PACKAGE_VERSION " " PACKAGE_URL "\n");
+         return 0;
+      default:
+         print_usage();
+         return 0;
+      }
+   }
+   if (rate <= 0 || burst < 1 || connections < 1) {
+      print_usage();
+      return 1;
+   }
+   bucket = burst;
+
+   /* only the upstream URLs and verbosity are of interest here */
+   initialize_options(&options);
+   env = getenv("CONFIG");
+   strncpy(conf_file, env ? env : CONF_FILE, PATH_MAX - 1);
+   conf_file[PATH_MAX - 1] = '\0';
+   if (access(conf_file, R_OK) == 0 && read_config_file(conf_file, &options)) {
+      return 1;
+   }
+   if (options.api_url)
+      upstream_api = options.api_url;
+   if (options.check_in_url)
+      upstream_check_in = options.check_in_url;
+
+   if (curl_global_init(CURL_GLOBAL_ALL)) {
+      fprintf(stderr, "CURL global initialization failed\n");
+      return 1;
+   }
+   if ((multi = curl_multi_init()) == NULL) {
+      fprintf(stderr, "CURL multi initialization failed\n");
+      return 1;
+   }
+   curl_multi_setopt(multi, CURLMOPT_PIPELINING, (long)CURLPIPE_MULTIPLEX);
+   curl_multi_setopt(multi, CURLMOPT_MAX_HOST_CONNECTIONS, connections);
+
+   if ((listen_fd = listen_on(address, port)) < 0) {
+      return 1;
+   }
+
+   dms_daemon_install_signals();
+   bucket_ms = now_ms();
+
+   while (!dms_daemon_should_stop()) {
+
+      wait = dispatch(multi);
+
+      fds[0].fd = listen_fd;
+      fds[0].events = CURL_WAIT_POLLIN;
+      fds[0].revents = 0;
+      nfds = 1;
+      for (i = 0; i < nclients; i++, nfds++) {
+         fds[nfds].fd = clients[i]->fd;
+         fds[nfds].events = clients[i]->out ? CURL_WAIT_POLLOUT
+                          : clients[i]->pending ? 0 : CURL_WAIT_POLLIN;
+         fds[nfds].revents = 0;
+      }
+
+      curl_multi_timeout(multi, &timeout);
+      if (timeout < 0 || timeout > WAIT_MS_MAX)
+         timeout = WAIT_MS_MAX;
+      if (wait >= 0 && wait < timeout)
+         timeout = wait;
+      curl_multi_wait(multi, fds, (unsigned int)nfds, (int)timeout, &numfds);
+
+      curl_multi_perform(multi, &running);
+      finished(multi);
+
+      for (i = 0; i < nclients; i++) {
+         if (fds[i + 1].revents & CURL_WAIT_POLLIN)
+            client_read(clients[i]);
+         else if (fds[i + 1].revents & CURL_WAIT_POLLOUT)
+            client_write(clients[i]);
+         /* answers that arrived in this round go out right away */
+         if (clients[i]->fd >= 0 && clients[i]->out && !(fds[i + 1].revents & CURL_WAIT_POLLOUT))
+            client_write(clients[i]);
+      }
+      if (fds[0].revents & CURL_WAIT_POLLIN)
+         accept_clients(listen_fd);
+
+      /* drop closed clients */
+      for (i = 0, j = 0; i < nclients; i++) {
+         if (clients[i]->fd < 0) {
+            free(clients[i]->out);
+            free(clients[i]);
+         } else {
+            clients[j++] = clients[i];
+         }
+      }
+      nclients = j;
+   }
+
+   for (i = 0; i < nclients; i++) {
+      client_close(clients[i]);
+      free(clients[i]->out);
+      free(clients[i]);
+   }
+   close(listen_fd);
+   curl_multi_cleanup(multi);
+   curl_global_cleanup();
+   free_options(&options);
+
+   return 0;
+}
@@ -0,0 +1,137 @@
+// vim:set et ts=3 sw=3:
+//  _____ _         _____                                 _       
+// |  __ (_)       |  __ \                               | |      
+// | |__) | _ __   | |__) |_ _ _   _ _ __ ___   ___ _ __ | |_ ___ 
+// |  ___/ | '_ \  |  ___/ _` | | | | '_ ` _ \ / _ \ '_ \| __/ __|
+// | |   | | | | | | |  | (_| | |_| | | | | | |  __/ | | | |_\__ \
+// |_|   |_|_| |_| |_|   \__,_|\__, |_| |_| |_|\___|_| |_|\__|___/
+//                              __/ |                             
+//                             |___/                              
+// Copyright (C) 2018 Pin Payments
+// http://pinpayments.com
+// 
+// This software is provided 'as-is', without any express or implied
+// warranty.  In no event will the authors be held liable for any damages
+// arising from the use of this software.
+// 
+// Permission is granted to anyone to use this software for any purpose,
+// including commercial applications, and to alter it and redistribute it
+// freely, subject to the following restrictions:
+// 
+// 1. The origin of this software must not be misrepresented; you must not
+//    claim that you wrote the original software. If you use this software
+//    in a product, an acknowledgment in the product documentation would be
+//    appreciated but is not required.
+// 2. Altered source versions must be plainly marked as such, and must not be
+//    misrepresented as being the original software.
+// 3. This notice may not be removed or altered from any source distribution.
+
+#include <dms-run.h>
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <signal.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/resource.h>
+#include <sys/time.h>
+#include <sys/types.h>
+#include <sys/wait.h>
+
+static double elapsed_s(const struct timespec* from) {
+
+   struct timespec now;
+
+   clock_gettime(CLOCK_MONOTONIC, &now);
+   return (double)(now.tv_sec - from->tv_sec) + (double)(now.tv_nsec - from->tv_nsec) / 1e9;
+}
+
+static double timeval_s(const struct timeval* tv) {
+
+   return (double)tv->tv_sec + (double)tv->tv_usec / 1e6;
+}
+
+/* Runs argv to completion and collects its resource usage. SIGCHLD is
+ * held blocked so the wait between idle calls is a sigtimedwait rather
+ * than a poll loop; like system() we shrug off the terminal's SIGINT and
+ * SIGQUIT meanwhile and leave them to the command. Returns 0 once the
+ * command ran, whatever its exit status, and 1 if it could not be run. */
+int dms_run_command(char* const argv[], long interval, dms_run_idle_fn idle, void* user, RunUsage* usage) {
+
+   struct sigaction ignore;
+   struct sigaction old_int;
+   struct sigaction old_quit;
+   struct timespec start;
+   struct timespec wait_for;
+   struct rusage ru;
+   sigset_t chld;
+   sigset_t old_mask;
+   int status;
+   pid_t pid;
+   pid_t rv;
+
+   memset(usage, 0, sizeof(*usage));
+
+   sigemptyset(&chld);
+   sigaddset(&chld, SIGCHLD);
+   sigprocmask(SIG_BLOCK, &chld, &old_mask);
+
+   memset(&ignore, 0, sizeof(ignore));
+   ignore.sa_handler = SIG_IGN;
+   sigemptyset(&ignore.sa_mask);
+   sigaction(SIGINT, &ignore, &old_int);
+   sigaction(SIGQUIT, &ignore, &old_quit);
+
+   clock_gettime(CLOCK_MONOTONIC, &start);
+
+   if ((pid = fork()) < 0) {
+      fprintf(stderr, "fork failed: %s\n", strerror(errno));
+      rv = -1;
+      goto out;
+   }
+   if (pid == 0) {
+      sigaction(SIGINT, &old_int, NULL);
+      sigaction(SIGQUIT, &old_quit, NULL);
+      sigprocmask(SIG_SETMASK, &old_mask, NULL);
+      execvp(argv[0], argv);
+      fprintf(stderr, "%s: %s\n", argv[0], strerror(errno));
+      _exit(127);
+   }
+
+   if (idle)
+      idle(user);
+
+   wait_for.tv_sec = interval > 0 ? interval : 60;
+   wait_for.tv_nsec = 0;
+   while ((rv = wait4(pid, &status, WNOHANG, &ru)) == 0) {
+      if (sigtimedwait(&chld, NULL, &wait_for) < 0 && errno == EAGAIN && idle)
+         idle(user);
+   }
+   if (rv < 0)
+      fprintf(stderr, "wait failed: %s\n", strerror(errno));
+
+out:
+   sigaction(SIGINT, &old_int, NULL);
+   sigaction(SIGQUIT, &old_quit, NULL);
+   sigprocmask(SIG_SETMASK, &old_mask, NULL);
+
+   if (rv < 0)
+      return 1;
+
+   usage->wall_s = elapsed_s(&start);
+   usage->user_s = timeval_s(&ru.ru_utime);
+   usage->sys_s = timeval_s(&ru.ru_stime);
+   usage->maxrss_kb = ru.ru_maxrss;
+   usage->inblock = ru.ru_inblock;
+   usage->oublock = ru.ru_oublock;
+   if (WIFEXITED(status))
+      usage->exit_status = WEXITSTATUS(status);
+   else if (WIFSIGNALED(status))
+      usage->exit_status = 128 + WTERMSIG(status);
+   else
+      usage->exit_status = 1;
+
+   return 0;
+}
@@ -0,0 +1,48 @@
+// vim:set et ts=3 sw=3:
+//  _____ _         _____                                 _       
+// |  __ (_)       |  __ \                               | |      
+// | |__) | _ __   | |__) |_ _ _   _ _ __ ___   ___ _ __ | |_ ___ 
+// |  ___/ | '_ \  |  ___/ _` | | | | '_ ` _ \ / _ \ '_ \| __/ __|
+// | |   | | | | | | |  | (_| | |_| | | | | | |  __/ | | | |_\__ \
+// |_|   |_|_| |_| |_|   \__,_|\__, |_| |_| |_|\___|_| |_|\__|___/
+//                              __/ |                             
+//                             |___/                              
+// Copyright (C) 2018 Pin Payments
+// http://pinpayments.com
+// 
+// This software is provided 'as-is', without any express or implied
+// warranty.  In no event will the authors be held liable for any damages
+// arising from the use of this software.
+// 
+// Permission is granted to anyone to use this software for any purpose,
+// including commercial applications, and to alter it and redistribute it
+// freely, subject to the following restrictions:
+// 
+// 1. The origin of this software must not be misrepresented; you must not
+//    claim that you wrote the original software. If you use this software
+//    in a product, an acknowledgment in the product documentation would be
+//    appreciated but is not required.
+// 2. Altered source versions must be plainly marked as such, and must not be
+//    misrepresented as being the original software.
+// 3. This notice may not be removed or altered from any source distribution.
+
+#ifndef DMS_RUN_H
+#define DMS_RUN_H
+
+typedef struct {
+   int         exit_status;   /* 128 + signal when it was killed */
+   double      wall_s;
+   double      user_s;
+   double      sys_s;
+   long        maxrss_kb;
+   long        inblock;
+   long        oublock;
+} RunUsage;
+
+/* called once the command is started and then every interval seconds
+ * while it runs */
+typedef void (*dms_run_idle_fn)(void* user);
+
+int   dms_run_command(char* const argv[], long interval, dms_run_idle_fn idle, void* user, RunUsage* usage);
+
+#endif // DMS_RUN_H
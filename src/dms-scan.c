@@ -0,0 +1,453 @@
+// vim:set et ts=3 sw=3:
+//  _____ _         _____                                 _       
+// |  __ (_)       |  __ \                               | |      
+// | |__) | _ __   | |__) |_ _ _   _ _ __ ___   ___ _ __ | |_ ___ 
+// |  ___/ | '_ \  |  ___/ _` | | | | '_ ` _ \ / _ \ '_ \| __/ __|
+// | |   | | | | | | |  | (_| | |_| | | | | | |  __/ | | | |_\__ \
+// |_|   |_|_| |_| |_|   \__,_|\__, |_| |_| |_|\___|_| |_|\__|___/
+//                              __/ |                             
+//                             |___/                              
+// Copyright (C) 2018 Pin Payments
+// http://pinpayments.com
+// 
+// This software is provided 'as-is', without any express or implied
+// warranty.  In no event will the authors be held liable for any damages
+// arising from the use of this software.
+// 
+// Permission is granted to anyone to use this software for any purpose,
+// including commercial applications, and to alter it and redistribute it
+// freely, subject to the following restrictions:
+// 
+// 1. The origin of this software must not be misrepresented; you must not
+//    claim that you wrote the original software. If you use this software
+//    in a product, an acknowledgment in the product documentation would be
+//    appreciated but is not required.
+// 2. Altered source versions must be plainly marked as such, and must not be
+//    misrepresented as being the original software.
+// 3. This notice may not be removed or altered from any source distribution.
+
+#include <dms-scan.h>
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <limits.h>
+#include <time.h>
+#include <dirent.h>
+#include <pthread.h>
+#include <spawn.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+#include <sys/wait.h>
+
+#define SCAN_MAX_WORKERS 256
+/* a batch is handed to the scanner once it has this many files or this
+ * many bytes of path names, whichever comes first */
+#define SCAN_BATCH_FILES 256
+#define SCAN_BATCH_BYTES (64 * 1024)
+#define SCAN_IDLE_NS 1000000L
+
+extern char** environ;
+
+/* directories waiting to be read; the owner works from the tail, thieves
+ * take from the head, so stolen work is the shallowest and biggest */
+struct scan_deque {
+   pthread_mutex_t   lock;
+   char**            dirs;
+   size_t            head;
+   size_t            tail;
+   size_t            cap;
+};
+
+struct scan_worker {
+   struct scan_pool*    pool;
+   int                  id;
+   pthread_t            thread;
+   struct scan_deque    deque;
+   const char*          argv[SCAN_BATCH_FILES + 3];
+   int                  nfiles;
+   size_t               bytes;
+   ScanResult           result;
+};
+
+struct scan_pool {
+   struct scan_worker*  workers;
+   int                  nworkers;
+   const char*          scanner;
+   unsigned long        pending;       /* directories queued or being read */
+   pthread_mutex_t      lock;
+   pthread_cond_t       done_cond;
+   int                  done;
+};
+
+static int deque_push(struct scan_deque* d, char* dir) {
+
+   char** grown;
+   size_t n;
+
+   pthread_mutex_lock(&d->lock);
+   if (d->tail == d->cap) {
+      /* slide down what thieves left behind before growing */
+      n = d->tail - d->head;
+      if (d->head > 0 && n < d->cap / 2) {
+         memmove(d->dirs, d->dirs + d->head, n * sizeof(*d->dirs));
+      } else {
+         if ((grown = realloc(d->dirs, (d->cap ? d->cap * 2 : 64) * sizeof(*d->dirs))) == NULL) {
+            pthread_mutex_unlock(&d->lock);
+            return 1;
+         }
+         d->dirs = grown;
+         d->cap = d->cap ? d->cap * 2 : 64;
+         memmove(d->dirs, d->dirs + d->head, n * sizeof(*d->dirs));
+      }
+      d->head = 0;
+      d->tail = n;
+   }
+   d->dirs[d->tail++] = dir;
+   pthread_mutex_unlock(&d->lock);
+   return 0;
+}
+
+static char* deque_pop(struct scan_deque* d) {
+
+   char* dir = NULL;
+
+   pthread_mutex_lock(&d->lock);
+   if (d->tail > d->head)
+      dir = d->dirs[--d->tail];
+   pthread_mutex_unlock(&d->lock);
+   return dir;
+}
+
+static char* deque_steal(struct scan_deque* d) {
+
+   char* dir = NULL;
+
+   pthread_mutex_lock(&d->lock);
+   if (d->tail > d->head)
+      dir = d->dirs[d->head++];
+   pthread_mutex_unlock(&d->lock);
+   return dir;
+}
+
+/* the scanner's exit status over the batch, -1 if it didn't get to one */
+static int run_scanner(struct scan_worker* w) {
+
+   pid_t pid;
+   int status;
+   int rc;
+
+   w->argv[0] = w->pool->scanner;
+   w->argv[1] = "--no-summary";
+   w->argv[w->nfiles + 2] = NULL;
+
+   if ((rc = posix_spawnp(&pid, w->pool->scanner, NULL, NULL, (char* const*)w->argv, environ)) != 0) {
+      fprintf(stderr, "%s: %s\n", w->pool->scanner, strerror(rc));
+      return -1;
+   }
+   while (waitpid(pid, &status, 0) < 0 && errno == EINTR)
+      ;
+   return WIFEXITED(status) ? WEXITSTATUS(status) : -1;
+}
+
+/* drops the files that are gone since the walk, returns how many */
+static int drop_vanished(struct scan_worker* w) {
+
+   struct stat st;
+   int kept = 0;
+   int i;
+
+   for (i = 0; i < w->nfiles; i++) {
+      if (lstat(w->argv[i + 2], &st) < 0 && errno == ENOENT)
+         free((char*)w->argv[i + 2]);
+      else
+         w->argv[kept++ + 2] = w->argv[i + 2];
+   }
+   i = w->nfiles - kept;
+   w->nfiles = kept;
+   return i;
+}
+
+/* Hands the batch to the scanner and waits for it. clamdscan and clamscan
+ * both exit 1 when they found something and 2 on errors, which includes
+ * a file deleted between the walk and the scan. On a live file system
+ * that happens all the time, so an error batch that lost files is
+ * scanned again without them, and only counts as failed if the rest
+ * still fails. */
+static void flush_batch(struct scan_worker* w) {
+
+   int rc;
+   int i;
+
+   if (w->nfiles == 0)
+      return;
+
+   w->result.batches++;
+   rc = run_scanner(w);
+   if (rc == 2 && drop_vanished(w) > 0) {
+      rc = w->nfiles > 0 ? run_scanner(w) : 0;
+      if (rc == 0)
+         w->result.vanished++;
+   }
+   if (rc == 1)
+      w->result.infected++;
+   else if (rc != 0)
+      w->result.failed++;
+
+   for (i = 0; i < w->nfiles; i++)
+      free((char*)w->argv[i + 2]);
+   w->nfiles = 0;
+   w->bytes = 0;
+}
+
+static void add_file(struct scan_worker* w, char* path) {
+
+   w->argv[w->nfiles + 2] = path;
+   w->nfiles++;
+   w->bytes += strlen(path) + 1;
+   w->result.files++;
+   if (w->nfiles == SCAN_BATCH_FILES || w->bytes >= SCAN_BATCH_BYTES)
+      flush_batch(w);
+}
+
+static char* join(const char* dir, const char* name) {
+
+   size_t dlen = strlen(dir);
+   size_t nlen = strlen(name);
+   char* path;
+
+   if ((path = malloc(dlen + nlen + 2)) == NULL)
+      return NULL;
+   memcpy(path, dir, dlen);
+   path[dlen] = '/';
+   memcpy(path + dlen + 1, name, nlen + 1);
+   return path;
+}
+
+/* Regular files go into the batch, subdirectories onto our own deque.
+ * Symbolic links are not followed. */
+static void read_dir(struct scan_worker* w, const char* dir) {
+
+   struct dirent* de;
+   struct stat st;
+   DIR* d;
+   char* path;
+   int type;
+
+   if ((d = opendir(dir)) == NULL) {
+      fprintf(stderr, "%s: %s\n", dir, strerror(errno));
+      w->result.unreadable++;
+      return;
+   }
+
+   while ((de = readdir(d)) != NULL) {
+      if (de->d_name[0] == '.' && (de->d_name[1] == '\0'
+          || (de->d_name[1] == '.' && de->d_name[2] == '\0')))
+         continue;
+      if ((path = join(dir, de->d_name)) == NULL) {
+         w->result.unreadable++;
+         continue;
+      }
+
+      type = de->d_type;
+      if (type == DT_UNKNOWN) {
+         if (lstat(path, &st) < 0)
+            type = DT_UNKNOWN;
+         else if (S_ISDIR(st.st_mode))
+            type = DT_DIR;
+         else if (S_ISREG(st.st_mode))
+            type = DT_REG;
+      }
+
+      if (type == DT_DIR) {
+         __atomic_add_fetch(&w->pool->pending, 1, __ATOMIC_RELAXED);
+         if (deque_push(&w->deque, path)) {
+            __atomic_sub_fetch(&w->pool->pending, 1, __ATOMIC_RELAXED);
+            w->result.unreadable++;
+            free(path);
+         }
+      } else if (type == DT_REG) {
+         add_file(w, path);
+      } else {
+         free(path);
+      }
+   }
+   closedir(d);
+}
+
+static char* next_dir(struct scan_worker* w) {
+
+   struct scan_pool* pool = w->pool;
+   char* dir;
+   int i;
+
+   if ((dir = deque_pop(&w->deque)) != NULL)
+      return dir;
+   for (i = 1; i < pool->nworkers; i++) {
+      if ((dir = deque_steal(&pool->workers[(w->id + i) % pool->nworkers].deque)) != NULL)
+         return dir;
+   }
+   return NULL;
+}
+
+static void* scan_worker_main(void* arg) {
+
+   struct scan_worker* w = arg;
+   struct scan_pool* pool = w->pool;
+   struct timespec idle = { 0, SCAN_IDLE_NS };
+   char* dir;
+
+   for (;;) {
+      if ((dir = next_dir(w)) != NULL) {
+         read_dir(w, dir);
+         free(dir);
+         __atomic_sub_fetch(&pool->pending, 1, __ATOMIC_RELEASE);
+         continue;
+      }
+      /* nothing queued anywhere and nobody reading: the walk is over */
+      if (__atomic_load_n(&pool->pending, __ATOMIC_ACQUIRE) == 0)
+         break;
+      /* others are still reading, flush while we wait for their spill */
+      if (w->nfiles > 0)
+         flush_batch(w);
+      else
+         nanosleep(&idle, NULL);
+   }
+   flush_batch(w);
+
+   pthread_mutex_lock(&pool->lock);
+   pool->done++;
+   pthread_cond_signal(&pool->done_cond);
+   pthread_mutex_unlock(&pool->lock);
+
+   return NULL;
+}
+
+static double elapsed_s(const struct timespec* from) {
+
+   struct timespec now;
+
+   clock_gettime(CLOCK_MONOTONIC, &now);
+   return (double)(now.tv_sec - from->tv_sec) + (double)(now.tv_nsec - from->tv_nsec) / 1e9;
+}
+
+/* Walks roots on a work-stealing pool of worker threads, each handing
+ * batches of files to its own scanner process, so directories big and
+ * small spread over all of them. Roots that are files are scanned as
+ * they are. The caller's thread sits out, calling idle every interval
+ * seconds until the pool is done. Returns 0 when the pool ran; whether
+ * the scan succeeded is in result. */
+int dms_scan_run(char* const roots[], int nroots, const char* scanner, int workers,
+                 long interval, dms_run_idle_fn idle, void* user, ScanResult* result) {
+
+   struct scan_pool pool;
+   struct timespec start;
+   struct timespec until;
+   struct stat st;
+   char* root;
+   int started = 0;
+   int rv = 0;
+   int i;
+
+   memset(result, 0, sizeof(*result));
+   memset(&pool, 0, sizeof(pool));
+
+   if (workers < 1)
+      workers = 1;
+   if (workers > SCAN_MAX_WORKERS)
+      workers = SCAN_MAX_WORKERS;
+
+   if ((pool.workers = calloc(workers, sizeof(*pool.workers))) == NULL) {
+      fprintf(stderr, "out of memory\n");
+      return 1;
+   }
+   pool.nworkers = workers;
+   pool.scanner = scanner;
+   pthread_mutex_init(&pool.lock, NULL);
+   pthread_cond_init(&pool.done_cond, NULL);
+
+   for (i = 0; i < workers; i++) {
+      pool.workers[i].pool = &pool;
+      pool.workers[i].id = i;
+      pthread_mutex_init(&pool.workers[i].deque.lock, NULL);
+   }
+
+   /* deal the roots out round robin, stealing evens out the rest */
+   for (i = 0; i < nroots; i++) {
+      if (stat(roots[i], &st) < 0) {
+         fprintf(stderr, "%s: %s\n", roots[i], strerror(errno));
+         result->unreadable++;
+         continue;
+      }
+      if ((root = strdup(roots[i])) == NULL) {
+         result->unreadable++;
+         continue;
+      }
+      if (S_ISDIR(st.st_mode)) {
+         pool.pending++;
+         if (deque_push(&pool.workers[i % workers].deque, root)) {
+            pool.pending--;
+            result->unreadable++;
+            free(root);
+         }
+      } else {
+         add_file(&pool.workers[i % workers], root);
+      }
+   }
+
+   clock_gettime(CLOCK_MONOTONIC, &start);
+
+   for (i = 0; i < workers; i++) {
+      if (pthread_create(&pool.workers[i].thread, NULL, scan_worker_main, &pool.workers[i]) != 0) {
+         fprintf(stderr, "failed to start scan worker\n");
+         rv = 1;
+         break;
+      }
+      started++;
+   }
+
+   /* a worker that failed to start leaves its deque to the others */
+   pthread_mutex_lock(&pool.lock);
+   while (pool.done < started) {
+      clock_gettime(CLOCK_REALTIME, &until);
+      until.tv_sec += interval > 0 ? interval : 60;
+      if (pthread_cond_timedwait(&pool.done_cond, &pool.lock, &until) == ETIMEDOUT && idle) {
+         pthread_mutex_unlock(&pool.lock);
+         idle(user);
+         pthread_mutex_lock(&pool.lock);
+      }
+   }
+   pthread_mutex_unlock(&pool.lock);
+
+   for (i = 0; i < started; i++)
+      pthread_join(pool.workers[i].thread, NULL);
+
+   result->workers = started;
+   result->wall_s = elapsed_s(&start);
+   for (i = 0; i < workers; i++) {
+      /* whatever a worker that never started was holding */
+      if (i >= started) {
+         flush_batch(&pool.workers[i]);
+         while ((root = deque_pop(&pool.workers[i].deque)) != NULL) {
+            result->unreadable++;
+            free(root);
+         }
+      }
+      result->files += pool.workers[i].result.files;
+      result->batches += pool.workers[i].result.batches;
+      result->infected += pool.workers[i].result.infected;
+      result->failed += pool.workers[i].result.failed;
+      result->vanished += pool.workers[i].result.vanished;
+      result->unreadable += pool.workers[i].result.unreadable;
+      free(pool.workers[i].deque.dirs);
+      pthread_mutex_destroy(&pool.workers[i].deque.lock);
+   }
+
+   pthread_cond_destroy(&pool.done_cond);
+   pthread_mutex_destroy(&pool.lock);
+   free(pool.workers);
+
+   return rv || started == 0;
+}
@@ -0,0 +1,441 @@
+// vim:set et ts=3 sw=3:
+//  _____ _         _____                                 _       
+// |  __ (_)       |  __ \                               | |      
+// | |__) | _ __   | |__) |_ _ _   _ _ __ ___   ___ _ __ | |_ ___ 
+// |  ___/ | '_ \  |  ___/ _` | | | | '_ ` _ \ / _ \ '_ \| __/ __|
+// | |   | | | | | | |  | (_| | |_| | | | | | |  __/ | | | |_\__ \
+// |_|   |_|_| |_| |_|   \__,_|\__, |_| |_| |_|\___|_| |_|\__|___/
+//                              __/ |                             
+//                             |___/                              
+// Copyright (C) 2018 Pin Payments
+// http://pinpayments.com
+// 
+// This software is provided 'as-is', without any express or implied
+// warranty.  In no event will the authors be held liable for any damages
+// arising from the use of this software.
+// 
+// Permission is granted to anyone to use this software for any purpose,
+// including commercial applications, and to alter it and redistribute it
+// freely, subject to the following restrictions:
+// 
+// 1. The origin of this software must not be misrepresented; you must not
+//    claim that you wrote the original software. If you use this software
+//    in a product, an acknowledgment in the product documentation would be
+//    appreciated but is not required.
+// 2. Altered source versions must be plainly marked as such, and must not be
+//    misrepresented as being the original software.
+// 3. This notice may not be removed or altered from any source distribution.
+
+#include <dms-sched.h>
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <poll.h>
+#include <time.h>
+
+#include <dms-daemon.h>
+
+/* Four levels of 64 one-second slots reach about 194 days ahead; the
+ * rare entry further out parks in the top level and comes back down as
+ * the wheel turns. */
+#define WHEEL_BITS 6
+#define WHEEL_SLOTS (1 << WHEEL_BITS)
+#define WHEEL_MASK (WHEEL_SLOTS - 1)
+#define WHEEL_LEVELS 4
+#define WHEEL_SPAN ((int64_t)1 << (WHEEL_BITS * WHEEL_LEVELS))
+#define WHEEL_NONE UINT32_MAX
+
+/* first check-ins are spread over at most this many seconds after start */
+#define SCHED_START_SPREAD 300
+/* and every period is shortened by up to a tenth, differently per token,
+ * so snitches that started together drift apart and none reports late */
+#define SCHED_JITTER_DIVISOR 10
+#define SCHED_RETRY_SECONDS 30
+#define SCHED_MAX_BACKOFF_SHIFT 8
+
+struct wheel {
+   int64_t     now;
+   uint32_t    slot[WHEEL_LEVELS][WHEEL_SLOTS];
+};
+
+static uint32_t hash_token(const char* token, uint32_t seed) {
+
+   uint32_t h = 2166136261u ^ seed;
+
+   while (*token) {
+      h ^= (unsigned char)*token++;
+      h *= 16777619u;
+   }
+   return h;
+}
+
+static int grow(void** column, size_t size, uint32_t cap) {
+
+   void* grown;
+
+   if ((grown = realloc(*column, size * cap)) == NULL)
+      return 1;
+   *column = grown;
+   return 0;
+}
+
+static uint32_t add_string(SnitchTable* t, const char* s) {
+
+   size_t len = strlen(s) + 1;
+   uint32_t offset = t->strings_len;
+   uint32_t cap;
+
+   if (t->strings_len + len > t->strings_cap) {
+      cap = t->strings_cap ? t->strings_cap : 4096;
+      while (t->strings_len + len > cap)
+         cap *= 2;
+      if (grow((void**)&t->strings, 1, cap))
+         return WHEEL_NONE;
+      t->strings_cap = cap;
+   }
+   memcpy(t->strings + offset, s, len);
+   t->strings_len += len;
+   return offset;
+}
+
+/* All memory is taken here, while loading; running takes none. */
+int dms_sched_add(SnitchTable* t, const char* name, const char* token, uint32_t interval, uint32_t deadline_ms) {
+
+   uint32_t cap;
+   uint32_t jitter;
+   uint32_t i;
+
+   if (interval == 0)
+      return 1;
+
+   if (t->count == t->cap) {
+      cap = t->cap ? t->cap * 2 : 256;
+      if (grow((void**)&t->name, sizeof(*t->name), cap)
+          || grow((void**)&t->token, sizeof(*t->token), cap)
+          || grow((void**)&t->interval, sizeof(*t->interval), cap)
+          || grow((void**)&t->period, sizeof(*t->period), cap)
+          || grow((void**)&t->deadline_ms, sizeof(*t->deadline_ms), cap)
+          || grow((void**)&t->due, sizeof(*t->due), cap)
+          || grow((void**)&t->link, sizeof(*t->link), cap)
+          || grow((void**)&t->status, sizeof(*t->status), cap)
+          || grow((void**)&t->failures, sizeof(*t->failures), cap)) {
+         fprintf(stderr, "out of memory\n");
+         return 1;
+      }
+      t->cap = cap;
+   }
+
+   i = t->count;
+   if ((t->name[i] = add_string(t, name)) == WHEEL_NONE
+       || (t->token[i] = add_string(t, token)) == WHEEL_NONE) {
+      fprintf(stderr, "out of memory\n");
+      return 1;
+   }
+
+   jitter = hash_token(token, 0) % (interval / SCHED_JITTER_DIVISOR + 1);
+   t->interval[i] = interval;
+   t->period[i] = interval - jitter;
+   t->deadline_ms[i] = deadline_ms;
+   t->due[i] = 1 + hash_token(token, 1) % (interval < SCHED_START_SPREAD ? interval : SCHED_START_SPREAD);
+   t->link[i] = WHEEL_NONE;
+   t->status[i] = SNITCH_NEVER;
+   t->failures[i] = 0;
+   t->count++;
+
+   return 0;
+}
+
+struct store_source {
+   SnitchTable*   table;
+   const Options* opts;
+};
+
+/* at the interval and deadline of the snitch's section, if it has one */
+int dms_sched_add_snitch(SnitchTable* t, const char* name, const char* token, const Options* opts) {
+
+   const SnitchConfig* sc = find_snitch_config(opts, name);
+   long interval = opts->check_in_interval;
+   long deadline_ms = 0;
+
+   if (sc && sc->interval) {
+      interval = sc->interval;
+   }
+   if (sc) {
+      deadline_ms = sc->deadline_ms;
+   }
+   return dms_sched_add(t, name, token, (uint32_t)interval, (uint32_t)deadline_ms);
+}
+
+static int add_from_store(const char* name, const char* token, void* user) {
+
+   struct store_source* src = user;
+
+   /* other systems' snitches, theirs to keep alive */
+   if (dms_tokens_is_bulk(name))
+      return 0;
+   return dms_sched_add_snitch(src->table, name, token, src->opts);
+}
+
+/* Every snitch of this system in the store, leaving out the ones -B
+ * provisioned for others. */
+int dms_sched_add_store(SnitchTable* t, const TokenStore* store, const Options* opts) {
+
+   struct store_source src;
+
+   src.table = t;
+   src.opts = opts;
+   return dms_tokens_each(store, add_from_store, &src);
+}
+
+void dms_sched_free(SnitchTable* t) {
+
+   free(t->strings);
+   free(t->name);
+   free(t->token);
+   free(t->interval);
+   free(t->period);
+   free(t->deadline_ms);
+   free(t->due);
+   free(t->link);
+   free(t->status);
+   free(t->failures);
+   memset(t, 0, sizeof(*t));
+}
+
+/* Level by how far off, slot by the due tick's own bits at that level,
+ * the way the classic hashed hierarchical wheels do it. */
+static void wheel_insert(struct wheel* w, SnitchTable* t, uint32_t i) {
+
+   int64_t due = t->due[i];
+   int64_t delta;
+   uint32_t* head;
+   int level;
+
+   /* due now goes in the slot about to be fired */
+   if (due < w->now)
+      due = w->now;
+   delta = due - w->now;
+   if (delta >= WHEEL_SPAN)
+      due = w->now + WHEEL_SPAN - 1;
+
+   for (level = 0; level < WHEEL_LEVELS - 1; level++) {
+      if (delta < ((int64_t)1 << (WHEEL_BITS * (level + 1))))
+         break;
+   }
+   head = &w->slot[level][(due >> (WHEEL_BITS * level)) & WHEEL_MASK];
+   t->link[i] = *head;
+   *head = i;
+}
+
+static uint32_t wheel_take(uint32_t* head) {
+
+   uint32_t list = *head;
+
+   *head = WHEEL_NONE;
+   return list;
+}
+
+static void reschedule(SnitchTable* t, uint32_t i, int64_t now, int failed) {
+
+   int64_t backoff;
+   int shift;
+
+   if (!failed) {
+      t->status[i] = SNITCH_OK;
+      t->failures[i] = 0;
+      /* keep the phase, unless we fell a whole period behind */
+      t->due[i] += t->period[i];
+      if (t->due[i] <= now)
+         t->due[i] = now + t->period[i];
+      return;
+   }
+
+   t->status[i] = SNITCH_FAILED;
+   if (t->failures[i] < UINT8_MAX)
+      t->failures[i]++;
+   shift = t->failures[i] - 1 < SCHED_MAX_BACKOFF_SHIFT ? t->failures[i] - 1 : SCHED_MAX_BACKOFF_SHIFT;
+   backoff = (int64_t)SCHED_RETRY_SECONDS << shift;
+   t->due[i] = now + (backoff < t->period[i] ? backoff : t->period[i]);
+}
+
+/* Moves the wheel on by one tick: pulls the slots of the upper levels
+ * that come due down a level, then fires what is in the level 0 slot. */
+static void wheel_tick(struct wheel* w, SnitchTable* t, CURL* curl, sched_check_in_fn check_in) {
+
+   uint32_t list;
+   uint32_t i;
+   int level;
+   int rc;
+
+   w->now++;
+
+   for (level = 1; level < WHEEL_LEVELS; level++) {
+      if ((w->now & (((int64_t)1 << (WHEEL_BITS * level)) - 1)) != 0)
+         break;
+      list = wheel_take(&w->slot[level][(w->now >> (WHEEL_BITS * level)) & WHEEL_MASK]);
+      while (list != WHEEL_NONE) {
+         i = list;
+         list = t->link[i];
+         wheel_insert(w, t, i);
+      }
+   }
+
+   list = wheel_take(&w->slot[0][w->now & WHEEL_MASK]);
+   while (list != WHEEL_NONE && !dms_daemon_should_stop()) {
+      i = list;
+      list = t->link[i];
+      if (t->due[i] <= w->now) {
+         rc = check_in(curl, t->strings + t->name[i], t->strings + t->token[i], t->deadline_ms[i]);
+         if (rc)
+            fprintf(stderr, "check-in for %s failed (%d in a row)\n",
+                    t->strings + t->name[i], t->failures[i] + 1);
+         reschedule(t, i, w->now, rc != 0);
+      }
+      wheel_insert(w, t, i);
+   }
+   /* stopped half way, what is left goes back to keep the table whole */
+   while (list != WHEEL_NONE) {
+      i = list;
+      list = t->link[i];
+      wheel_insert(w, t, i);
+   }
+}
+
+static void wheel_build(struct wheel* w, SnitchTable* t) {
+
+   uint32_t i;
+
+   memset(w->slot, 0xff, sizeof(w->slot));
+   for (i = 0; i < t->count; i++)
+      wheel_insert(w, t, i);
+}
+
+/* Takes over the schedule of every snitch fresh shares with t, by name
+ * and token, found through an open-addressed index of t built just for
+ * this; snitches new to the table start within the start spread from
+ * now, as they would at startup. */
+static int carry_over(SnitchTable* t, SnitchTable* fresh, int64_t now) {
+
+   uint32_t* index;
+   uint32_t size = 16;
+   uint32_t h;
+   uint32_t i;
+   uint32_t j;
+
+   while (size < t->count * 2)
+      size *= 2;
+   if ((index = malloc(size * sizeof(*index))) == NULL)
+      return 1;
+   memset(index, 0xff, size * sizeof(*index));
+
+   for (i = 0; i < t->count; i++) {
+      h = hash_token(t->strings + t->token[i], 0) & (size - 1);
+      while (index[h] != WHEEL_NONE)
+         h = (h + 1) & (size - 1);
+      index[h] = i;
+   }
+
+   for (i = 0; i < fresh->count; i++) {
+      h = hash_token(fresh->strings + fresh->token[i], 0) & (size - 1);
+      while ((j = index[h]) != WHEEL_NONE
+             && (strcmp(t->strings + t->token[j], fresh->strings + fresh->token[i]) != 0
+                 || strcmp(t->strings + t->name[j], fresh->strings + fresh->name[i]) != 0))
+         h = (h + 1) & (size - 1);
+
+      if (j == WHEEL_NONE) {
+         fresh->due[i] += now;
+         continue;
+      }
+      fresh->status[i] = t->status[j];
+      fresh->failures[i] = t->failures[j];
+      /* a shorter interval takes effect from the last check-in */
+      fresh->due[i] = t->due[j];
+      if (fresh->due[i] > now + fresh->period[i])
+         fresh->due[i] = now + fresh->period[i];
+   }
+
+   free(index);
+   return 0;
+}
+
+/* Builds the new table off to the side, then swaps it in between two
+ * ticks, so no check-in is missed or made twice. Keeps t when reload
+ * declines or anything goes wrong. */
+static void reload_table(struct wheel* w, SnitchTable* t, sched_reload_fn reload, void* user) {
+
+   SnitchTable fresh;
+
+   memset(&fresh, 0, sizeof(fresh));
+   if (reload(&fresh, user) || fresh.count == 0) {
+      dms_sched_free(&fresh);
+      return;
+   }
+   if (carry_over(t, &fresh, w->now)) {
+      fprintf(stderr, "out of memory\n");
+      dms_sched_free(&fresh);
+      return;
+   }
+
+   dms_sched_free(t);
+   *t = fresh;
+   wheel_build(w, t);
+}
+
+/* Checks in on every snitch in the table, each every period seconds,
+ * until SIGTERM or SIGINT. A tick is a second of monotonic time; when
+ * check-ins take long the wheel catches up tick by tick, each of them
+ * O(1) plus what comes due. Between ticks it waits on reload_fd, if not
+ * -1, and has reload fill in a new table when it turns readable. Runs in
+ * the foreground on the one handle, leave detaching to the service
+ * manager. */
+int dms_sched_run(CURL* curl, SnitchTable* t, sched_check_in_fn check_in,
+                  int reload_fd, sched_reload_fn reload, void* user) {
+
+   struct wheel w;
+   struct timespec start;
+   struct timespec now;
+   struct timespec next;
+   struct pollfd pfd;
+   int64_t elapsed;
+   long wait_ms;
+
+   if (t->count == 0)
+      return 1;
+
+   w.now = 0;
+   wheel_build(&w, t);
+
+   dms_daemon_install_signals();
+   clock_gettime(CLOCK_MONOTONIC, &start);
+
+   pfd.fd = reload_fd;
+   pfd.events = POLLIN;
+
+   while (!dms_daemon_should_stop()) {
+      clock_gettime(CLOCK_MONOTONIC, &now);
+      elapsed = (int64_t)(now.tv_sec - start.tv_sec);
+      while (w.now < elapsed && !dms_daemon_should_stop())
+         wheel_tick(&w, t, curl, check_in);
+
+      next.tv_sec = start.tv_sec + (time_t)w.now + 1;
+      next.tv_nsec = start.tv_nsec;
+
+      if (reload_fd < 0) {
+         while (!dms_daemon_should_stop()
+                && clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &next, NULL) == EINTR)
+            ;
+         continue;
+      }
+
+      clock_gettime(CLOCK_MONOTONIC, &now);
+      wait_ms = (long)(next.tv_sec - now.tv_sec) * 1000 + (next.tv_nsec - now.tv_nsec) / 1000000;
+      if (wait_ms < 0)
+         wait_ms = 0;
+      if (poll(&pfd, 1, (int)wait_ms) > 0 && !dms_daemon_should_stop())
+         reload_table(&w, t, reload, user);
+   }
+
+   return 0;
+}
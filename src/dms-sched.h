@@ -0,0 +1,74 @@
+// vim:set et ts=3 sw=3:
+//  _____ _         _____                                 _       
+// |  __ (_)       |  __ \                               | |      
+// | |__) | _ __   | |__) |_ _ _   _ _ __ ___   ___ _ __ | |_ ___ 
+// |  ___/ | '_ \  |  ___/ _` | | | | '_ ` _ \ / _ \ '_ \| __/ __|
+// | |   | | | | | | |  | (_| | |_| | | | | | |  __/ | | | |_\__ \
+// |_|   |_|_| |_| |_|   \__,_|\__, |_| |_| |_|\___|_| |_|\__|___/
+//                              __/ |                             
+//                             |___/                              
+// Copyright (C) 2018 Pin Payments
+// http://pinpayments.com
+// 
+// This software is provided 'as-is', without any express or implied
+// warranty.  In no event will the authors be held liable for any damages
+// arising from the use of this software.
+// 
+// Permission is granted to anyone to use this software for any purpose,
+// including commercial applications, and to alter it and redistribute it
+// freely, subject to the following restrictions:
+// 
+// 1. The origin of this software must not be misrepresented; you must not
+//    claim that you wrote the original software. If you use this software
+//    in a product, an acknowledgment in the product documentation would be
+//    appreciated but is not required.
+// 2. Altered source versions must be plainly marked as such, and must not be
+//    misrepresented as being the original software.
+// 3. This notice may not be removed or altered from any source distribution.
+
+#ifndef DMS_SCHED_H
+#define DMS_SCHED_H
+
+#include <stdint.h>
+#include <curl/curl.h>
+
+#include <dms-tokens.h>
+#include <readconf.h>
+
+#define SNITCH_NEVER    0
+#define SNITCH_OK       1
+#define SNITCH_FAILED   2
+
+/* Snitches to check in on, one column per field so the wheel only walks
+ * the narrow ones. Names and tokens live back to back in one string
+ * arena and are found by offset. */
+typedef struct {
+   uint32_t    count;
+   uint32_t    cap;
+   char*       strings;
+   uint32_t    strings_len;
+   uint32_t    strings_cap;
+   uint32_t*   name;          /* offsets into strings */
+   uint32_t*   token;
+   uint32_t*   interval;      /* seconds, as configured */
+   uint32_t*   period;        /* interval less this token's jitter */
+   uint32_t*   deadline_ms;   /* per check-in, 0 for the default */
+   int64_t*    due;           /* scheduler tick */
+   uint32_t*   link;          /* next in the same wheel slot */
+   uint8_t*    status;
+   uint8_t*    failures;      /* in a row */
+} SnitchTable;
+
+typedef int (*sched_check_in_fn)(CURL* curl, const char* name, const char* token, long deadline_ms);
+/* fills an empty table with what should be scheduled from now on, or
+ * returns 1 to keep the current one */
+typedef int (*sched_reload_fn)(SnitchTable* fresh, void* user);
+
+int   dms_sched_add(SnitchTable* table, const char* name, const char* token, uint32_t interval, uint32_t deadline_ms);
+int   dms_sched_add_snitch(SnitchTable* table, const char* name, const char* token, const Options* opts);
+int   dms_sched_add_store(SnitchTable* table, const TokenStore* store, const Options* opts);
+void  dms_sched_free(SnitchTable* table);
+int   dms_sched_run(CURL* curl, SnitchTable* table, sched_check_in_fn check_in,
+                    int reload_fd, sched_reload_fn reload, void* user);
+
+#endif // DMS_SCHED_H
@@ -0,0 +1,72 @@
+// vim:set et ts=3 sw=3:
+//  _____ _         _____                                 _       
+// |  __ (_)       |  __ \                               | |      
+// | |__) | _ __   | |__) |_ _ _   _ _ __ ___   ___ _ __ | |_ ___ 
+// |  ___/ | '_ \  |  ___/ _` | | | | '_ ` _ \ / _ \ '_ \| __/ __|
+// | |   | | | | | | |  | (_| | |_| | | | | | |  __/ | | | |_\__ \
+// |_|   |_|_| |_| |_|   \__,_|\__, |_| |_| |_|\___|_| |_|\__|___/
+//                              __/ |                             
+//                             |___/                              
+// Copyright (C) 2018 Pin Payments
+// http://pinpayments.com
+// 
+// This software is provided 'as-is', without any express or implied
+// warranty.  In no event will the authors be held liable for any damages
+// arising from the use of this software.
+// 
+// Permission is granted to anyone to use this software for any purpose,
+// including commercial applications, and to alter it and redistribute it
+// freely, subject to the following restrictions:
+// 
+// 1. The origin of this software must not be misrepresented; you must not
+//    claim that you wrote the original software. If you use this software
+//    in a product, an acknowledgment in the product documentation would be
+//    appreciated but is not required.
+// 2. Altered source versions must be plainly marked as such, and must not be
+//    misrepresented as being the original software.
+// 3. This notice may not be removed or altered from any source distribution.
+
+#include <dms-stamp.h>
+
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/stat.h>
+
+/* Seconds since the stamp was last touched. Fails if there is none yet
+ * or it lies in the future, e.g. after the clock was set back. A stat
+ * is all it takes, so any number of concurrent runs may ask. */
+int dms_stamp_age(const char* filename, long* age) {
+
+   struct stat st;
+   time_t now = time(NULL);
+
+   if (stat(filename, &st) < 0 || st.st_mtime > now)
+      return 1;
+   *age = (long)(now - st.st_mtime);
+   return 0;
+}
+
+/* Moves the stamp to now. The file never has contents, so there is
+ * nothing a crash could leave half written and nothing to lock: the
+ * timestamp update itself is atomic and the last writer wins. */
+int dms_stamp_touch(const char* filename) {
+
+   int fd;
+
+   if (utimensat(AT_FDCWD, filename, NULL, 0) == 0)
+      return 0;
+   if (errno != ENOENT)
+      goto error;
+
+   if ((fd = open(filename, O_WRONLY | O_CREAT | O_CLOEXEC, 0644)) < 0)
+      goto error;
+   close(fd);
+   return 0;
+error:
+   fprintf(stderr, "%s: %s\n", filename, strerror(errno));
+   return 1;
+}
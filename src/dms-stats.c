@@ -0,0 +1,368 @@
+// vim:set et ts=3 sw=3:
+//  _____ _         _____                                 _       
+// |  __ (_)       |  __ \                               | |      
+// | |__) | _ __   | |__) |_ _ _   _ _ __ ___   ___ _ __ | |_ ___ 
+// |  ___/ | '_ \  |  ___/ _` | | | | '_ ` _ \ / _ \ '_ \| __/ __|
+// | |   | | | | | | |  | (_| | |_| | | | | | |  __/ | | | |_\__ \
+// |_|   |_|_| |_| |_|   \__,_|\__, |_| |_| |_|\___|_| |_|\__|___/
+//                              __/ |                             
+//                             |___/                              
+// Copyright (C) 2018 Pin Payments
+// http://pinpayments.com
+// 
+// This software is provided 'as-is', without any express or implied
+// warranty.  In no event will the authors be held liable for any damages
+// arising from the use of this software.
+// 
+// Permission is granted to anyone to use this software for any purpose,
+// including commercial applications, and to alter it and redistribute it
+// freely, subject to the following restrictions:
+// 
+// 1. The origin of this software must not be misrepresented; you must not
+//    claim that you wrote the original software. If you use this software
+//    in a product, an acknowledgment in the product documentation would be
+//    appreciated but is not required.
+// 2. Altered source versions must be plainly marked as such, and must not be
+//    misrepresented as being the original software.
+// 3. This notice may not be removed or altered from any source distribution.
+
+#include <dms-stats.h>
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+/*
+ * Request timings are kept in a fixed-size ring mapped from a file, so
+ * recording one is a fetch-and-add plus a store into shared memory and
+ * many dms processes can write at once. A slot's sequence number is
+ * stored last; readers ignore slots that are still being written.
+ */
+
+#define STATS_MAGIC "DMSSTA1"
+#define STATS_CAPACITY 1024
+
+typedef struct {
+   char      magic[8];
+   uint32_t  capacity;
+   uint32_t  reserved;
+   uint64_t  next;
+} StatsHeader;
+
+static const char* const op_names[STATS_OPS] = {
+   "create", "delete", "check_in", "pause", "list", "get"
+};
+
+static StatsHeader* ring = NULL;
+static size_t ring_size = 0;
+
+static size_t stats_size(uint32_t capacity) {
+   return sizeof(StatsHeader) + (size_t)capacity * sizeof(StatsRecord);
+}
+
+static StatsHeader* map_ring(const char* filename, int writable, size_t* size) {
+
+   struct stat st;
+   StatsHeader* hdr;
+   int fd;
+
+   if ((fd = open(filename, writable ? O_RDWR | O_CREAT | O_CLOEXEC : O_RDONLY | O_CLOEXEC, 0644)) < 0)
+      return NULL;
+
+   if (fstat(fd, &st)) {
+      close(fd);
+      return NULL;
+   }
+
+   /* a new file is sized up front; a zeroed header is initialized below */
+   if (writable && (size_t)st.st_size < stats_size(STATS_CAPACITY)) {
+      if (ftruncate(fd, (off_t)stats_size(STATS_CAPACITY))) {
+         close(fd);
+         return NULL;
+      }
+      st.st_size = (off_t)stats_size(STATS_CAPACITY);
+   }
+
+   if ((size_t)st.st_size < sizeof(StatsHeader)) {
+      close(fd);
+      return NULL;
+   }
+
+   hdr = mmap(NULL, (size_t)st.st_size, writable ? PROT_READ | PROT_WRITE : PROT_READ, MAP_SHARED, fd, 0);
+   close(fd);
+   if (hdr == MAP_FAILED)
+      return NULL;
+   *size = (size_t)st.st_size;
+
+   if (writable && hdr->magic[0] == '\0') {
+      hdr->capacity = STATS_CAPACITY;
+      memcpy(hdr->magic, STATS_MAGIC, sizeof(STATS_MAGIC));
+   }
+
+   if (memcmp(hdr->magic, STATS_MAGIC, sizeof(STATS_MAGIC)) != 0
+       || hdr->capacity == 0 || *size < stats_size(hdr->capacity)) {
+      munmap(hdr, *size);
+      return NULL;
+   }
+   return hdr;
+}
+
+/* Failing to open the ring only disables recording. */
+int dms_stats_open(const char* filename) {
+   if ((ring = map_ring(filename, 1, &ring_size)) == NULL)
+      return 1;
+   return 0;
+}
+
+void dms_stats_close(void) {
+   if (ring)
+      munmap(ring, ring_size);
+   ring = NULL;
+}
+
+static uint32_t usec(CURL* curl, CURLINFO info) {
+
+   curl_off_t t = 0;
+
+   curl_easy_getinfo(curl, info, &t);
+   return t > UINT32_MAX ? UINT32_MAX : (uint32_t)t;
+}
+
+void dms_stats_record(CURL* curl, StatsOp op, CURLcode rc) {
+
+   StatsRecord* slot;
+   StatsRecord rec;
+   curl_off_t bytes;
+   long http_status = 0;
+   uint64_t seq;
+
+   if (!ring)
+      return;
+
+   memset(&rec, 0, sizeof(rec));
+   rec.time = (int64_t)time(NULL);
+   rec.op = (uint32_t)op;
+   rec.curl_code = (int32_t)rc;
+   curl_easy_getinfo(curl, CURLINFO_RESPONSE_CODE, &http_status);
+   rec.http_status = (int32_t)http_status;
+   rec.dns_us = usec(curl, CURLINFO_NAMELOOKUP_TIME_T);
+   rec.connect_us = usec(curl, CURLINFO_CONNECT_TIME_T);
+   rec.tls_us = usec(curl, CURLINFO_APPCONNECT_TIME_T);
+   rec.ttfb_us = usec(curl, CURLINFO_STARTTRANSFER_TIME_T);
+   rec.total_us = usec(curl, CURLINFO_TOTAL_TIME_T);
+   bytes = 0;
+   curl_easy_getinfo(curl, CURLINFO_SIZE_UPLOAD_T, &bytes);
+   rec.bytes_up = (uint64_t)bytes;
+   bytes = 0;
+   curl_easy_getinfo(curl, CURLINFO_SIZE_DOWNLOAD_T, &bytes);
+   rec.bytes_down = (uint64_t)bytes;
+
+   seq = __atomic_fetch_add(&ring->next, 1, __ATOMIC_RELAXED);
+   slot = (StatsRecord*)(ring + 1) + seq % ring->capacity;
+
+   __atomic_store_n(&slot->seq, 0, __ATOMIC_RELAXED);
+   __atomic_thread_fence(__ATOMIC_RELEASE);
+   rec.seq = seq + 1;
+   memcpy((char*)slot + sizeof(slot->seq), (char*)&rec + sizeof(rec.seq), sizeof(rec) - sizeof(rec.seq));
+   __atomic_store_n(&slot->seq, rec.seq, __ATOMIC_RELEASE);
+}
+
+typedef struct {
+   uint64_t  requests;
+   uint64_t  failures;
+   int64_t   last_time;
+   uint64_t  last_seq;
+   int32_t   last_status;
+   uint64_t  bytes_up;
+   uint64_t  bytes_down;
+   uint32_t* phases[5];
+   size_t    n;
+} OpSummary;
+
+static const char* const phase_names[5] = { "dns", "connect", "tls", "ttfb", "total" };
+
+static int compare_u32(const void* a, const void* b) {
+
+   uint32_t x = *(const uint32_t*)a;
+   uint32_t y = *(const uint32_t*)b;
+
+   return (x > y) - (x < y);
+}
+
+static double quantile(const uint32_t* sorted, size_t n, double q) {
+   if (n == 0)
+      return 0;
+   return sorted[(size_t)(q * (n - 1) + 0.5)] / 1e6;
+}
+
+static int record_failed(const StatsRecord* rec) {
+   return rec->curl_code != 0 || rec->http_status >= 400 || rec->http_status == 0;
+}
+
+static void print_prometheus(OpSummary* ops) {
+
+   static const double quantiles[] = { 0.5, 0.9, 0.99 };
+   int op;
+   int p;
+   int q;
+
+   printf("# HELP dms_requests Requests recorded in the stats ring.\n");
+   printf("# TYPE dms_requests gauge\n");
+   for (op = 0; op < STATS_OPS; op++)
+      printf("dms_requests{op=\"%s\"} %llu\n", op_names[op], (unsigned long long)ops[op].requests);
+
+   printf("# HELP dms_request_failures Failed requests recorded in the stats ring.\n");
+   printf("# TYPE dms_request_failures gauge\n");
+   for (op = 0; op < STATS_OPS; op++)
+      printf("dms_request_failures{op=\"%s\"} %llu\n", op_names[op], (unsigned long long)ops[op].failures);
+
+   printf("# HELP dms_last_request_timestamp_seconds When the last request finished.\n");
+   printf("# TYPE dms_last_request_timestamp_seconds gauge\n");
+   for (op = 0; op < STATS_OPS; op++) {
+      if (ops[op].requests)
+         printf("dms_last_request_timestamp_seconds{op=\"%s\"} %lld\n", op_names[op], (long long)ops[op].last_time);
+   }
+
+   printf("# HELP dms_last_http_status HTTP status of the last request, 0 if none was received.\n");
+   printf("# TYPE dms_last_http_status gauge\n");
+   for (op = 0; op < STATS_OPS; op++) {
+      if (ops[op].requests)
+         printf("dms_last_http_status{op=\"%s\"} %d\n", op_names[op], ops[op].last_status);
+   }
+
+   printf("# HELP dms_request_bytes Bytes transferred by recorded requests.\n");
+   printf("# TYPE dms_request_bytes gauge\n");
+   for (op = 0; op < STATS_OPS; op++) {
+      printf("dms_request_bytes{op=\"%s\",direction=\"up\"} %llu\n", op_names[op], (unsigned long long)ops[op].bytes_up);
+      printf("dms_request_bytes{op=\"%s\",direction=\"down\"} %llu\n", op_names[op], (unsigned long long)ops[op].bytes_down);
+   }
+
+   printf("# HELP dms_request_phase_seconds Time from request start to the end of each phase.\n");
+   printf("# TYPE dms_request_phase_seconds summary\n");
+   for (op = 0; op < STATS_OPS; op++) {
+      if (!ops[op].n)
+         continue;
+      for (p = 0; p < 5; p++) {
+         for (q = 0; q < 3; q++) {
+            printf("dms_request_phase_seconds{op=\"%s\",phase=\"%s\",quantile=\"%g\"} %.6f\n",
+                   op_names[op], phase_names[p], quantiles[q],
+                   quantile(ops[op].phases[p], ops[op].n, quantiles[q]));
+         }
+      }
+   }
+}
+
+static void print_json(OpSummary* ops) {
+
+   int op;
+   int p;
+   int first = 1;
+
+   printf("{");
+   for (op = 0; op < STATS_OPS; op++) {
+      printf("%s\"%s\":{\"requests\":%llu,\"failures\":%llu,\"bytes_up\":%llu,\"bytes_down\":%llu",
+             first ? "" : ",", op_names[op],
+             (unsigned long long)ops[op].requests, (unsigned long long)ops[op].failures,
+             (unsigned long long)ops[op].bytes_up, (unsigned long long)ops[op].bytes_down);
+      first = 0;
+      if (ops[op].requests)
+         printf(",\"last_time\":%lld,\"last_status\":%d", (long long)ops[op].last_time, ops[op].last_status);
+      for (p = 0; p < 5 && ops[op].n; p++) {
+         printf(",\"%s\":{\"p50\":%.6f,\"p90\":%.6f,\"p99\":%.6f}", phase_names[p],
+                quantile(ops[op].phases[p], ops[op].n, 0.5),
+                quantile(ops[op].phases[p], ops[op].n, 0.9),
+                quantile(ops[op].phases[p], ops[op].n, 0.99));
+      }
+      printf("}");
+   }
+   printf("}\n");
+}
+
+int dms_stats_print(const char* filename, StatsFormat format) {
+
+   StatsHeader* hdr;
+   const StatsRecord* records;
+   StatsRecord rec;
+   OpSummary ops[STATS_OPS];
+   OpSummary* s;
+   size_t size;
+   uint32_t i;
+   int op;
+   int p;
+   int rv = 0;
+
+   memset(ops, 0, sizeof(ops));
+
+   if ((hdr = map_ring(filename, 0, &size)) == NULL) {
+      /* nothing recorded yet still makes a valid, empty report */
+      if (errno != ENOENT) {
+         fprintf(stderr, "could not read stats from %s\n", filename);
+         return 1;
+      }
+   }
+
+   if (hdr) {
+      for (op = 0; op < STATS_OPS; op++) {
+         for (p = 0; p < 5; p++) {
+            if ((ops[op].phases[p] = calloc(hdr->capacity, sizeof(uint32_t))) == NULL) {
+               fprintf(stderr, "out of memory\n");
+               rv = 1;
+               goto out;
+            }
+         }
+      }
+
+      records = (const StatsRecord*)(hdr + 1);
+      for (i = 0; i < hdr->capacity; i++) {
+         rec.seq = __atomic_load_n(&records[i].seq, __ATOMIC_ACQUIRE);
+         if (rec.seq == 0)
+            continue;
+         memcpy(&rec, &records[i], sizeof(rec));
+         if (__atomic_load_n(&records[i].seq, __ATOMIC_ACQUIRE) != rec.seq || rec.op >= STATS_OPS)
+            continue;
+
+         s = &ops[rec.op];
+         s->requests++;
+         if (record_failed(&rec))
+            s->failures++;
+         s->bytes_up += rec.bytes_up;
+         s->bytes_down += rec.bytes_down;
+         if (rec.seq > s->last_seq) {
+            s->last_seq = rec.seq;
+            s->last_time = rec.time;
+            s->last_status = rec.http_status;
+         }
+         s->phases[0][s->n] = rec.dns_us;
+         s->phases[1][s->n] = rec.connect_us;
+         s->phases[2][s->n] = rec.tls_us;
+         s->phases[3][s->n] = rec.ttfb_us;
+         s->phases[4][s->n] = rec.total_us;
+         s->n++;
+      }
+
+      for (op = 0; op < STATS_OPS; op++) {
+         for (p = 0; p < 5; p++)
+            qsort(ops[op].phases[p], ops[op].n, sizeof(uint32_t), compare_u32);
+      }
+   }
+
+   if (format == STATS_FORMAT_JSON)
+      print_json(ops);
+   else
+      print_prometheus(ops);
+
+out:
+   for (op = 0; op < STATS_OPS; op++) {
+      for (p = 0; p < 5; p++)
+         free(ops[op].phases[p]);
+   }
+   if (hdr)
+      munmap(hdr, size);
+   return rv;
+}
@@ -0,0 +1,71 @@
+// vim:set et ts=3 sw=3:
+//  _____ _         _____                                 _       
+// |  __ (_)       |  __ \                               | |      
+// | |__) | _ __   | |__) |_ _ _   _ _ __ ___   ___ _ __ | |_ ___ 
+// |  ___/ | '_ \  |  ___/ _` | | | | '_ ` _ \ / _ \ '_ \| __/ __|
+// | |   | | | | | | |  | (_| | |_| | | | | | |  __/ | | | |_\__ \
+// |_|   |_|_| |_| |_|   \__,_|\__, |_| |_| |_|\___|_| |_|\__|___/
+//                              __/ |                             
+//                             |___/                              
+// Copyright (C) 2018 Pin Payments
+// http://pinpayments.com
+// 
+// This software is provided 'as-is', without any express or implied
+// warranty.  In no event will the authors be held liable for any damages
+// arising from the use of this software.
+// 
+// Permission is granted to anyone to use this software for any purpose,
+// including commercial applications, and to alter it and redistribute it
+// freely, subject to the following restrictions:
+// 
+// 1. The origin of this software must not be misrepresented; you must not
+//    claim that you wrote the original software. If you use this software
+//    in a product, an acknowledgment in the product documentation would be
+//    appreciated but is not required.
+// 2. Altered source versions must be plainly marked as such, and must not be
+//    misrepresented as being the original software.
+// 3. This notice may not be removed or altered from any source distribution.
+
+#ifndef DMS_STATS_H
+#define DMS_STATS_H
+
+#include <stdint.h>
+#include <curl/curl.h>
+
+typedef enum {
+   STATS_CREATE,
+   STATS_DELETE,
+   STATS_CHECK_IN,
+   STATS_PAUSE,
+   STATS_LIST,
+   STATS_GET,
+   STATS_OPS
+} StatsOp;
+
+typedef enum {
+   STATS_FORMAT_PROMETHEUS,
+   STATS_FORMAT_JSON
+} StatsFormat;
+
+/* one finished request, times in microseconds */
+typedef struct {
+   uint64_t  seq;           /* written last, 0 while the slot is being filled */
+   int64_t   time;
+   uint32_t  op;
+   int32_t   curl_code;
+   int32_t   http_status;
+   uint32_t  dns_us;
+   uint32_t  connect_us;
+   uint32_t  tls_us;
+   uint32_t  ttfb_us;
+   uint32_t  total_us;
+   uint64_t  bytes_up;
+   uint64_t  bytes_down;
+} StatsRecord;
+
+int   dms_stats_open(const char* filename);
+void  dms_stats_close(void);
+void  dms_stats_record(CURL* curl, StatsOp op, CURLcode rc);
+int   dms_stats_print(const char* filename, StatsFormat format);
+
+#endif // DMS_STATS_H
@@ -0,0 +1,130 @@
+// vim:set et ts=3 sw=3:
+//  _____ _         _____                                 _       
+// |  __ (_)       |  __ \                               | |      
+// | |__) | _ __   | |__) |_ _ _   _ _ __ ___   ___ _ __ | |_ ___ 
+// |  ___/ | '_ \  |  ___/ _` | | | | '_ ` _ \ / _ \ '_ \| __/ __|
+// | |   | | | | | | |  | (_| | |_| | | | | | |  __/ | | | |_\__ \
+// |_|   |_|_| |_| |_|   \__,_|\__, |_| |_| |_|\___|_| |_|\__|___/
+//                              __/ |                             
+//                             |___/                              
+// Copyright (C) 2018 Pin Payments
+// http://pinpayments.com
+// 
+// This software is provided 'as-is', without any express or implied
+// warranty.  In no event will the authors be held liable for any damages
+// arising from the use of this software.
+// 
+// Permission is granted to anyone to use this software for any purpose,
+// including commercial applications, and to alter it and redistribute it
+// freely, subject to the following restrictions:
+// 
+// 1. The origin of this software must not be misrepresented; you must not
+//    claim that you wrote the original software. If you use this software
+//    in a product, an acknowledgment in the product documentation would be
+//    appreciated but is not required.
+// 2. Altered source versions must be plainly marked as such, and must not be
+//    misrepresented as being the original software.
+// 3. This notice may not be removed or altered from any source distribution.
+
+#include <dms-status.h>
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <limits.h>
+#include <unistd.h>
+
+#include <dms-stamp.h>
+
+/* One small file per snitch, a single line of tab separated fields:
+ *
+ *    ETAG STATUS CHECKED_IN_AT INTERVAL
+ *
+ * Its mtime is when the API last confirmed them, so a 304 only has to
+ * touch it, the way a stamp is touched. */
+
+static void copy_field(char* out, size_t size, const char* value) {
+
+   size_t i;
+
+   snprintf(out, size, "%s", value ? value : "");
+   /* the API's own strings never have these, but the format can't */
+   for (i = 0; out[i]; i++) {
+      if (out[i] == '\t' || out[i] == '\n' || out[i] == '\r')
+         out[i] = ' ';
+   }
+}
+
+static const char* next_field(char** line) {
+
+   char* field = *line;
+   char* end = field + strcspn(field, "\t\n");
+
+   *line = *end == '\t' ? end + 1 : end;
+   *end = '\0';
+   return field;
+}
+
+/* Fails when there is nothing cached, or the cache is from the future. */
+int dms_status_load(const char* filename, SnitchStatus* status) {
+
+   FILE* file;
+   char line[STATUS_ETAG_LEN + 3 * STATUS_FIELD_LEN + 8];
+   char* p = line;
+
+   if (dms_stamp_age(filename, &status->age))
+      return 1;
+   if ((file = fopen(filename, "r")) == NULL)
+      return 1;
+   if (fgets(line, sizeof(line), file) == NULL) {
+      fclose(file);
+      return 1;
+   }
+   fclose(file);
+
+   copy_field(status->etag, sizeof(status->etag), next_field(&p));
+   copy_field(status->status, sizeof(status->status), next_field(&p));
+   copy_field(status->checked_in_at, sizeof(status->checked_in_at), next_field(&p));
+   copy_field(status->interval, sizeof(status->interval), next_field(&p));
+
+   return status->status[0] == '\0';
+}
+
+/* Writes the cache next to filename and renames it into place, so a
+ * concurrent load sees either the old copy or the new one. */
+int dms_status_save(const char* filename, const SnitchStatus* status) {
+
+   char tmp[PATH_MAX];
+   FILE* file;
+
+   snprintf(tmp, sizeof(tmp), "%s.%ld.tmp", filename, (long)getpid());
+   if ((file = fopen(tmp, "w")) == NULL) {
+      fprintf(stderr, "%s is not writable\n", tmp);
+      return 1;
+   }
+   fprintf(file, "%s\t%s\t%s\t%s\n", status->etag, status->status,
+           status->checked_in_at, status->interval);
+   if (fclose(file) || rename(tmp, filename)) {
+      fprintf(stderr, "failed to save %s\n", filename);
+      unlink(tmp);
+      return 1;
+   }
+   return 0;
+}
+
+/* the API answered that nothing changed */
+int dms_status_confirm(const char* filename) {
+
+   return dms_stamp_touch(filename);
+}
+
+void dms_status_from_json(json_t* snitch, SnitchStatus* status) {
+
+   copy_field(status->status, sizeof(status->status),
+              json_string_value(json_object_get(snitch, "status")));
+   copy_field(status->checked_in_at, sizeof(status->checked_in_at),
+              json_string_value(json_object_get(snitch, "checked_in_at")));
+   copy_field(status->interval, sizeof(status->interval),
+              json_string_value(json_object_get(snitch, "interval")));
+   status->age = 0;
+}
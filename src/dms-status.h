@@ -0,0 +1,51 @@
+// vim:set et ts=3 sw=3:
+//  _____ _         _____                                 _       
+// |  __ (_)       |  __ \                               | |      
+// | |__) | _ __   | |__) |_ _ _   _ _ __ ___   ___ _ __ | |_ ___ 
+// |  ___/ | '_ \  |  ___/ _` | | | | '_ ` _ \ / _ \ '_ \| __/ __|
+// | |   | | | | | | |  | (_| | |_| | | | | | |  __/ | | | |_\__ \
+// |_|   |_|_| |_| |_|   \__,_|\__, |_| |_| |_|\___|_| |_|\__|___/
+//                              __/ |                             
+//                             |___/                              
+// Copyright (C) 2018 Pin Payments
+// http://pinpayments.com
+// 
+// This software is provided 'as-is', without any express or implied
+// warranty.  In no event will the authors be held liable for any damages
+// arising from the use of this software.
+// 
+// Permission is granted to anyone to use this software for any purpose,
+// including commercial applications, and to alter it and redistribute it
+// freely, subject to the following restrictions:
+// 
+// 1. The origin of this software must not be misrepresented; you must not
+//    claim that you wrote the original software. If you use this software
+//    in a product, an acknowledgment in the product documentation would be
+//    appreciated but is not required.
+// 2. Altered source versions must be plainly marked as such, and must not be
+//    misrepresented as being the original software.
+// 3. This notice may not be removed or altered from any source distribution.
+
+#ifndef DMS_STATUS_H
+#define DMS_STATUS_H
+
+#include <jansson.h>
+
+#define STATUS_FIELD_LEN 64
+#define STATUS_ETAG_LEN  128
+
+/* what the API last said about a snitch, and how long ago */
+typedef struct {
+   char  etag[STATUS_ETAG_LEN];
+   char  status[STATUS_FIELD_LEN];
+   char  checked_in_at[STATUS_FIELD_LEN];
+   char  interval[STATUS_FIELD_LEN];
+   long  age;
+} SnitchStatus;
+
+int   dms_status_load(const char* filename, SnitchStatus* status);
+int   dms_status_save(const char* filename, const SnitchStatus* status);
+int   dms_status_confirm(const char* filename);
+void  dms_status_from_json(json_t* snitch, SnitchStatus* status);
+
+#endif // DMS_STATUS_H
@@ -0,0 +1,384 @@
+// vim:set et ts=3 sw=3:
+//  _____ _         _____                                 _       
+// |  __ (_)       |  __ \                               | |      
+// | |__) | _ __   | |__) |_ _ _   _ _ __ ___   ___ _ __ | |_ ___ 
+// |  ___/ | '_ \  |  ___/ _` | | | | '_ ` _ \ / _ \ '_ \| __/ __|
+// | |   | | | | | | |  | (_| | |_| | | | | | |  __/ | | | |_\__ \
+// |_|   |_|_| |_| |_|   \__,_|\__, |_| |_| |_|\___|_| |_|\__|___/
+//                              __/ |                             
+//                             |___/                              
+// Copyright (C) 2018 Pin Payments
+// http://pinpayments.com
+// 
+// This software is provided 'as-is', without any express or implied
+// warranty.  In no event will the authors be held liable for any damages
+// arising from the use of this software.
+// 
+// Permission is granted to anyone to use this software for any purpose,
+// including commercial applications, and to alter it and redistribute it
+// freely, subject to the following restrictions:
+// 
+// 1. The origin of this software must not be misrepresented; you must not
+//    claim that you wrote the original software. If you use this software
+//    in a product, an acknowledgment in the product documentation would be
+//    appreciated but is not required.
+// 2. Altered source versions must be plainly marked as such, and must not be
+//    misrepresented as being the original software.
+// 3. This notice may not be removed or altered from any source distribution.
+
+#include <dms-tokens.h>
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <ctype.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <unistd.h>
+#include <sys/file.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+/*
+ * The token store is a fixed-layout hash table that is mapped read-only
+ * by every reader:
+ *
+ *    header   magic, slot count, entry count
+ *    slots    nslots TokenSlot entries, open addressing, linear probing
+ *
+ * nslots is a power of two and at least twice the entry count, so a
+ * lookup touches one or two slots. Writers never modify the file in
+ * place; they build a new table, write it next to the old one and rename
+ * it over, so readers always see either the old or the new store.
+ */
+
+#define TOKENS_MAGIC "DMSTOK1"
+#define MIN_SLOTS 16
+
+typedef struct {
+   char      magic[8];
+   uint32_t  nslots;
+   uint32_t  count;
+} TokenHeader;
+
+static uint32_t hash_name(const char* name) {
+
+   uint32_t h = 2166136261u;
+
+   while (*name) {
+      h ^= (unsigned char)*name++;
+      h *= 16777619u;
+   }
+   return h;
+}
+
+int dms_tokens_valid_name(const char* name) {
+
+   size_t len = strlen(name);
+
+   if (len == 0 || len >= TOKEN_NAME_LEN)
+      return 0;
+   for (; *name; name++) {
+      if (!isalnum((unsigned char)*name) && !strchr("._-", *name))
+         return 0;
+   }
+   return 1;
+}
+
+/* the store key for a system provisioned with -B; 1 if it doesn't fit */
+int dms_tokens_bulk_name(char* key, size_t size, const char* name) {
+
+   int len = snprintf(key, size, "%s%s", TOKEN_BULK_PREFIX, name);
+
+   return len < 0 || (size_t)len >= size || (size_t)len >= TOKEN_NAME_LEN;
+}
+
+int dms_tokens_is_bulk(const char* key) {
+   return strncmp(key, TOKEN_BULK_PREFIX, sizeof(TOKEN_BULK_PREFIX) - 1) == 0;
+}
+
+/* a snitch name, or one under the bulk prefix */
+static int valid_key(const char* key) {
+
+   if (strlen(key) >= TOKEN_NAME_LEN)
+      return 0;
+   if (dms_tokens_is_bulk(key))
+      key += sizeof(TOKEN_BULK_PREFIX) - 1;
+   return dms_tokens_valid_name(key);
+}
+
+int dms_tokens_open(const char* filename, TokenStore* store) {
+
+   struct stat st;
+   const TokenHeader* hdr;
+   int fd;
+
+   memset(store, 0, sizeof(*store));
+
+   if ((fd = open(filename, O_RDONLY | O_CLOEXEC)) < 0)
+      return 1;
+
+   if (fstat(fd, &st) || (size_t)st.st_size < sizeof(TokenHeader)) {
+      close(fd);
+      return 1;
+   }
+
+   store->map = mmap(NULL, (size_t)st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+   close(fd);
+   if (store->map == MAP_FAILED) {
+      store->map = NULL;
+      return 1;
+   }
+   store->size = (size_t)st.st_size;
+
+   hdr = (const TokenHeader*)store->map;
+   if (memcmp(hdr->magic, TOKENS_MAGIC, sizeof(TOKENS_MAGIC)) != 0
+       || hdr->nslots == 0 || (hdr->nslots & (hdr->nslots - 1)) != 0
+       || store->size < sizeof(TokenHeader) + (size_t)hdr->nslots * sizeof(TokenSlot)) {
+      fprintf(stderr, "%s is not a token store\n", filename);
+      dms_tokens_close(store);
+      return 1;
+   }
+
+   store->slots = (const TokenSlot*)(hdr + 1);
+   store->nslots = hdr->nslots;
+   store->count = hdr->count;
+   return 0;
+}
+
+void dms_tokens_close(TokenStore* store) {
+   if (store->map)
+      munmap(store->map, store->size);
+   memset(store, 0, sizeof(*store));
+}
+
+/* The slot holding name, or the empty one it would go in. Gives up
+ * after a lap of the table and returns nslots, so a store that is full
+ * or has a corrupt header cannot keep us probing forever. */
+static uint32_t find_slot(const TokenSlot* slots, uint32_t nslots, const char* name) {
+
+   uint32_t mask = nslots - 1;
+   uint32_t i = hash_name(name) & mask;
+   uint32_t probes;
+
+   for (probes = 0; probes < nslots; probes++) {
+      if (!slots[i].name[0] || strncmp(slots[i].name, name, TOKEN_NAME_LEN) == 0)
+         return i;
+      i = (i + 1) & mask;
+   }
+   return nslots;
+}
+
+const char* dms_tokens_lookup(const TokenStore* store, const char* name) {
+
+   const TokenSlot* slot;
+   uint32_t i;
+
+   if (!store->slots || !valid_key(name))
+      return NULL;
+
+   if ((i = find_slot(store->slots, store->nslots, name)) == store->nslots)
+      return NULL;
+   slot = &store->slots[i];
+   if (!slot->name[0] || memchr(slot->token, '\0', TOKEN_VALUE_LEN) == NULL)
+      return NULL;
+   return slot->token;
+}
+
+int dms_tokens_each(const TokenStore* store, token_each_fn fn, void* user) {
+
+   uint32_t i;
+   int rv;
+
+   for (i = 0; i < store->nslots; i++) {
+      if (!store->slots[i].name[0])
+         continue;
+      if ((rv = fn(store->slots[i].name, store->slots[i].token, user)) != 0)
+         return rv;
+   }
+   return 0;
+}
+
+static int write_all(int fd, const void* buf, size_t len) {
+
+   const char* p = buf;
+   ssize_t n;
+
+   while (len) {
+      if ((n = write(fd, p, len)) < 0) {
+         if (errno == EINTR)
+            continue;
+         return 1;
+      }
+      p += n;
+      len -= (size_t)n;
+   }
+   return 0;
+}
+
+static int insert(TokenSlot* slots, uint32_t nslots, const char* name, const char* token, uint32_t* count) {
+
+   TokenSlot* slot;
+   uint32_t i;
+
+   if ((i = find_slot(slots, nslots, name)) == nslots)
+      return 1;
+   slot = &slots[i];
+   if (!slot->name[0])
+      (*count)++;
+   strncpy(slot->name, name, TOKEN_NAME_LEN - 1);
+   strncpy(slot->token, token, TOKEN_VALUE_LEN - 1);
+   return 0;
+}
+
+/* backward shift deletion keeps every probe chain intact without
+ * tombstones */
+static void remove_name(TokenSlot* slots, uint32_t nslots, const char* name, uint32_t* count) {
+
+   uint32_t mask = nslots - 1;
+   uint32_t i = find_slot(slots, nslots, name);
+   uint32_t j = i;
+   uint32_t k;
+
+   if (i == nslots || !slots[i].name[0])
+      return;
+
+   for (;;) {
+      j = (j + 1) & mask;
+      if (!slots[j].name[0])
+         break;
+      k = hash_name(slots[j].name) & mask;
+      /* leave entries whose home slot lies cyclically in (i, j] */
+      if (i <= j ? (i < k && k <= j) : (i < k || k <= j))
+         continue;
+      slots[i] = slots[j];
+      i = j;
+   }
+   memset(&slots[i], 0, sizeof(slots[i]));
+   (*count)--;
+}
+
+static int commit(const char* filename, const TokenSlot* slots, uint32_t nslots, uint32_t count) {
+
+   char tmp[PATH_MAX];
+   char dir[PATH_MAX];
+   char* slash;
+   TokenHeader hdr;
+   int fd;
+
+   snprintf(tmp, sizeof(tmp), "%s.%ld.tmp", filename, (long)getpid());
+
+   if ((fd = open(tmp, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0600)) < 0) {
+      fprintf(stderr, "could not create %s: %s\n", tmp, strerror(errno));
+      return 1;
+   }
+
+   memset(&hdr, 0, sizeof(hdr));
+   memcpy(hdr.magic, TOKENS_MAGIC, sizeof(TOKENS_MAGIC));
+   hdr.nslots = nslots;
+   hdr.count = count;
+
+   if (write_all(fd, &hdr, sizeof(hdr))
+       || write_all(fd, slots, (size_t)nslots * sizeof(TokenSlot))
+       || fsync(fd)) {
+      fprintf(stderr, "could not write %s\n", tmp);
+      close(fd);
+      unlink(tmp);
+      return 1;
+   }
+   close(fd);
+
+   if (rename(tmp, filename)) {
+      fprintf(stderr, "could not replace %s: %s\n", filename, strerror(errno));
+      unlink(tmp);
+      return 1;
+   }
+
+   strncpy(dir, filename, sizeof(dir) - 1);
+   dir[sizeof(dir) - 1] = '\0';
+   if ((slash = strrchr(dir, '/')) != NULL) {
+      *slash = '\0';
+      if ((fd = open(*dir ? dir : "/", O_RDONLY | O_DIRECTORY)) >= 0) {
+         fsync(fd);
+         close(fd);
+      }
+   }
+   return 0;
+}
+
+/* Applies every change in one atomic replacement of the store. Writers
+ * are serialized on a lock file next to the store. */
+int dms_tokens_update(const char* filename, const TokenChange* changes, size_t count) {
+
+   char lock[PATH_MAX];
+   TokenStore old;
+   TokenSlot* slots = NULL;
+   uint32_t nslots = MIN_SLOTS;
+   uint32_t n = 0;
+   uint32_t i;
+   size_t total;
+   size_t j;
+   int lock_fd;
+   int have_old;
+   int rv = 1;
+
+   for (j = 0; j < count; j++) {
+      if (!valid_key(changes[j].name)
+          || (changes[j].token && strlen(changes[j].token) >= TOKEN_VALUE_LEN)) {
+         fprintf(stderr, "invalid snitch name or token for '%s'\n", changes[j].name);
+         return 1;
+      }
+   }
+
+   snprintf(lock, sizeof(lock), "%s.lock", filename);
+   if ((lock_fd = open(lock, O_RDWR | O_CREAT | O_CLOEXEC, 0600)) < 0) {
+      fprintf(stderr, "could not open %s: %s\n", lock, strerror(errno));
+      return 1;
+   }
+   flock(lock_fd, LOCK_EX);
+
+   have_old = dms_tokens_open(filename, &old) == 0;
+
+   /* size for the worst case, every change being an insert; the old
+    * entries are counted rather than taken from a header that may lie */
+   total = count;
+   for (i = 0; have_old && i < old.nslots; i++) {
+      if (old.slots[i].name[0])
+         total++;
+   }
+   while (nslots < total * 2)
+      nslots *= 2;
+
+   if ((slots = calloc(nslots, sizeof(*slots))) == NULL) {
+      fprintf(stderr, "out of memory\n");
+      goto out;
+   }
+
+   if (have_old) {
+      for (i = 0; i < old.nslots; i++) {
+         if (old.slots[i].name[0] && insert(slots, nslots, old.slots[i].name, old.slots[i].token, &n))
+            goto full;
+      }
+   }
+
+   for (j = 0; j < count; j++) {
+      if (!changes[j].token)
+         remove_name(slots, nslots, changes[j].name, &n);
+      else if (insert(slots, nslots, changes[j].name, changes[j].token, &n))
+         goto full;
+   }
+
+   rv = commit(filename, slots, nslots, n);
+   goto out;
+
+full:
+   fprintf(stderr, "%s is full\n", filename);
+out:
+   if (have_old)
+      dms_tokens_close(&old);
+   free(slots);
+   flock(lock_fd, LOCK_UN);
+   close(lock_fd);
+   return rv;
+}
@@ -0,0 +1,72 @@
+// vim:set et ts=3 sw=3:
+//  _____ _         _____                                 _       
+// |  __ (_)       |  __ \                               | |      
+// | |__) | _ __   | |__) |_ _ _   _ _ __ ___   ___ _ __ | |_ ___ 
+// |  ___/ | '_ \  |  ___/ _` | | | | '_ ` _ \ / _ \ '_ \| __/ __|
+// | |   | | | | | | |  | (_| | |_| | | | | | |  __/ | | | |_\__ \
+// |_|   |_|_| |_| |_|   \__,_|\__, |_| |_| |_|\___|_| |_|\__|___/
+//                              __/ |                             
+//                             |___/                              
+// Copyright (C) 2018 Pin Payments
+// http://pinpayments.com
+// 
+// This software is provided 'as-is', without any express or implied
+// warranty.  In no event will the authors be held liable for any damages
+// arising from the use of this software.
+// 
+// Permission is granted to anyone to use this software for any purpose,
+// including commercial applications, and to alter it and redistribute it
+// freely, subject to the following restrictions:
+// 
+// 1. The origin of this software must not be misrepresented; you must not
+//    claim that you wrote the original software. If you use this software
+//    in a product, an acknowledgment in the product documentation would be
+//    appreciated but is not required.
+// 2. Altered source versions must be plainly marked as such, and must not be
+//    misrepresented as being the original software.
+// 3. This notice may not be removed or altered from any source distribution.
+
+#ifndef DMS_TOKENS_H
+#define DMS_TOKENS_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#define TOKEN_NAME_LEN  64
+#define TOKEN_VALUE_LEN 64
+
+/* snitches provisioned with -B for other systems are kept under this
+ * prefix, which no snitch name of our own can carry */
+#define TOKEN_BULK_PREFIX "bulk/"
+
+typedef struct {
+   char  name[TOKEN_NAME_LEN];
+   char  token[TOKEN_VALUE_LEN];
+} TokenSlot;
+
+typedef struct {
+   void*             map;
+   size_t            size;
+   const TokenSlot*  slots;
+   uint32_t          nslots;
+   uint32_t          count;
+} TokenStore;
+
+/* one entry of an update, a NULL token removes the name */
+typedef struct {
+   const char* name;
+   const char* token;
+} TokenChange;
+
+typedef int (*token_each_fn)(const char* name, const char* token, void* user);
+
+int          dms_tokens_open(const char* filename, TokenStore* store);
+void         dms_tokens_close(TokenStore* store);
+const char*  dms_tokens_lookup(const TokenStore* store, const char* name);
+int          dms_tokens_each(const TokenStore* store, token_each_fn fn, void* user);
+int          dms_tokens_update(const char* filename, const TokenChange* changes, size_t count);
+int          dms_tokens_valid_name(const char* name);
+int          dms_tokens_bulk_name(char* key, size_t size, const char* name);
+int          dms_tokens_is_bulk(const char* key);
+
+#endif // DMS_TOKENS_H
@@ -0,0 +1,361 @@
+// vim:set et ts=3 sw=3:
+//  _____ _         _____                                 _       
+// |  __ (_)       |  __ \                               | |      
+// | |__) | _ __   | |__) |_ _ _   _ _ __ ___   ___ _ __ | |_ ___ 
+// |  ___/ | '_ \  |  ___/ _` | | | | '_ ` _ \ / _ \ '_ \| __/ __|
+// | |   | | | | | | |  | (_| | |_| | | | | | |  __/ | | | |_\__ \
+// |_|   |_|_| |_| |_|   \__,_|\__, |_| |_| |_|\___|_| |_|\__|___/
+//                              __/ |                             
+//                             |___/                              
+// Copyright (C) 2018 Pin Payments
+// http://pinpayments.com
+// 
+// This software is provided 'as-is', without any express or implied
+// warranty.  In no event will the authors be held liable for any damages
+// arising from the use of this software.
+// 
+// Permission is granted to anyone to use this software for any purpose,
+// including commercial applications, and to alter it and redistribute it
+// freely, subject to the following restrictions:
+// 
+// 1. The origin of this software must not be misrepresented; you must not
+//    claim that you wrote the original software. If you use this software
+//    in a product, an acknowledgment in the product documentation would be
+//    appreciated but is not required.
+// 2. Altered source versions must be plainly marked as such, and must not be
+//    misrepresented as being the original software.
+// 3. This notice may not be removed or altered from any source distribution.
+
+#include <dms-watch.h>
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <unistd.h>
+#include <sys/inotify.h>
+#include <sys/stat.h>
+
+/*
+ * Watch mode follows the ClamAV logs with inotify and checks in only
+ * when a line shows that freshclam or clamd actually did its job. Each
+ * log's directory is watched rather than the file itself, which makes
+ * both rename-and-create and copytruncate rotation visible. Only the
+ * bytes appended since the last event are read, and the read offset is
+ * saved so a restart picks up where the last run stopped.
+ */
+
+#define MAX_WATCH_LOGS 8
+#define READ_CHUNK 65536
+#define MAX_LINE 4096
+#define EVENT_BUF (64 * (sizeof(struct inotify_event) + NAME_MAX + 1))
+
+const char* const dms_watch_freshclam_markers[] = {
+   "Database updated",
+   "database is up-to-date",
+   "is up to date",
+   NULL
+};
+
+/* clamd logs nothing per scan unless LogClean is set, and then a line per
+ * file, so only its database reloads (SelfCheck finding the update
+ * freshclam made, or a RELOAD from freshclam's NotifyClamd) count */
+const char* const dms_watch_clamd_markers[] = {
+   "Database correctly reloaded",
+   NULL
+};
+
+typedef struct {
+   const WatchLog*   log;
+   const char*       name;          /* basename within the watched directory */
+   int               wd;
+   int               fd;
+   ino_t             ino;
+   off_t             offset;
+   char              line[MAX_LINE];
+   size_t            line_len;
+} LogState;
+
+static int matches(const char* line, const char* const* markers) {
+
+   for (; *markers; markers++) {
+      if (strstr(line, *markers))
+         return 1;
+   }
+   return 0;
+}
+
+/* splits buf into lines, carrying an unterminated tail over to the next
+ * read; returns 1 if any complete line carries a marker */
+static int scan_lines(LogState* st, const char* buf, size_t len) {
+
+   const char* p = buf;
+   const char* end = buf + len;
+   const char* nl;
+   size_t n;
+   int hit = 0;
+
+   while (p < end) {
+      nl = memchr(p, '\n', (size_t)(end - p));
+      n = (size_t)((nl ? nl : end) - p);
+
+      /* overlong lines are cut, the marker is near the start anyway */
+      if (st->line_len + n >= MAX_LINE)
+         n = MAX_LINE - 1 - st->line_len;
+      memcpy(st->line + st->line_len, p, n);
+      st->line_len += n;
+
+      if (!nl)
+         break;
+
+      st->line[st->line_len] = '\0';
+      if (matches(st->line, st->log->markers))
+         hit = 1;
+      st->line_len = 0;
+      p = nl + 1;
+   }
+   return hit;
+}
+
+static int open_log(LogState* st, off_t offset) {
+
+   struct stat sb;
+
+   if ((st->fd = open(st->log->path, O_RDONLY | O_CLOEXEC)) < 0)
+      return 1;
+   if (fstat(st->fd, &sb)) {
+      close(st->fd);
+      st->fd = -1;
+      return 1;
+   }
+
+   st->ino = sb.st_ino;
+   st->offset = offset > sb.st_size ? 0 : offset;
+   st->line_len = 0;
+   return 0;
+}
+
+/* reads everything appended since the last call */
+static int read_new(LogState* st, char* buf) {
+
+   struct stat sb;
+   ssize_t n;
+   int hit = 0;
+
+   if (st->fd < 0)
+      return 0;
+
+   /* truncated in place */
+   if (fstat(st->fd, &sb) == 0 && sb.st_size < st->offset) {
+      st->offset = 0;
+      st->line_len = 0;
+   }
+
+   while ((n = pread(st->fd, buf, READ_CHUNK, st->offset)) > 0) {
+      st->offset += n;
+      hit |= scan_lines(st, buf, (size_t)n);
+   }
+   return hit;
+}
+
+/* the log was replaced: drain what is left of the old file, then follow
+ * the new one from its start */
+static int reopen_if_rotated(LogState* st, char* buf) {
+
+   struct stat sb;
+   int hit = 0;
+
+   if (stat(st->log->path, &sb))
+      return 0;
+   if (st->fd >= 0 && sb.st_ino == st->ino)
+      return 0;
+
+   if (st->fd >= 0) {
+      hit = read_new(st, buf);
+      close(st->fd);
+   }
+   if (open_log(st, 0) == 0)
+      hit |= read_new(st, buf);
+   return hit;
+}
+
+static void load_state(const char* filename, LogState* logs, int nlogs) {
+
+   FILE* file;
+   char path[PATH_MAX];
+   unsigned long ino;
+   long long offset;
+   struct stat sb;
+   int i;
+   int found;
+
+   file = fopen(filename, "r");
+
+   for (i = 0; i < nlogs; i++) {
+      found = 0;
+      if (file) {
+         rewind(file);
+         while (fscanf(file, "%lu %lld %4095s", &ino, &offset, path) == 3) {
+            if (strcmp(path, logs[i].log->path) == 0) {
+               found = 1;
+               break;
+            }
+         }
+      }
+
+      if (stat(logs[i].log->path, &sb)) {
+         logs[i].fd = -1;
+         continue;
+      }
+      if (found && (ino_t)ino == sb.st_ino) {
+         open_log(&logs[i], (off_t)offset);
+      } else if (found) {
+         /* rotated while we were not running */
+         open_log(&logs[i], 0);
+      } else {
+         /* first run, history proves nothing about now */
+         open_log(&logs[i], sb.st_size);
+      }
+   }
+
+   if (file)
+      fclose(file);
+}
+
+static void save_state(const char* filename, const LogState* logs, int nlogs) {
+
+   char tmp[PATH_MAX];
+   FILE* file;
+   int i;
+
+   snprintf(tmp, sizeof(tmp), "%s.tmp", filename);
+   if ((file = fopen(tmp, "w")) == NULL)
+      return;
+   /* an unfinished last line is read again after a restart */
+   for (i = 0; i < nlogs; i++) {
+      if (logs[i].fd >= 0)
+         fprintf(file, "%lu %lld %s\n", (unsigned long)logs[i].ino,
+                 (long long)(logs[i].offset - (off_t)logs[i].line_len), logs[i].log->path);
+   }
+   if (fclose(file) == 0)
+      rename(tmp, filename);
+   else
+      unlink(tmp);
+}
+
+static int add_watch(int ifd, LogState* st) {
+
+   char dir[PATH_MAX];
+   char* slash;
+
+   strncpy(dir, st->log->path, sizeof(dir) - 1);
+   dir[sizeof(dir) - 1] = '\0';
+   if ((slash = strrchr(dir, '/')) == NULL) {
+      strcpy(dir, ".");
+      st->name = st->log->path;
+   } else {
+      *slash = '\0';
+      st->name = st->log->path + (slash - dir) + 1;
+      if (slash == dir)
+         strcpy(dir, "/");
+   }
+
+   st->wd = inotify_add_watch(ifd, dir, IN_MODIFY | IN_CREATE | IN_MOVED_TO | IN_CLOSE_WRITE);
+   if (st->wd < 0) {
+      fprintf(stderr, "cannot watch %s: %s\n", dir, strerror(errno));
+      return 1;
+   }
+   return 0;
+}
+
+/* Blocks until SIGTERM or SIGINT, calling report once for every batch of
+ * log events that contains a success marker. */
+int dms_watch_run(CURL* curl, const WatchLog* logs, int nlogs, const char* state_file, daemon_tick_fn report) {
+
+   LogState state[MAX_WATCH_LOGS];
+   char events[EVENT_BUF] __attribute__((aligned(__alignof__(struct inotify_event))));
+   const struct inotify_event* ev;
+   char* buf;
+   ssize_t len;
+   ssize_t off;
+   int ifd;
+   int hit;
+   int i;
+   int rv = 0;
+
+   if (nlogs > MAX_WATCH_LOGS)
+      nlogs = MAX_WATCH_LOGS;
+
+   if ((buf = malloc(READ_CHUNK)) == NULL) {
+      fprintf(stderr, "out of memory\n");
+      return 1;
+   }
+
+   if ((ifd = inotify_init1(IN_CLOEXEC)) < 0) {
+      fprintf(stderr, "inotify initialization failed: %s\n", strerror(errno));
+      free(buf);
+      return 1;
+   }
+
+   memset(state, 0, sizeof(state));
+   for (i = 0; i < nlogs; i++) {
+      state[i].log = &logs[i];
+      state[i].fd = -1;
+      if (add_watch(ifd, &state[i])) {
+         rv = 1;
+         goto out;
+      }
+   }
+   load_state(state_file, state, nlogs);
+
+   dms_daemon_install_signals();
+
+   /* anything appended while we were down counts too */
+   hit = 0;
+   for (i = 0; i < nlogs; i++)
+      hit |= read_new(&state[i], buf);
+
+   while (!dms_daemon_should_stop()) {
+      if (hit) {
+         if (report(curl))
+            fprintf(stderr, "check-in failed\n");
+         hit = 0;
+      }
+      save_state(state_file, state, nlogs);
+
+      if ((len = read(ifd, events, sizeof(events))) <= 0) {
+         if (len < 0 && errno == EINTR)
+            continue;
+         fprintf(stderr, "inotify read failed\n");
+         rv = 1;
+         break;
+      }
+
+      for (off = 0; off < len; off += (ssize_t)(sizeof(*ev) + ev->len)) {
+         ev = (const struct inotify_event*)(events + off);
+         if (!ev->len)
+            continue;
+         for (i = 0; i < nlogs; i++) {
+            if (ev->wd != state[i].wd || strcmp(ev->name, state[i].name) != 0)
+               continue;
+            if (ev->mask & (IN_CREATE | IN_MOVED_TO))
+               hit |= reopen_if_rotated(&state[i], buf);
+            else
+               hit |= reopen_if_rotated(&state[i], buf) | read_new(&state[i], buf);
+         }
+      }
+   }
+
+   save_state(state_file, state, nlogs);
+
+out:
+   for (i = 0; i < nlogs; i++) {
+      if (state[i].fd >= 0)
+         close(state[i].fd);
+   }
+   close(ifd);
+   free(buf);
+   return rv;
+}
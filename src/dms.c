@@ -34,35 +34,113 @@
 #include <getopt.h>
 #include <string.h>
 #include <errno.h>
+#include <time.h>
+#include <limits.h>
+#include <sys/inotify.h>
+#include <sys/stat.h>
 
 #include <curl/curl.h>
 #include <jansson.h>
 
 #include <readconf.h>
+#include <dms-agent.h>
+#include <dms-cache.h>
+#include <dms-clamd.h>
 #include <dms-crud.h>
+#include <dms-cvd.h>
+#include <dms-daemon.h>
+#include <dms-fleet.h>
+#include <dms-guard.h>
+#include <dms-outbox.h>
+#include <dms-ratelimit.h>
+#include <dms-run.h>
+#include <dms-scan.h>
+#include <dms-sched.h>
+#include <dms-stamp.h>
+#include <dms-stats.h>
+#include <dms-status.h>
+#include <dms-tokens.h>
+#include <dms-watch.h>
 #include <config.h>
 
 #define unlikely(x)    __builtin_expect(!!(x), 0)
 
 #define SNITCH_CREATE_TEMPLATE \
-  "{\"name\":\"%s daily ClamAV\", \"interval\":\"daily\", \"tags\":[\"production\", \"anti-virus\"]}"
+  "{\"name\":\"%s daily ClamAV\", \"interval\":\"%s\", \"tags\":[\"production\", \"anti-virus\"%s]}"
+#define SNITCH_CREATE_NAMED_TEMPLATE \
+  "{\"name\":\"%s %s\", \"interval\":\"%s\", \"tags\":[\"production\", \"anti-virus\"%s]}"
+/* what SNITCH_CREATE_TEMPLATE creates on a system, for another system */
+#define SNITCH_CREATE_BULK_TEMPLATE \
+  "{\"name\":\"%s %s ClamAV\", \"interval\":\"%s\", \"tags\":[\"production\", \"anti-virus\"%s]}"
+
+/* the snitch SNITCH_CREATE_TEMPLATE creates, the only one that may still
+ * live in the single-token file */
+#define DEFAULT_SNITCH "clamav"
 
 #define MAX_TOKEN 256
+#define MAX_LINE 512
+#define FLEET_MAX_INFLIGHT 16
+/* seconds between connection refreshes while a wrapped command runs,
+ * inside the minute most HTTP front ends keep an idle connection */
+#define RUN_WARM_INTERVAL 50
+/* passes over the creates that failed in a way that created nothing */
+#define BULK_ROUNDS 3
+#define BULK_RETRY_PAUSE_MS 500
+/* room for the inotify events of one burst of config edits */
+#define RELOAD_EVENT_BUF (16 * (sizeof(struct inotify_event) + NAME_MAX + 1))
+
+/* the tags every snitch we create carries, see the templates above */
+#define RECONCILE_TAGS "production,anti-virus"
 
 typedef enum {
   COMMISSION,
   DECOMMISSION,
   REPORT,
-  PAUSE
+  PAUSE,
+  FLEET,
+  DAEMON,
+  WATCH,
+  AGENT,
+  PROBE,
+  FRESHNESS,
+  STATS,
+  RECONCILE,
+  RUN,
+  SCAN,
+  BATCH,
+  STATUS,
+  BULK
 } Action;
 
 Options options;
 
+char conf_file[PATH_MAX];
 char token_file[PATH_MAX];
+char tokens_file[PATH_MAX];
+const char* snitch_name = DEFAULT_SNITCH;
+char outbox_file[PATH_MAX];
+char stats_file[PATH_MAX];
+char watch_file[PATH_MAX];
+char stamp_file[PATH_MAX];
+char flight_file[PATH_MAX];
+char breaker_file[PATH_MAX];
+char ratelimit_file[PATH_MAX];
+char status_file[PATH_MAX];
+int status_json = 0;
+char fleet_file[PATH_MAX];
+char bulk_file[PATH_MAX];
+int fleet_max_inflight = FLEET_MAX_INFLIGHT;
+FleetOp reconcile_op;
+int reconcile_apply = 0;
+char* const* run_argv;
+char batch_file[PATH_MAX];
+char* const* scan_roots;
+int scan_nroots;
+int scan_workers = 0;
 
-const char* load_token() {;
+/* the single-token file written by earlier versions */
+static const char* load_token_file(char* token) {
 
-   static char token[MAX_TOKEN];
    FILE* file; 
    long size;
    size_t rv;
@@ -75,7 +153,7 @@ const char* load_token() {;
    fseek(file, 0 , SEEK_END);
    size = ftell(file);
    rewind(file);
-   if (size > MAX_TOKEN) {
+   if (size >= MAX_TOKEN) {
       fprintf(stderr, "token is larger than supported size\n");
       goto error;
    } 
@@ -85,6 +163,7 @@ const char* load_token() {;
       goto error;
    }
    fclose(file);
+   token[size] = '\0';
    token[strcspn(token, "\n")] = '\0';
    return token;
 error:
@@ -92,76 +171,176 @@ error:
    return NULL;
 }
 
+static int token_in_store(const char* name) {
+
+   TokenStore store;
+   int found;
+
+   if (dms_tokens_open(tokens_file, &store))
+      return 0;
+   found = dms_tokens_lookup(&store, name) != NULL;
+   dms_tokens_close(&store);
+   return found;
+}
+
+const char* load_token() {
+
+   static char token[MAX_TOKEN];
+   TokenStore store;
+   const char* found;
+
+   /* never report on behalf of a system -B provisioned */
+   if (dms_tokens_is_bulk(snitch_name)) {
+      fprintf(stderr, "no token for snitch %s\n", snitch_name);
+      return NULL;
+   }
+   if (dms_tokens_open(tokens_file, &store) == 0) {
+      found = dms_tokens_lookup(&store, snitch_name);
+      if (found) {
+         strncpy(token, found, MAX_TOKEN - 1);
+         dms_tokens_close(&store);
+         return token;
+      }
+      dms_tokens_close(&store);
+   }
+
+   if (strcmp(snitch_name, DEFAULT_SNITCH) == 0) {
+      return load_token_file(token);
+   }
+
+   fprintf(stderr, "no token for snitch %s\n", snitch_name);
+   return NULL;
+}
+
 void print_version() {
    printf(PACKAGE_STRING " " PACKAGE_URL "\n");
 }
 
 void print_usage() {
    static char const usage[] = "\
-Usage: " PACKAGE_NAME " [OPTIONS]\n\
+Usage: " PACKAGE_NAME " [OPTIONS] [COMMAND]\n\
 Options:\n\
    -c    commission a snitch for this system\n\
    -d    decommission snitch\n\
    -r    report on this snitch\n\
    -p    pause snitch\n\
+   -n    name of the snitch to act on (default " DEFAULT_SNITCH ")\n\
+   -f    check in every token listed in a file, concurrently\n\
+   -B    commission a snitch for every system in an inventory file,\n\
+         one \"SYSTEM [INTERVAL [TAGS]]\" per line, concurrently\n\
+   -j    maximum number of concurrent check-ins or creates (default 16),\n\
+         or of scanners for scan (default one per CPU)\n\
+   -b    run the commission, decommission, report and pause commands\n\
+         listed in a file (- for stdin), one \"ACTION [NAME]\" per line,\n\
+         printing a JSON result line for each\n\
+   -D    stay in the foreground and report on every snitch in the token\n\
+         store every CheckInInterval seconds, spread over the interval\n\
+   -w    follow the freshclam and clamd logs, report on successful database\n\
+         updates and on clamd reloading the database\n\
+   -a    listen on AgentSocket and combine the reports of local callers\n\
+         into one check-in per snitch every AgentWindow seconds\n\
+   -P    probe clamd on ClamdSocket, check in with its thread and queue\n\
+         figures only if it answers within ClamdLatency and its queue\n\
+         is at most ClamdMaxQueue\n\
+   -g    check in with the signature database versions only if daily in\n\
+         DatabaseDirectory was built within MaxDatabaseAge seconds\n\
    -v    display version information and exit\n\
    -h    display this help text and exit\n\
+Commands:\n\
+   stats [json]   print recent request timings in node_exporter textfile\n\
+                  format, or as JSON\n\
+   status [json]  print the snitch's status, last check-in, interval and\n\
+                  the age of that answer in seconds, from a copy kept for\n\
+                  StatusTTL seconds; exits 0 only if it is healthy\n\
+   reconcile [pause|delete]\n\
+                  list this system's snitches that have no local token,\n\
+                  and optionally pause or delete them concurrently\n\
+   run [--] COMMAND [ARGS]\n\
+                  run COMMAND and check in with its run time and resource\n\
+                  usage if it succeeds; exits with its status\n\
+   scan [--] PATH...\n\
+                  scan PATHs with ScanCommand in parallel batches, check in\n\
+                  once if every batch came back clean\n\
 ";
 
    printf(usage);
 }
 
+/* The extra tags of a [snitch NAME] section, as more JSON strings for
+ * the templates above. Tags are checked while parsing, nothing in them
+ * needs escaping. */
+static int section_tags(const SnitchConfig* sc, char* out, size_t size) {
+
+   const char* p;
+   size_t len = 0;
+   size_t n;
+
+   out[0] = '\0';
+   if (!sc || !sc->tags) {
+      return 0;
+   }
+   for (p = sc->tags; *p; p += n + (p[n] == ',')) {
+      n = strcspn(p, ",");
+      if (n == 0) {
+         continue;
+      }
+      if (len + n + 5 > size) {
+         fprintf(stderr, "too many tags for %s\n", sc->name);
+         return 1;
+      }
+      len += snprintf(out + len, size - len, ", \"%.*s\"", (int)n, p);
+   }
+   return 0;
+}
+
 int dms_commission(CURL* curl) {
 
-   FILE* file;
-   json_t* val;
-   json_t* token;
+   char token[TOKEN_VALUE_LEN];
    char req[JSON_BUF_LEN];
-   const char* text;
+   char tags[MAX_LINE];
+   const SnitchConfig* sc;
+   const char* interval = "daily";
+   TokenChange change;
+   int rv;
 
    /* make this call idempotent */
-   if (access(token_file, F_OK) == 0) {
+   if (token_in_store(snitch_name)) {
+      return 0;
+   }
+   if (strcmp(snitch_name, DEFAULT_SNITCH) == 0 && access(token_file, F_OK) == 0) {
       /* file exists and is readable */
       return 0;
    }
 
-   snprintf(req, JSON_BUF_LEN, SNITCH_CREATE_TEMPLATE, options.system_name);
-
-   val = dms_crud_create(curl, options.api_key, req, &options.verbose);
-
-   if ((file = fopen(token_file, "wb")) == NULL) {
-      fprintf(stderr, "could not open token file\n");    
+   sc = find_snitch_config(&options, snitch_name);
+   if (sc && sc->interval) {
+      interval = snitch_interval_name(sc->interval);
+   }
+   if (section_tags(sc, tags, sizeof(tags))) {
       return 1;
    }
 
-   if (!json_is_object(val)) {
-      /* error: json root is not an object */
-      fprintf(stderr, "json root is not an object\n");
-      json_decref(val);
-      return 1;
+   if (strcmp(snitch_name, DEFAULT_SNITCH) == 0) {
+      snprintf(req, JSON_BUF_LEN, SNITCH_CREATE_TEMPLATE, options.system_name, interval, tags);
+   } else {
+      snprintf(req, JSON_BUF_LEN, SNITCH_CREATE_NAMED_TEMPLATE, options.system_name, snitch_name, interval, tags);
    }
 
-   token = json_object_get(val, "token");
-   if (!json_is_string(token)) {
-      fprintf(stderr, "token is not a string\n");
-      json_decref(val);
+   if (dms_crud_create_token(curl, options.api_key, req, token, sizeof(token), &options.verbose)) {
       return 1;
    }
 
-   text = json_string_value(token);
-   fwrite(text, sizeof(char), strlen(text), file);
-   fclose(file);
-
-   json_decref(val);
+   change.name = snitch_name;
+   change.token = token;
+   rv = dms_tokens_update(tokens_file, &change, 1);
 
-   return 0;
+   return rv;
 }
 
 int dms_decommission(CURL* curl) {
 
-   long size;
-   size_t rv;
    const char* token;
+   TokenChange change;
 
    if ((token = load_token()) == NULL) {
       return 1;
@@ -172,7 +351,14 @@ int dms_decommission(CURL* curl) {
       return 1;
    }
 
-   if (remove(token_file)) {
+   if (token_in_store(snitch_name)) {
+      change.name = snitch_name;
+      change.token = NULL;
+      if (dms_tokens_update(tokens_file, &change, 1)) {
+         fprintf(stderr, "failed to remove token from store\n");
+         return 1;
+      }
+   } else if (remove(token_file)) {
       fprintf(stderr, "failed to remove token file\n");
       return 1;
    }
@@ -180,19 +366,275 @@ int dms_decommission(CURL* curl) {
    return 0;
 }
 
+static int outbox_send(CURL* curl, OutboxOp op, const char* token) {
+
+   switch (op) {
+   case OUTBOX_CHECK_IN:
+      return dms_crud_check_in(curl, token, &options.verbose);
+   case OUTBOX_PAUSE:
+      return dms_crud_pause(curl, options.api_key, token, &options.verbose);
+   }
+   return 1;
+}
+
+/* the per-snitch stamp of the last accepted check-in */
+static void stamp_path(char* path, size_t size) {
+   snprintf(path, size, "%s.%s", stamp_file, snitch_name);
+}
+
+/* A check-in within SkipFraction of the snitch's interval ago is good
+ * enough, unless the outbox still holds something to deliver. The
+ * interval is its section's, or SnitchInterval. */
+static int report_recent(void) {
+
+   char path[PATH_MAX + TOKEN_NAME_LEN];
+   const SnitchConfig* sc = find_snitch_config(&options, snitch_name);
+   long interval = options.snitch_interval;
+   struct stat st;
+   long age;
+
+   if (options.skip_fraction <= 0)
+      return 0;
+   if (stat(outbox_file, &st) == 0 && st.st_size > 0)
+      return 0;
+
+   stamp_path(path, sizeof(path));
+   if (dms_stamp_age(path, &age))
+      return 0;
+   if (sc && sc->interval)
+      interval = sc->interval;
+   return age < (long)(interval * options.skip_fraction);
+}
+
 int dms_report(CURL* curl) { 
 
    const char* token; 
+   char path[PATH_MAX + TOKEN_NAME_LEN];
+
+   if (report_recent()) {
+      if (options.verbose)
+         fprintf(stderr, "checked in recently, skipping\n");
+      return 0;
+   }
 
    if ((token = load_token()) == NULL) { 
       return 1;
    }
 
+   /* anything queued by earlier failed runs goes first */
+   dms_outbox_drain(outbox_file, curl, outbox_send, token);
+
    if (dms_crud_check_in(curl, token, &options.verbose)) {
-      fprintf(stderr, "failed to check-in\n");
+      fprintf(stderr, "failed to check-in, queued for retry\n");
+      dms_outbox_append(outbox_file, OUTBOX_CHECK_IN, token);
+      return 1;
+   }
+
+   stamp_path(path, sizeof(path));
+   dms_stamp_touch(path);
+
+   return 0;
+}
+
+int dms_probe(CURL* curl) {
+
+   ClamdHealth health;
+   char message[256];
+   char path[PATH_MAX + TOKEN_NAME_LEN];
+   const char* token;
+
+   if (dms_clamd_probe(options.clamd_socket, options.clamd_latency_ms, &health)) {
+      return 1;
+   }
+   if (health.queue > (unsigned long)options.clamd_max_queue) {
+      fprintf(stderr, "clamd queue at %u, over %ld\n", health.queue, options.clamd_max_queue);
+      return 1;
+   }
+
+   snprintf(message, sizeof(message),
+            "clamd ping %.1fms stats %.1fms, threads %u live %u idle %u max, queue %u",
+            health.ping_ms, health.stats_ms, health.threads_live, health.threads_idle,
+            health.threads_max, health.queue);
+   if (options.verbose) {
+      fprintf(stderr, "%s\n", message);
+   }
+
+   if ((token = load_token()) == NULL) {
+      return 1;
+   }
+
+   dms_outbox_drain(outbox_file, curl, outbox_send, token);
+
+   if (dms_crud_check_in_message(curl, token, message, 0, &options.verbose)) {
+      fprintf(stderr, "failed to check-in, queued for retry\n");
+      dms_outbox_append(outbox_file, OUTBOX_CHECK_IN, token);
+      return 1;
+   }
+
+   stamp_path(path, sizeof(path));
+   dms_stamp_touch(path);
+
+   return 0;
+}
+
+/* Only the 512-byte headers are read; daily is the one freshclam
+ * updates several times a day, so its build time stands for them all. */
+int dms_freshness(CURL* curl) {
+
+   static const char* const databases[] = { "main", "daily", "bytecode" };
+   CvdHeader headers[3];
+   int present[3];
+   char message[256];
+   char path[PATH_MAX + TOKEN_NAME_LEN];
+   const char* token;
+   size_t len = 0;
+   long long age;
+   int i;
+
+   for (i = 0; i < 3; i++) {
+      present[i] = dms_cvd_find(options.database_directory, databases[i], &headers[i]) == 0;
+   }
+   if (!present[1]) {
+      fprintf(stderr, "no daily database in %s\n", options.database_directory);
+      return 1;
+   }
+
+   age = (long long)time(NULL) - headers[1].stime;
+   if (age > options.max_database_age) {
+      fprintf(stderr, "daily %u built %llds ago, over %lds\n",
+              headers[1].version, age, options.max_database_age);
+      return 1;
+   }
+
+   len = snprintf(message, sizeof(message), "daily %u built %llds ago", headers[1].version, age);
+   for (i = 0; i < 3; i++) {
+      if (i == 1 || !present[i] || len >= sizeof(message))
+         continue;
+      len += snprintf(message + len, sizeof(message) - len, ", %s %u", databases[i], headers[i].version);
+   }
+   if (options.verbose) {
+      fprintf(stderr, "%s\n", message);
+   }
+
+   if ((token = load_token()) == NULL) {
+      return 1;
+   }
+
+   dms_outbox_drain(outbox_file, curl, outbox_send, token);
+
+   if (dms_crud_check_in_message(curl, token, message, 0, &options.verbose)) {
+      fprintf(stderr, "failed to check-in, queued for retry\n");
+      dms_outbox_append(outbox_file, OUTBOX_CHECK_IN, token);
+      return 1;
+   }
+
+   stamp_path(path, sizeof(path));
+   dms_stamp_touch(path);
+
+   return 0;
+}
+
+static void run_warm(void* user) {
+
+   dms_crud_check_in_warm((CURL*)user, &options.verbose);
+}
+
+/* The command runs regardless of the token, the job matters more than
+ * the report. Meanwhile the check-in connection is opened and kept warm,
+ * so the check-in leaves as soon as the command is done. */
+int dms_run(CURL* curl) {
+
+   RunUsage usage;
+   char message[512];
+   char path[PATH_MAX + TOKEN_NAME_LEN];
+   const char* token;
+
+   token = load_token();
+   dms_crud_set_keepalive(RUN_WARM_INTERVAL * 2);
+
+   if (dms_run_command(run_argv, RUN_WARM_INTERVAL, token ? run_warm : NULL, curl, &usage)) {
+      return 1;
+   }
+
+   snprintf(message, sizeof(message),
+            "%.64s exit %d in %.1fs, user %.1fs sys %.1fs, max rss %ld KiB, blocks in %ld out %ld",
+            run_argv[0], usage.exit_status, usage.wall_s, usage.user_s, usage.sys_s,
+            usage.maxrss_kb, usage.inblock, usage.oublock);
+   if (options.verbose) {
+      fprintf(stderr, "%s\n", message);
+   }
+
+   if (usage.exit_status != 0) {
+      fprintf(stderr, "%s exited with %d, not checking in\n", run_argv[0], usage.exit_status);
+      return usage.exit_status;
+   }
+   if (token == NULL) {
+      return 1;
+   }
+
+   if (dms_crud_check_in_message(curl, token, message, usage.exit_status, &options.verbose)) {
+      fprintf(stderr, "failed to check-in, queued for retry\n");
+      dms_outbox_append(outbox_file, OUTBOX_CHECK_IN, token);
+      return 1;
+   }
+
+   dms_outbox_drain(outbox_file, curl, outbox_send, token);
+
+   stamp_path(path, sizeof(path));
+   dms_stamp_touch(path);
+
+   return 0;
+}
+
+/* One snitch for the whole job: a single check-in, and only when every
+ * batch was scanned and came back clean. */
+int dms_scan(CURL* curl) {
+
+   ScanResult result;
+   char message[512];
+   char path[PATH_MAX + TOKEN_NAME_LEN];
+   const char* token;
+   int workers = scan_workers;
+
+   if (workers < 1 && (workers = (int)sysconf(_SC_NPROCESSORS_ONLN)) < 1) {
+      workers = 1;
+   }
+
+   token = load_token();
+   dms_crud_set_keepalive(RUN_WARM_INTERVAL * 2);
+
+   if (dms_scan_run(scan_roots, scan_nroots, options.scan_command, workers,
+                    RUN_WARM_INTERVAL, token ? run_warm : NULL, curl, &result)) {
+      return 1;
+   }
+
+   snprintf(message, sizeof(message),
+            "scanned %lu files in %lu batches on %d workers in %.1fs, %lu infected %lu failed %lu unreadable %lu vanished",
+            result.files, result.batches, result.workers, result.wall_s,
+            result.infected, result.failed, result.unreadable, result.vanished);
+   if (options.verbose) {
+      fprintf(stderr, "%s\n", message);
+   }
+
+   if (result.infected || result.failed || result.unreadable) {
+      fprintf(stderr, "%s, not checking in\n", message);
+      return 1;
+   }
+   if (token == NULL) {
+      return 1;
+   }
+
+   if (dms_crud_check_in_message(curl, token, message, 0, &options.verbose)) {
+      fprintf(stderr, "failed to check-in, queued for retry\n");
+      dms_outbox_append(outbox_file, OUTBOX_CHECK_IN, token);
       return 1;
    }
 
+   dms_outbox_drain(outbox_file, curl, outbox_send, token);
+
+   stamp_path(path, sizeof(path));
+   dms_stamp_touch(path);
+
    return 0;
 }
 
@@ -204,24 +646,963 @@ int dms_pause(CURL* curl) {
       return 1;
    }
 
+   dms_outbox_drain(outbox_file, curl, outbox_send, NULL);
+
    if (dms_crud_pause(curl, options.api_key, token, &options.verbose)) {
-      fprintf(stderr, "failed to pause\n");
+      fprintf(stderr, "failed to pause, queued for retry\n");
+      dms_outbox_append(outbox_file, OUTBOX_PAUSE, token);
+      return 1;
+   }
+
+   return 0;
+}
+
+static void status_path(char* path, size_t size) {
+   snprintf(path, size, "%s.%s", status_file, snitch_name);
+}
+
+/* the local copy is recent enough to answer from */
+static int status_fresh(SnitchStatus* st) {
+
+   char path[PATH_MAX + TOKEN_NAME_LEN];
+
+   status_path(path, sizeof(path));
+   return dms_status_load(path, st) == 0 && st->age < options.status_ttl;
+}
+
+/* exits 0 only for a snitch DMS calls healthy */
+static int status_print(const SnitchStatus* st) {
+
+   if (status_json) {
+      printf("{\"name\":\"%s\",\"status\":\"%s\",", snitch_name, st->status);
+      if (st->checked_in_at[0]) {
+         printf("\"checked_in_at\":\"%s\",", st->checked_in_at);
+      } else {
+         printf("\"checked_in_at\":null,");
+      }
+      printf("\"interval\":\"%s\",\"age\":%ld}\n", st->interval, st->age);
+   } else {
+      printf("%s %s %s %s %ld\n", snitch_name, st->status,
+             st->checked_in_at[0] ? st->checked_in_at : "never", st->interval, st->age);
+   }
+   return strcmp(st->status, "healthy") != 0;
+}
+
+/* Answers from the local copy while it is younger than StatusTTL, then
+ * asks DMS whether it changed, which mostly it hasn't. While DMS can't
+ * be reached the last copy is still the answer, however old; when DMS
+ * answers with anything but the status, that is the answer. */
+int dms_status(CURL* curl) {
+
+   char path[PATH_MAX + TOKEN_NAME_LEN];
+   SnitchStatus st;
+   json_t* snitch = NULL;
+   const char* token;
+   unsigned long ok_before;
+   unsigned long failed_before;
+   unsigned long ok_after;
+   unsigned long failed_after;
+   int unreachable = 1;
+   int cached;
+   int rc = 1;
+
+   status_path(path, sizeof(path));
+   memset(&st, 0, sizeof(st));
+   cached = dms_status_load(path, &st) == 0;
+   if (cached && st.age < options.status_ttl) {
+      return status_print(&st);
+   }
+
+   if ((token = load_token()) == NULL) {
+      return 1;
+   }
+
+   if (dms_breaker_allow()) {
+      dms_crud_outcomes(&ok_before, &failed_before);
+      rc = dms_crud_get(curl, options.api_key, token, cached ? st.etag : NULL,
+                        &snitch, st.etag, sizeof(st.etag), &options.verbose);
+      dms_crud_outcomes(&ok_after, &failed_after);
+      if (ok_after > ok_before)
+         dms_breaker_record(0);
+      else if (failed_after > failed_before)
+         dms_breaker_record(1);
+      unreachable = failed_after > failed_before;
+   }
+
+   /* an answer from DMS (404, 401) trumps the copy, however fresh */
+   if (rc && !unreachable) {
+      fprintf(stderr, "failed to get status\n");
+      return 1;
+   }
+
+   if (rc) {
+      if (!cached) {
+         fprintf(stderr, "failed to get status\n");
+         return 1;
+      }
+      fprintf(stderr, "DMS unreachable, status is %lds old\n", st.age);
+      return status_print(&st);
+   }
+
+   if (snitch == NULL) {
+      dms_status_confirm(path);
+      st.age = 0;
+   } else {
+      dms_status_from_json(snitch, &st);
+      json_decref(snitch);
+      dms_status_save(path, &st);
+   }
+   return status_print(&st);
+}
+
+int dms_fleet(void) {
+
+   FleetEntry* entries;
+   size_t count;
+   size_t i;
+   int failed;
+   struct timespec start;
+   struct timespec end;
+
+   if (dms_fleet_load(fleet_file, &entries, &count)) {
+      return 1;
+   }
+
+   clock_gettime(CLOCK_MONOTONIC, &start);
+   failed = dms_fleet_check_in(entries, count, fleet_max_inflight, &options.verbose);
+   clock_gettime(CLOCK_MONOTONIC, &end);
+
+   for (i = 0; i < count; i++) {
+      printf("%s %ld %.3fs %s\n", entries[i].token, entries[i].http_status,
+             entries[i].seconds, entries[i].rc ? "failed" : "ok");
+   }
+   printf("fleet: %zu check-ins, %d failed, %.3fs\n", count, failed,
+          (end.tv_sec - start.tv_sec) + (end.tv_nsec - start.tv_nsec) / 1e9);
+
+   dms_fleet_free(entries, count);
+
+   return failed ? 1 : 0;
+}
+
+typedef struct {
+   FleetEntry* entries;
+   char      (*names)[TOKEN_NAME_LEN];
+   size_t      count;
+   size_t      cap;
+   size_t      existing;
+} Bulk;
+
+static int bulk_listed(const Bulk* b, const char* name) {
+
+   size_t i;
+
+   for (i = 0; i < b->count; i++) {
+      if (strcmp(b->names[i], name) == 0)
+         return 1;
+   }
+   return 0;
+}
+
+static int bulk_add(Bulk* b, const char* name, const char* interval, const char* tags) {
+
+   SnitchConfig sc;
+   FleetEntry* entries;
+   char (*names)[TOKEN_NAME_LEN];
+   char extra[MAX_LINE];
+   char req[JSON_BUF_LEN];
+   FleetEntry* e;
+
+   if (b->count == b->cap) {
+      b->cap = b->cap ? b->cap * 2 : 64;
+      entries = realloc(b->entries, b->cap * sizeof(*entries));
+      if (entries) {
+         b->entries = entries;
+      }
+      names = realloc(b->names, b->cap * sizeof(*names));
+      if (names) {
+         b->names = names;
+      }
+      if (!entries || !names) {
+         return 1;
+      }
+   }
+
+   memset(&sc, 0, sizeof(sc));
+   sc.name = (char*)name;
+   sc.tags = (char*)tags;
+   if (section_tags(&sc, extra, sizeof(extra))) {
+      return 1;
+   }
+   snprintf(req, sizeof(req), SNITCH_CREATE_BULK_TEMPLATE, name, interval, interval, extra);
+
+   e = &b->entries[b->count];
+   memset(e, 0, sizeof(*e));
+   e->token = malloc(TOKEN_VALUE_LEN);
+   e->request = strdup(req);
+   if (!e->token || !e->request) {
+      free(e->token);
+      free(e->request);
+      return 1;
+   }
+   snprintf(b->names[b->count], TOKEN_NAME_LEN, "%s", name);
+   b->count++;
+   return 0;
+}
+
+/* One "SYSTEM [INTERVAL [TAGS]]" per line, INTERVAL in seconds or by
+ * name (default daily), TAGS added to ours. Systems already in the
+ * token store under the bulk prefix, or listed before, are counted and
+ * left out; a bad line fails the whole inventory before anything is
+ * created. */
+static int bulk_load(Bulk* b) {
+
+   FILE* file;
+   TokenStore store;
+   char line[MAX_LINE];
+   char key[TOKEN_NAME_LEN];
+   unsigned long lineno = 0;
+   const char* interval;
+   char* name;
+   char* word;
+   char* tags;
+   char* save;
+   long seconds;
+   int have_store;
+   int rv = 0;
+
+   if ((file = fopen(bulk_file, "r")) == NULL) {
+      fprintf(stderr, "%s is missing or unreadable\n", bulk_file);
+      return 1;
+   }
+   have_store = dms_tokens_open(tokens_file, &store) == 0;
+
+   while (fgets(line, sizeof(line), file)) {
+      lineno++;
+      if ((name = strtok_r(line, " \t\r\n", &save)) == NULL || *name == '#') {
+         continue;
+      }
+      word = strtok_r(NULL, " \t\r\n", &save);
+      tags = strtok_r(NULL, " \t\r\n", &save);
+
+      interval = "daily";
+      if (word) {
+         if ((seconds = snitch_interval_seconds(word)) <= 0) {
+            fprintf(stderr, "%s:%lu: bad interval %s\n", bulk_file, lineno, word);
+            rv = 1;
+            break;
+         }
+         interval = snitch_interval_name(seconds);
+      }
+      if (!dms_tokens_valid_name(name) || dms_tokens_bulk_name(key, sizeof(key), name)
+          || (tags && !snitch_tags_valid(tags)) || strtok_r(NULL, " \t\r\n", &save)) {
+         fprintf(stderr, "%s:%lu: bad entry\n", bulk_file, lineno);
+         rv = 1;
+         break;
+      }
+
+      /* make this idempotent, like dms_commission */
+      if ((have_store && dms_tokens_lookup(&store, key)) || bulk_listed(b, name)) {
+         b->existing++;
+         continue;
+      }
+      if (bulk_add(b, name, interval, tags)) {
+         fprintf(stderr, "out of memory\n");
+         rv = 1;
+         break;
+      }
+   }
+
+   if (have_store) {
+      dms_tokens_close(&store);
+   }
+   fclose(file);
+   return rv;
+}
+
+/* Worth another round: the create can't have happened, because the
+ * request never got through or was turned away unprocessed. Any other
+ * failure may have created the snitch, and is left to a rerun of the
+ * inventory to sort out. */
+static int bulk_retryable(const FleetEntry* e) {
+
+   if (e->http_status == 429 || e->http_status == 503) {
+      return 1;
+   }
+   return e->http_status == 0
+          && (e->rc == CURLE_COULDNT_RESOLVE_HOST || e->rc == CURLE_COULDNT_CONNECT);
+}
+
+/* Creates a snitch for every system in the inventory that has none yet,
+ * up to fleet_max_inflight at a time through the fleet runner, and
+ * retries only the failures that created nothing. The new tokens go
+ * into the store in one update at the end, under the bulk prefix so
+ * that neither -D nor reconcile takes them for this system's own. */
+int dms_bulk(void) {
+
+   Bulk b;
+   FleetEntry* round;
+   TokenChange* changes = NULL;
+   char (*keys)[TOKEN_NAME_LEN] = NULL;
+   size_t* pending = NULL;
+   size_t npending;
+   size_t nround;
+   size_t nchanges = 0;
+   size_t i;
+   struct timespec start;
+   struct timespec end;
+   struct timespec pause;
+   int failed = 0;
+   int r;
+   int rv = 1;
+
+   memset(&b, 0, sizeof(b));
+   if (bulk_load(&b)) {
+      goto out;
+   }
+
+   pending = calloc(b.count + 1, sizeof(*pending));
+   round = calloc(b.count + 1, sizeof(*round));
+   changes = calloc(b.count + 1, sizeof(*changes));
+   keys = calloc(b.count + 1, sizeof(*keys));
+   if (!pending || !round || !changes || !keys) {
+      fprintf(stderr, "out of memory\n");
+      free(round);
+      goto out;
+   }
+   for (i = 0; i < b.count; i++) {
+      pending[i] = i;
+   }
+   npending = b.count;
+
+   clock_gettime(CLOCK_MONOTONIC, &start);
+   for (r = 0; r < BULK_ROUNDS && npending > 0; r++) {
+      if (r > 0) {
+         pause.tv_sec = 0;
+         pause.tv_nsec = BULK_RETRY_PAUSE_MS * 1000000L * r;
+         while (pause.tv_nsec >= 1000000000L) {
+            pause.tv_sec++;
+            pause.tv_nsec -= 1000000000L;
+         }
+         nanosleep(&pause, NULL);
+      }
+
+      /* copies share token and request with the entries they stand for */
+      for (i = 0; i < npending; i++) {
+         round[i] = b.entries[pending[i]];
+         round[i].attempts = 0;
+      }
+      dms_fleet_run(round, npending, FLEET_CREATE, options.api_key, fleet_max_inflight, &options.verbose);
+
+      nround = npending;
+      npending = 0;
+      for (i = 0; i < nround; i++) {
+         b.entries[pending[i]] = round[i];
+         if (round[i].rc && bulk_retryable(&round[i])) {
+            pending[npending++] = pending[i];
+         }
+      }
+   }
+   clock_gettime(CLOCK_MONOTONIC, &end);
+   free(round);
+
+   for (i = 0; i < b.count; i++) {
+      if (b.entries[i].rc) {
+         failed++;
+      } else {
+         /* checked to fit when the inventory was read */
+         dms_tokens_bulk_name(keys[nchanges], sizeof(keys[nchanges]), b.names[i]);
+         changes[nchanges].name = keys[nchanges];
+         changes[nchanges].token = b.entries[i].token;
+         nchanges++;
+      }
+      printf("%s %s %ld %.3fs %s\n", b.names[i], b.entries[i].rc ? "-" : b.entries[i].token,
+             b.entries[i].http_status, b.entries[i].seconds, b.entries[i].rc ? "failed" : "ok");
+   }
+   printf("bulk: %zu created, %zu existing, %d failed, %.3fs\n", nchanges, b.existing, failed,
+          (end.tv_sec - start.tv_sec) + (end.tv_nsec - start.tv_nsec) / 1e9);
+
+   rv = failed ? 1 : 0;
+   if (nchanges > 0 && dms_tokens_update(tokens_file, changes, nchanges)) {
+      fprintf(stderr, "failed to save tokens, they are listed above\n");
+      rv = 1;
+   }
+
+out:
+   free(keys);
+   free(changes);
+   free(pending);
+   dms_fleet_free(b.entries, b.count);
+   free(b.names);
+   return rv;
+}
+
+typedef struct {
+   char**      known;         /* sorted tokens we still hold */
+   size_t      nknown;
+   size_t      cap;
+   FleetEntry* stale;
+   size_t      nstale;
+   size_t      stale_cap;
+   char        prefix[TOKEN_NAME_LEN * 2];
+} Reconcile;
+
+static int cmp_token(const void* a, const void* b) {
+   return strcmp(*(char* const*)a, *(char* const*)b);
+}
+
+static int reconcile_add_known(const char* name, const char* token, void* user) {
+
+   Reconcile* r = (Reconcile*) user;
+   char** grown;
+
+   /* provisioned for other systems, not ours to account for */
+   if (dms_tokens_is_bulk(name))
+      return 0;
+   if (r->nknown == r->cap) {
+      r->cap = r->cap ? r->cap * 2 : 64;
+      if ((grown = realloc(r->known, r->cap * sizeof(*grown))) == NULL)
+         return 1;
+      r->known = grown;
+   }
+   if ((r->known[r->nknown] = strdup(token)) == NULL)
+      return 1;
+   r->nknown++;
+   return 0;
+}
+
+static int reconcile_snitch(json_t* snitch, void* user) {
+
+   Reconcile* r = (Reconcile*) user;
+   const char* name = json_string_value(json_object_get(snitch, "name"));
+   const char* token = json_string_value(json_object_get(snitch, "token"));
+   const char* status = json_string_value(json_object_get(snitch, "status"));
+   FleetEntry* grown;
+
+   if (!name || !token || strncmp(name, r->prefix, strlen(r->prefix)) != 0)
+      return 0;
+   if (bsearch(&token, r->known, r->nknown, sizeof(*r->known), cmp_token))
+      return 0;
+   /* nothing left to do for these */
+   if (reconcile_apply && reconcile_op == FLEET_PAUSE && status && strcmp(status, "paused") == 0)
+      return 0;
+
+   if (r->nstale == r->stale_cap) {
+      r->stale_cap = r->stale_cap ? r->stale_cap * 2 : 16;
+      if ((grown = realloc(r->stale, r->stale_cap * sizeof(*grown))) == NULL) {
+         fprintf(stderr, "out of memory\n");
+         return 1;
+      }
+      r->stale = grown;
+   }
+   memset(&r->stale[r->nstale], 0, sizeof(*r->stale));
+   if ((r->stale[r->nstale].token = strdup(token)) == NULL) {
+      fprintf(stderr, "out of memory\n");
       return 1;
    }
+   r->nstale++;
 
+   printf("stale %s %s %s\n", token, status ? status : "-", name);
    return 0;
 }
 
+/* Snitches named after this system that neither the token store nor the
+ * legacy token file knows about were left behind by an earlier install
+ * of the host. Lists them, then pauses or deletes them if asked to. */
+int dms_reconcile(CURL* curl) {
+
+   Reconcile r;
+   TokenStore store;
+   char token[MAX_TOKEN];
+   size_t i;
+   int failed = 0;
+   int rv = 1;
+
+   memset(&r, 0, sizeof(r));
+   snprintf(r.prefix, sizeof(r.prefix), "%s ", options.system_name);
+
+   if (dms_tokens_open(tokens_file, &store) == 0) {
+      rv = dms_tokens_each(&store, reconcile_add_known, &r);
+      dms_tokens_close(&store);
+      if (rv) {
+         fprintf(stderr, "out of memory\n");
+         goto out;
+      }
+   }
+   if (access(token_file, R_OK) == 0 && load_token_file(token)) {
+      if (reconcile_add_known(DEFAULT_SNITCH, token, &r)) {
+         fprintf(stderr, "out of memory\n");
+         rv = 1;
+         goto out;
+      }
+   }
+   qsort(r.known, r.nknown, sizeof(*r.known), cmp_token);
+
+   if ((rv = dms_crud_list(curl, options.api_key, RECONCILE_TAGS, reconcile_snitch, &r, &options.verbose)) != 0)
+      goto out;
+
+   if (reconcile_apply && r.nstale > 0) {
+      failed = dms_fleet_run(r.stale, r.nstale, reconcile_op, options.api_key,
+                             fleet_max_inflight, &options.verbose);
+      for (i = 0; i < r.nstale; i++) {
+         printf("%s %s %ld %s\n", reconcile_op == FLEET_DELETE ? "delete" : "pause",
+                r.stale[i].token, r.stale[i].http_status, r.stale[i].rc ? "failed" : "ok");
+      }
+   }
+   printf("reconcile: %zu stale, %d failed\n", r.nstale, failed);
+   rv = failed ? 1 : 0;
+
+out:
+   for (i = 0; i < r.nknown; i++)
+      free(r.known[i]);
+   free(r.known);
+   dms_fleet_free(r.stale, r.nstale);
+   return rv;
+}
+
+int dms_dispatch(CURL* curl, int action);
+int dms_batch(CURL* curl);
+
+/* Every snitch of ours in the token store, and the one in the legacy
+ * token file unless the store has its own. */
+static int schedule_build(SnitchTable* table, const Options* opts) {
+
+   TokenStore store;
+   char token[MAX_TOKEN];
+   int rv = 0;
+
+   if (dms_tokens_open(tokens_file, &store) == 0) {
+      rv = dms_sched_add_store(table, &store, opts);
+      dms_tokens_close(&store);
+   }
+   if (rv == 0 && !token_in_store(DEFAULT_SNITCH) && access(token_file, F_OK) == 0
+       && load_token_file(token)) {
+      rv = dms_sched_add_snitch(table, DEFAULT_SNITCH, token, opts);
+   }
+   if (rv == 0 && table->count == 0) {
+      fprintf(stderr, "no snitches to report on\n");
+      rv = 1;
+   }
+   return rv;
+}
+
+/* One snitch come due, straight to the check-in; the wheel does the
+ * retrying, so there is nothing to queue. */
+static int schedule_check_in(CURL* curl, const char* name, const char* token, long deadline_ms) {
+
+   char path[PATH_MAX + TOKEN_NAME_LEN];
+   const char* saved = snitch_name;
+   unsigned long ok_before;
+   unsigned long failed_before;
+   unsigned long ok_after;
+   unsigned long failed_after;
+   int rc;
+
+   if (!dms_breaker_allow()) {
+      return 1;
+   }
+   if (deadline_ms) {
+      dms_crud_set_deadline(deadline_ms);
+   }
+   dms_crud_outcomes(&ok_before, &failed_before);
+   rc = dms_crud_check_in(curl, token, &options.verbose);
+   dms_crud_outcomes(&ok_after, &failed_after);
+   if (deadline_ms) {
+      dms_crud_set_deadline(options.deadline_ms);
+   }
+   /* a snitch DMS turned down (404, 401) says nothing about DMS itself */
+   if (ok_after > ok_before)
+      dms_breaker_record(0);
+   else if (failed_after > failed_before)
+      dms_breaker_record(1);
+
+   if (rc == 0) {
+      snitch_name = name;
+      stamp_path(path, sizeof(path));
+      snitch_name = saved;
+      dms_stamp_touch(path);
+   }
+   return rc;
+}
+
+/* inotify watches the directories, so edits that replace the file by
+ * renaming over it are seen too */
+static void schedule_watch_dir(int ifd, const char* path, int is_dir) {
+
+   char dir[PATH_MAX];
+   const char* slash;
+
+   if (is_dir) {
+      snprintf(dir, sizeof(dir), "%s", path);
+   } else if ((slash = strrchr(path, '/')) == NULL) {
+      snprintf(dir, sizeof(dir), ".");
+   } else if (slash == path) {
+      snprintf(dir, sizeof(dir), "/");
+   } else {
+      snprintf(dir, sizeof(dir), "%.*s", (int)(slash - path), path);
+   }
+   /* the same directory twice is the same watch */
+   if (inotify_add_watch(ifd, dir, IN_CLOSE_WRITE | IN_MOVED_TO | IN_DELETE) < 0
+       && options.verbose) {
+      fprintf(stderr, "not watching %s: %s\n", dir, strerror(errno));
+   }
+}
+
+static void schedule_watch(int ifd, const Options* opts) {
+
+   struct stat st;
+   size_t i;
+
+   schedule_watch_dir(ifd, conf_file, 0);
+   schedule_watch_dir(ifd, tokens_file, 0);
+   for (i = 0; i < opts->nincluded; i++) {
+      schedule_watch_dir(ifd, opts->included[i], stat(opts->included[i], &st) == 0 && S_ISDIR(st.st_mode));
+   }
+}
+
+static int same_base(const char* name, const char* path) {
+
+   const char* slash = strrchr(path, '/');
+
+   return strcmp(name, slash ? slash + 1 : path) == 0;
+}
+
+/* anything the configuration or the store is read from */
+static int schedule_relevant(const char* name, const Options* opts) {
+
+   size_t len = strlen(name);
+   size_t i;
+
+   if (same_base(name, conf_file) || same_base(name, tokens_file)) {
+      return 1;
+   }
+   if (len > 5 && strcmp(name + len - 5, ".conf") == 0) {
+      return 1;
+   }
+   for (i = 0; i < opts->nincluded; i++) {
+      if (same_base(name, opts->included[i])) {
+         return 1;
+      }
+   }
+   return 0;
+}
+
+/* The configuration or the store changed: read both again into a new
+ * table for the wheel to swap in. Only the snitches and their sections
+ * are taken, every other option still needs a restart. */
+static int schedule_reload(SnitchTable* fresh, void* user) {
+
+   char events[RELOAD_EVENT_BUF] __attribute__((aligned(__alignof__(struct inotify_event))));
+   const struct inotify_event* ev;
+   int ifd = *(int*)user;
+   Options next;
+   SnitchConfig* snitches;
+   size_t nsnitches;
+   char** included;
+   size_t nincluded;
+   ssize_t len;
+   ssize_t off;
+   int relevant = 0;
+
+   while ((len = read(ifd, events, sizeof(events))) > 0) {
+      for (off = 0; off < len; off += sizeof(*ev) + ev->len) {
+         ev = (const struct inotify_event*)(events + off);
+         if (ev->len > 0 && schedule_relevant(ev->name, &options)) {
+            relevant = 1;
+         }
+      }
+   }
+   if (!relevant) {
+      return 1;
+   }
+
+   initialize_options(&next);
+   if (read_config_file(conf_file, &next) || schedule_build(fresh, &next)) {
+      fprintf(stderr, "reload failed, keeping the current schedule\n");
+      free_options(&next);
+      return 1;
+   }
+   if (options.verbose) {
+      fprintf(stderr, "reloaded, scheduling %u snitches\n", fresh->count);
+   }
+
+   /* the sections move over, next takes the old ones with it */
+   snitches = options.snitches;
+   nsnitches = options.nsnitches;
+   included = options.included;
+   nincluded = options.nincluded;
+   options.snitches = next.snitches;
+   options.nsnitches = next.nsnitches;
+   options.included = next.included;
+   options.nincluded = next.nincluded;
+   next.snitches = snitches;
+   next.nsnitches = nsnitches;
+   next.included = included;
+   next.nincluded = nincluded;
+   free_options(&next);
+
+   schedule_watch(ifd, &options);
+   return 0;
+}
+
+/* Every snitch on one timer wheel, reloaded as the configuration and the
+ * store change. */
+int dms_schedule(CURL* curl) {
+
+   SnitchTable table;
+   int ifd;
+   int rv;
+
+   memset(&table, 0, sizeof(table));
+
+   rv = schedule_build(&table, &options);
+
+   if (rv == 0) {
+      if (options.verbose) {
+         fprintf(stderr, "scheduling %u snitches\n", table.count);
+      }
+      /* without inotify there is no reloading, but still scheduling */
+      if ((ifd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC)) < 0) {
+         fprintf(stderr, "inotify initialization failed: %s\n", strerror(errno));
+      } else {
+         schedule_watch(ifd, &options);
+      }
+      /* keep the connection eligible for reuse across a whole interval */
+      dms_crud_set_keepalive(options.check_in_interval + options.check_in_interval / 2);
+      rv = dms_sched_run(curl, &table, schedule_check_in, ifd, schedule_reload, &ifd);
+      if (ifd >= 0) {
+         close(ifd);
+      }
+   }
+
+   dms_sched_free(&table);
+   return rv;
+}
+
+/* a report from one of the long-running modes, guarded like -r */
+static int guarded_report(CURL* curl) {
+   return dms_dispatch(curl, REPORT);
+}
+
+/* the agent's check-ins, made the way -r makes them */
+static int agent_report(CURL* curl, const char* name) {
+
+   snitch_name = name;
+   return guarded_report(curl);
+}
+
+int dms_watch(CURL* curl) {
+
+   WatchLog logs[2];
+
+   logs[0].path = options.freshclam_log;
+   logs[0].markers = dms_watch_freshclam_markers;
+   logs[1].path = options.clamd_log;
+   logs[1].markers = dms_watch_clamd_markers;
+
+   return dms_watch_run(curl, logs, 2, watch_file, guarded_report);
+}
+
+static int run_action(CURL* curl, int action) {
+
+   switch (action) {
+   case COMMISSION:
+      return dms_commission(curl);
+   case DECOMMISSION:
+      return dms_decommission(curl);
+   case REPORT:
+      return dms_report(curl);
+   case PAUSE:
+      return dms_pause(curl);
+   case FLEET:
+      return dms_fleet();
+   case DAEMON:
+      return dms_schedule(curl);
+   case WATCH:
+      return dms_watch(curl);
+   case AGENT:
+      if (!options.agent_socket) {
+         fprintf(stderr, "AgentSocket is not configured\n");
+         return 1;
+      }
+      return dms_agent_run(curl, options.agent_socket, options.agent_window_ms, agent_report);
+   case RECONCILE:
+      return dms_reconcile(curl);
+   case PROBE:
+      return dms_probe(curl);
+   case FRESHNESS:
+      return dms_freshness(curl);
+   case RUN:
+      return dms_run(curl);
+   case SCAN:
+      return dms_scan(curl);
+   case BATCH:
+      return dms_batch(curl);
+   case STATUS:
+      return dms_status(curl);
+   case BULK:
+      return dms_bulk();
+   default:
+      return 1;
+   }
+}
+
+/* the single-snitch actions, also as batch files spell them */
+static const char* const action_names[] = {
+   [COMMISSION] = "commission", [DECOMMISSION] = "decommission",
+   [REPORT] = "report", [PAUSE] = "pause"
+};
+
+/* With the breaker open nothing goes out; check-ins and pauses are
+ * queued for the first run after the cooldown instead. */
+static int breaker_spool(int action) {
+
+   const char* token;
+
+   if ((action == REPORT || action == PAUSE) && (token = load_token()) != NULL) {
+      fprintf(stderr, "DMS unreachable lately, queued for retry\n");
+      dms_outbox_append(outbox_file, action == REPORT ? OUTBOX_CHECK_IN : OUTBOX_PAUSE, token);
+      return 1;
+   }
+   fprintf(stderr, "DMS unreachable lately, try again later\n");
+   return 1;
+}
+
+/* Runs an action behind the circuit breaker. Those on a single snitch
+ * also go through a single flight, so a run that overlaps another one
+ * doing the same waits for it and takes its result. The long-running
+ * modes come back through here for every report they make. */
+int dms_dispatch(CURL* curl, int action) {
+
+   GuardFlight flight = { -1, 0 };
+   char path[PATH_MAX + TOKEN_NAME_LEN + 16];
+   unsigned long ok_before;
+   unsigned long failed_before;
+   unsigned long ok_after;
+   unsigned long failed_after;
+   int rv;
+
+   /* a wrapped command or scan runs even while DMS is unreachable */
+   if (action == DAEMON || action == WATCH || action == AGENT || action == RUN || action == SCAN
+       || action == BATCH || action == STATUS) {
+      return run_action(curl, action);
+   }
+
+   if (action <= PAUSE) {
+      snprintf(path, sizeof(path), "%s.%s.%s", flight_file, action_names[action], snitch_name);
+      switch (dms_guard_begin(path, &flight, &rv)) {
+      case GUARD_FOLLOWER:
+         if (options.verbose)
+            fprintf(stderr, "joined a %s already in progress\n", action_names[action]);
+         return rv;
+      case GUARD_ERROR:
+         /* carry on without, as before */
+         flight.fd = -1;
+         break;
+      case GUARD_LEADER:
+         break;
+      }
+   }
+
+   if (!dms_breaker_allow()) {
+      rv = breaker_spool(action);
+   } else {
+      dms_crud_outcomes(&ok_before, &failed_before);
+      rv = run_action(curl, action);
+      dms_crud_outcomes(&ok_after, &failed_after);
+      if (ok_after > ok_before)
+         dms_breaker_record(0);
+      else if (failed_after > failed_before)
+         dms_breaker_record(1);
+   }
+
+   dms_guard_end(&flight, rv);
+   return rv;
+}
+
+/* Runs one "ACTION [NAME]" per line of batch_file ("-" for stdin), in
+ * order, on the one handle, so the connection stays warm from one to the
+ * next. Each goes through dms_dispatch as if run on its own and gets a
+ * JSON line on stdout. Returns 1 if any line failed. */
+int dms_batch(CURL* curl) {
+
+   FILE* file;
+   char line[MAX_LINE];
+   char name[TOKEN_NAME_LEN];
+   struct timespec start;
+   struct timespec end;
+   unsigned long lineno = 0;
+   const char* word;
+   const char* arg;
+   char* save;
+   long http_status;
+   int action;
+   int failed = 0;
+   int rv;
+
+   if (strcmp(batch_file, "-") == 0) {
+      file = stdin;
+   } else if ((file = fopen(batch_file, "r")) == NULL) {
+      fprintf(stderr, "%s is missing or unreadable\n", batch_file);
+      return 1;
+   }
+
+   while (fgets(line, sizeof(line), file)) {
+      lineno++;
+      if ((word = strtok_r(line, " \t\r\n", &save)) == NULL || *word == '#') {
+         continue;
+      }
+      arg = strtok_r(NULL, " \t\r\n", &save);
+
+      for (action = COMMISSION; action <= PAUSE; action++) {
+         if (strcmp(word, action_names[action]) == 0)
+            break;
+      }
+      if (action > PAUSE || (arg && !dms_tokens_valid_name(arg))) {
+         fprintf(stderr, "line %lu: %s\n", lineno, action > PAUSE ? "unknown command" : "invalid snitch name");
+         printf("{\"line\":%lu,\"rc\":1}\n", lineno);
+         fflush(stdout);
+         failed++;
+         continue;
+      }
+      snprintf(name, sizeof(name), "%s", arg ? arg : DEFAULT_SNITCH);
+      snitch_name = name;
+
+      /* so a line that never gets as far as a request reports none */
+      dms_crud_reset(curl);
+      clock_gettime(CLOCK_MONOTONIC, &start);
+      rv = dms_dispatch(curl, action);
+      clock_gettime(CLOCK_MONOTONIC, &end);
+      http_status = 0;
+      curl_easy_getinfo(curl, CURLINFO_RESPONSE_CODE, &http_status);
+
+      printf("{\"line\":%lu,\"command\":\"%s\",\"name\":\"%s\",\"rc\":%d,\"http_status\":%ld,\"seconds\":%.3f}\n",
+             lineno, action_names[action], name, rv, http_status,
+             (double)(end.tv_sec - start.tv_sec) + (double)(end.tv_nsec - start.tv_nsec) / 1e9);
+      fflush(stdout);
+      if (rv)
+         failed++;
+   }
+
+   if (file != stdin) {
+      fclose(file);
+   }
+   snitch_name = DEFAULT_SNITCH;
+
+   return failed > 0;
+}
+
 int main(int argc, char* argv[]) {
 
    int c;
    CURL* curl;
    char* env;
    int action = REPORT;
-   char conf_file[PATH_MAX];
    int rv; 
+   StatsFormat stats_format = STATS_FORMAT_PROMETHEUS;
+   SnitchStatus status;
 
-   while ((c = getopt(argc, argv, "cdrpvh")) != -1) {
+   /* options stop at the first command word */
+   while ((c = getopt(argc, argv, "+cdrpn:f:B:j:b:DwaPgvh")) != -1) {
       switch (c) {
       case 'c':
          action = COMMISSION;
@@ -235,6 +1616,44 @@ int main(int argc, char* argv[]) {
       case 'p':
          action = PAUSE;
          break;
+      case 'n':
+         if (!dms_tokens_valid_name(optarg)) {
+            fprintf(stderr, "invalid snitch name %s\n", optarg);
+            return 1;
+         }
+         snitch_name = optarg;
+         break;
+      case 'f':
+         action = FLEET;
+         strncpy(fleet_file, optarg, PATH_MAX - 1);
+         break;
+      case 'B':
+         action = BULK;
+         strncpy(bulk_file, optarg, PATH_MAX - 1);
+         break;
+      case 'b':
+         action = BATCH;
+         strncpy(batch_file, optarg, PATH_MAX - 1);
+         break;
+      case 'D':
+         action = DAEMON;
+         break;
+      case 'w':
+         action = WATCH;
+         break;
+      case 'a':
+         action = AGENT;
+         break;
+      case 'P':
+         action = PROBE;
+         break;
+      case 'g':
+         action = FRESHNESS;
+         break;
+      case 'j':
+         fleet_max_inflight = (int)strtol(optarg, (char **)NULL, 10);
+         scan_workers = fleet_max_inflight;
+         break;
       case 'v':
          print_version();
          return 0;
@@ -244,6 +1663,57 @@ int main(int argc, char* argv[]) {
       }
    }
 
+   if (optind < argc) {
+      if (strcmp(argv[optind], "stats") == 0) {
+         action = STATS;
+         if (optind + 1 < argc && strcmp(argv[optind + 1], "json") == 0) {
+            stats_format = STATS_FORMAT_JSON;
+         }
+      } else if (strcmp(argv[optind], "status") == 0) {
+         action = STATUS;
+         if (optind + 1 < argc && strcmp(argv[optind + 1], "json") == 0) {
+            status_json = 1;
+         }
+      } else if (strcmp(argv[optind], "reconcile") == 0) {
+         action = RECONCILE;
+         if (optind + 1 < argc) {
+            reconcile_apply = 1;
+            if (strcmp(argv[optind + 1], "pause") == 0) {
+               reconcile_op = FLEET_PAUSE;
+            } else if (strcmp(argv[optind + 1], "delete") == 0) {
+               reconcile_op = FLEET_DELETE;
+            } else {
+               print_usage();
+               return 1;
+            }
+         }
+      } else if (strcmp(argv[optind], "run") == 0) {
+         action = RUN;
+         if (optind + 1 < argc && strcmp(argv[optind + 1], "--") == 0) {
+            optind++;
+         }
+         if (optind + 1 >= argc) {
+            print_usage();
+            return 1;
+         }
+         run_argv = &argv[optind + 1];
+      } else if (strcmp(argv[optind], "scan") == 0) {
+         action = SCAN;
+         if (optind + 1 < argc && strcmp(argv[optind + 1], "--") == 0) {
+            optind++;
+         }
+         if (optind + 1 >= argc) {
+            print_usage();
+            return 1;
+         }
+         scan_roots = &argv[optind + 1];
+         scan_nroots = argc - optind - 1;
+      } else {
+         print_usage();
+         return 1;
+      }
+   }
+
    if (curl_global_init(CURL_GLOBAL_ALL)) {
       fprintf(stderr, "CURL global initialization failed\n");
       return 1;
@@ -273,9 +1743,114 @@ int main(int argc, char* argv[]) {
       strncpy(token_file, TOKEN_FILE, PATH_MAX);
    }
 
+   env = getenv("TOKENS");
+   if (env) {
+      strncpy(tokens_file, env, PATH_MAX - 1);
+   } else {
+      strncpy(tokens_file, TOKENS_FILE, PATH_MAX - 1);
+   }
+
+   env = getenv("OUTBOX");
+   if (env) {
+      strncpy(outbox_file, env, PATH_MAX - 1);
+   } else {
+      strncpy(outbox_file, OUTBOX_FILE, PATH_MAX - 1);
+   }
+
+   env = getenv("WATCH");
+   if (env) {
+      strncpy(watch_file, env, PATH_MAX - 1);
+   } else {
+      strncpy(watch_file, WATCH_FILE, PATH_MAX - 1);
+   }
+
+   env = getenv("STAMP");
+   if (env) {
+      strncpy(stamp_file, env, PATH_MAX - 1);
+   } else {
+      strncpy(stamp_file, STAMP_FILE, PATH_MAX - 1);
+   }
+
+   env = getenv("FLIGHT");
+   if (env) {
+      strncpy(flight_file, env, PATH_MAX - 1);
+   } else {
+      strncpy(flight_file, FLIGHT_FILE, PATH_MAX - 1);
+   }
+
+   env = getenv("BREAKER");
+   if (env) {
+      strncpy(breaker_file, env, PATH_MAX - 1);
+   } else {
+      strncpy(breaker_file, BREAKER_FILE, PATH_MAX - 1);
+   }
+
+   env = getenv("RATELIMIT");
+   if (env) {
+      strncpy(ratelimit_file, env, PATH_MAX - 1);
+   } else {
+      strncpy(ratelimit_file, RATELIMIT_FILE, PATH_MAX - 1);
+   }
+
+   env = getenv("STATUS");
+   if (env) {
+      strncpy(status_file, env, PATH_MAX - 1);
+   } else {
+      strncpy(status_file, STATUS_FILE, PATH_MAX - 1);
+   }
+
+   env = getenv("STATS");
+   if (env) {
+      strncpy(stats_file, env, PATH_MAX - 1);
+   } else {
+      strncpy(stats_file, STATS_FILE, PATH_MAX - 1);
+   }
+
+   /* reading the stats needs neither configuration nor network */
+   if (action == STATS) {
+      rv = dms_stats_print(stats_file, stats_format);
+      curl_global_cleanup();
+      return rv;
+   }
+
    if (read_config_file(conf_file, &options)) {
       return 1;
    }
+
+   /* nothing to do, and no reason to touch the network or the agent */
+   if (action == REPORT && report_recent()) {
+      curl_global_cleanup();
+      free_options(&options);
+      return 0;
+   }
+   if (action == STATUS && status_fresh(&status)) {
+      rv = status_print(&status);
+      curl_global_cleanup();
+      free_options(&options);
+      return rv;
+   }
+
+   /* leave the check-in to a running agent, we are done once it has it */
+   if (action == REPORT && options.agent_socket
+       && dms_agent_send(options.agent_socket, snitch_name) == 0) {
+      curl_global_cleanup();
+      free_options(&options);
+      return 0;
+   }
+
+   dms_stats_open(stats_file);
+   dms_breaker_open(breaker_file, options.breaker_threshold, options.breaker_cooldown);
+   dms_ratelimit_open(ratelimit_file);
+
+   dms_crud_set_urls(options.api_url, options.check_in_url);
+   if (options.relay) {
+      dms_crud_set_relay(options.relay);
+   }
+   dms_crud_set_deadline(options.deadline_ms);
+
+   if (options.cache_file) {
+      dms_cache_load(options.cache_file, options.cache_ttl);
+   }
    curl = curl_easy_init();
 
    if (unlikely(!curl)) {
@@ -283,22 +1858,18 @@ int main(int argc, char* argv[]) {
       return 1;
    }
 
-  switch (action) {
-  case COMMISSION:
-    rv = dms_commission(curl);
-    break;
-  case DECOMMISSION:
-    rv = dms_decommission(curl);
-    break;
-  case REPORT:
-    rv = dms_report(curl);
-    break;
-  case PAUSE:
-    rv = dms_pause(curl);
-    break;
-  }
+  rv = dms_dispatch(curl, action);
 
   curl_easy_cleanup(curl);
+  dms_ratelimit_close();
+  dms_breaker_close();
+  dms_stats_close();
+
+  if (options.cache_file) {
+    dms_cache_save(options.cache_file);
+    dms_cache_free();
+  }
+
   curl_global_cleanup();
 
   free_options(&options);
@@ -31,8 +31,18 @@
 
 #define CONF_FILE   "/etc/dms.conf"
 #define TOKEN_FILE  "/var/lib/dms/token"
+#define TOKENS_FILE "/var/lib/dms/tokens"
+#define OUTBOX_FILE "/var/lib/dms/outbox"
+#define STATS_FILE  "/var/lib/dms/stats"
+#define WATCH_FILE  "/var/lib/dms/watch"
+#define STAMP_FILE  "/var/lib/dms/last-check-in"
+#define FLIGHT_FILE "/var/lib/dms/flight"
+#define BREAKER_FILE "/var/lib/dms/breaker"
+#define RATELIMIT_FILE "/var/lib/dms/ratelimit"
+#define STATUS_FILE "/var/lib/dms/status"
 
 #define DMS_API_URL "https://api.deadmanssnitch.com/v1/snitches"
+#define DMS_CHECK_IN_URL "https://nosnch.in"
 
 #define JSON_BUF_LEN 2048
 
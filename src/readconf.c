@@ -32,144 +32,826 @@
 #include <stdarg.h>
 #include <stdlib.h>
 #include <string.h>
+#include <strings.h>
 #include <ctype.h>
+#include <dirent.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <unistd.h>
 
+#include <sys/mman.h>
+#include <sys/stat.h>
 #include <sys/types.h>
 
-#define WHITESPACE " \t\r\n"
-#define QUOTE	"\""
+/* how deep Include may nest */
+#define MAX_INCLUDE_DEPTH 8
+
+#define DEFAULT_CHECK_IN_INTERVAL 3600
+#define DEFAULT_CACHE_TTL 300
+#define DEFAULT_FRESHCLAM_LOG "/var/log/clamav/freshclam.log"
+#define DEFAULT_CLAMD_LOG "/var/log/clamav/clamav.log"
+#define DEFAULT_AGENT_WINDOW_MS 5000
+#define DEFAULT_SNITCH_INTERVAL 86400
+#define DEFAULT_BREAKER_THRESHOLD 5
+#define DEFAULT_BREAKER_COOLDOWN 300
+#define DEFAULT_CLAMD_SOCKET "/var/run/clamav/clamd.ctl"
+#define DEFAULT_CLAMD_LATENCY_MS 1000
+#define DEFAULT_CLAMD_MAX_QUEUE 10
+#define DEFAULT_DATABASE_DIRECTORY "/var/lib/clamav"
+#define DEFAULT_MAX_DATABASE_AGE 172800
+#define DEFAULT_SCAN_COMMAND "clamdscan"
+#define DEFAULT_STATUS_TTL 60
 
 typedef enum {
    OPCODE_API_KEY,
    OPCODE_SYSTEM_NAME,
+   OPCODE_CHECK_IN_INTERVAL,
+   OPCODE_CACHE_FILE,
+   OPCODE_CACHE_TTL,
+   OPCODE_API_URL,
+   OPCODE_CHECK_IN_URL,
+   OPCODE_FRESHCLAM_LOG,
+   OPCODE_CLAMD_LOG,
+   OPCODE_DEADLINE,
+   OPCODE_AGENT_SOCKET,
+   OPCODE_AGENT_WINDOW,
+   OPCODE_RELAY,
+   OPCODE_SNITCH_INTERVAL,
+   OPCODE_SKIP_FRACTION,
+   OPCODE_BREAKER_THRESHOLD,
+   OPCODE_BREAKER_COOLDOWN,
+   OPCODE_CLAMD_SOCKET,
+   OPCODE_CLAMD_LATENCY,
+   OPCODE_CLAMD_MAX_QUEUE,
+   OPCODE_DATABASE_DIRECTORY,
+   OPCODE_MAX_DATABASE_AGE,
+   OPCODE_SCAN_COMMAND,
+   OPCODE_STATUS_TTL,
    OPCODE_BAD
 } OPCODE_TYPE;
 
-static void lowercase(char* s);
-static char* strdelim(char** s);
-static int process_config_line(Options* options, char* line);
+/* keys of a [snitch NAME] section */
+typedef enum {
+   SNITCH_OPCODE_INTERVAL,
+   SNITCH_OPCODE_TAGS,
+   SNITCH_OPCODE_DEADLINE,
+   SNITCH_OPCODE_BAD
+} SNITCH_OPCODE_TYPE;
+
+/* a stretch of the mapped file, not terminated */
+typedef struct {
+   const char* p;
+   size_t len;
+} Span;
+
+static int parse_file(Options* options, const char* filename, int depth);
+static int process_config_line(Options* options, Span keyword, Span arg);
 
 void initialize_options(Options* options) {
    memset(options, 'X', sizeof(*options));
    options->api_key = NULL;
    options->system_name = NULL;
    options->verbose = 0;
+   options->check_in_interval = DEFAULT_CHECK_IN_INTERVAL;
+   options->cache_file = NULL;
+   options->cache_ttl = DEFAULT_CACHE_TTL;
+   options->api_url = NULL;
+   options->check_in_url = NULL;
+   options->freshclam_log = strdup(DEFAULT_FRESHCLAM_LOG);
+   options->clamd_log = strdup(DEFAULT_CLAMD_LOG);
+   options->deadline_ms = 0;
+   options->agent_socket = NULL;
+   options->agent_window_ms = DEFAULT_AGENT_WINDOW_MS;
+   options->relay = NULL;
+   options->snitch_interval = DEFAULT_SNITCH_INTERVAL;
+   options->skip_fraction = 0;
+   options->breaker_threshold = DEFAULT_BREAKER_THRESHOLD;
+   options->breaker_cooldown = DEFAULT_BREAKER_COOLDOWN;
+   options->clamd_socket = strdup(DEFAULT_CLAMD_SOCKET);
+   options->clamd_latency_ms = DEFAULT_CLAMD_LATENCY_MS;
+   options->clamd_max_queue = DEFAULT_CLAMD_MAX_QUEUE;
+   options->database_directory = strdup(DEFAULT_DATABASE_DIRECTORY);
+   options->max_database_age = DEFAULT_MAX_DATABASE_AGE;
+   options->scan_command = strdup(DEFAULT_SCAN_COMMAND);
+   options->status_ttl = DEFAULT_STATUS_TTL;
+   options->snitches = NULL;
+   options->nsnitches = 0;
+   options->included = NULL;
+   options->nincluded = 0;
 }
 
 void free_options(Options* options) {
+
+   size_t i;
+
    if (options->api_key)
       free(options->api_key);
    if (options->system_name)
       free(options->system_name);
+   if (options->cache_file)
+      free(options->cache_file);
+   if (options->api_url)
+      free(options->api_url);
+   if (options->check_in_url)
+      free(options->check_in_url);
+   if (options->freshclam_log)
+      free(options->freshclam_log);
+   if (options->clamd_log)
+      free(options->clamd_log);
+   if (options->agent_socket)
+      free(options->agent_socket);
+   if (options->relay)
+      free(options->relay);
+   if (options->clamd_socket)
+      free(options->clamd_socket);
+   if (options->database_directory)
+      free(options->database_directory);
+   if (options->scan_command)
+      free(options->scan_command);
+   for (i = 0; i < options->nsnitches; i++) {
+      free(options->snitches[i].name);
+      free(options->snitches[i].tags);
+   }
+   free(options->snitches);
+   for (i = 0; i < options->nincluded; i++)
+      free(options->included[i]);
+   free(options->included);
+}
+
+static int compare_snitch(const void* a, const void* b) {
+
+   return strcmp(((const SnitchConfig*)a)->name, ((const SnitchConfig*)b)->name);
+}
+
+/* Sorted by name for lookups, a name given twice keeps its last section
+ * (qsort isn't stable, so sections are numbered as they are read). */
+static void sort_snitches(Options* options) {
+
+   size_t i;
+   size_t n = 0;
+
+   qsort(options->snitches, options->nsnitches, sizeof(*options->snitches), compare_snitch);
+   for (i = 0; i < options->nsnitches; i++) {
+      if (n > 0 && strcmp(options->snitches[n - 1].name, options->snitches[i].name) == 0) {
+         if (options->snitches[i].order < options->snitches[n - 1].order) {
+            free(options->snitches[i].name);
+            free(options->snitches[i].tags);
+            continue;
+         }
+         free(options->snitches[n - 1].name);
+         free(options->snitches[n - 1].tags);
+         n--;
+      }
+      options->snitches[n++] = options->snitches[i];
+   }
+   options->nsnitches = n;
 }
 
 int read_config_file(const char* filename, Options* options) {
-  
-   FILE* f;
-   char line[1024];
 
-   if ((f = fopen(filename, "r")) == NULL) {
+   int rv;
+
+   rv = parse_file(options, filename, 0);
+   sort_snitches(options);
+   return rv;
+}
+
+const SnitchConfig* find_snitch_config(const Options* options, const char* name) {
+
+   SnitchConfig key;
+
+   if (options->nsnitches == 0)
+      return NULL;
+   key.name = (char*)name;
+   return bsearch(&key, options->snitches, options->nsnitches, sizeof(key), compare_snitch);
+}
+
+static int span_is(Span s, const char* word) {
+
+   return s.len == strlen(word) && strncasecmp(s.p, word, s.len) == 0;
+}
+
+static char* span_dup(Span s) {
+
+   char* copy;
+
+   if ((copy = malloc(s.len + 1)) == NULL)
+      return NULL;
+   memcpy(copy, s.p, s.len);
+   copy[s.len] = '\0';
+   return copy;
+}
+
+/* Numbers are the one thing copied out, onto the stack, because strtol
+ * and strtod want a terminated string and the map may end right after
+ * the last digit. Anything that isn't wholly a number parses as -1. */
+static long span_long(Span s) {
+
+   char buf[32];
+   char* end;
+   long v;
+
+   if (s.len == 0 || s.len >= sizeof(buf))
+      return -1;
+   memcpy(buf, s.p, s.len);
+   buf[s.len] = '\0';
+   v = strtol(buf, &end, 10);
+   return *end == '\0' ? v : -1;
+}
+
+static double span_double(Span s) {
+
+   char buf[32];
+   char* end;
+   double v;
+
+   if (s.len == 0 || s.len >= sizeof(buf))
+      return -1;
+   memcpy(buf, s.p, s.len);
+   buf[s.len] = '\0';
+   v = strtod(buf, &end);
+   return *end == '\0' ? v : -1;
+}
+
+static int is_space(char c) {
+
+   return c == ' ' || c == '\t' || c == '\r';
+}
+
+/* Splits a line (without its newline) into the keyword and the first
+ * argument, plain or in double quotes, with an optional '=' between. */
+static int split_line(const char* p, const char* end, Span* keyword, Span* arg) {
+
+   const char* q;
+
+   keyword->p = p;
+   while (p < end && !is_space(*p) && *p != '=')
+      p++;
+   keyword->len = (size_t)(p - keyword->p);
+
+   while (p < end && is_space(*p))
+      p++;
+   if (p < end && *p == '=') {
+      p++;
+      while (p < end && is_space(*p))
+         p++;
+   }
+
+   if (p < end && *p == '"') {
+      if ((q = memchr(p + 1, '"', (size_t)(end - p - 1))) == NULL)
+         return 1;
+      arg->p = p + 1;
+      arg->len = (size_t)(q - p - 1);
+      return 0;
+   }
+   arg->p = p;
+   while (p < end && !is_space(*p))
+      p++;
+   arg->len = (size_t)(p - arg->p);
+   return 0;
+}
+
+/* "[snitch NAME]", returns the index of its new SnitchConfig or -1 */
+static long open_section(Options* options, const char* p, const char* end) {
+
+   SnitchConfig* grown;
+   SnitchConfig* sc;
+   Span kind;
+   Span name;
+   const char* close;
+
+   if ((close = memchr(p, ']', (size_t)(end - p))) == NULL)
+      return -1;
+   p++;
+   while (p < close && is_space(*p))
+      p++;
+   kind.p = p;
+   while (p < close && !is_space(*p))
+      p++;
+   kind.len = (size_t)(p - kind.p);
+   while (p < close && is_space(*p))
+      p++;
+   name.p = p;
+   name.len = (size_t)(close - p);
+   while (name.len > 0 && is_space(name.p[name.len - 1]))
+      name.len--;
+
+   if (!span_is(kind, "snitch") || name.len == 0)
+      return -1;
+
+   if (options->nsnitches % 64 == 0) {
+      grown = realloc(options->snitches, (options->nsnitches + 64) * sizeof(*grown));
+      if (grown == NULL)
+         return -1;
+      options->snitches = grown;
+   }
+   sc = &options->snitches[options->nsnitches];
+   memset(sc, 0, sizeof(*sc));
+   if ((sc->name = span_dup(name)) == NULL)
+      return -1;
+   sc->order = options->nsnitches;
+   return (long)options->nsnitches++;
+}
+
+/* the intervals DMS knows by name */
+static const struct {
+   const char* name;
+   long seconds;
+} intervals[] = {
+   { "15_minute", 900 },
+   { "30_minute", 1800 },
+   { "hourly", 3600 },
+   { "daily", 86400 },
+   { "weekly", 604800 },
+   { "monthly", 2592000 },
+};
+
+static long parse_interval(Span arg) {
+
+   size_t i;
+
+   for (i = 0; i < sizeof(intervals) / sizeof(intervals[0]); i++) {
+      if (span_is(arg, intervals[i].name))
+         return intervals[i].seconds;
+   }
+   return span_long(arg);
+}
+
+/* seconds, or an interval DMS knows by name; 0 or less if neither */
+long snitch_interval_seconds(const char* s) {
+
+   Span arg;
+
+   arg.p = s;
+   arg.len = strlen(s);
+   return parse_interval(arg);
+}
+
+/* the shortest interval DMS has that is at least seconds long */
+const char* snitch_interval_name(long seconds) {
+
+   size_t i;
+
+   for (i = 0; i < sizeof(intervals) / sizeof(intervals[0]) - 1; i++) {
+      if (seconds <= intervals[i].seconds)
+         break;
+   }
+   return intervals[i].name;
+}
+
+/* tags end up in the JSON of a create, so only plain ones */
+static int valid_tags(Span arg) {
+
+   size_t i;
+
+   if (arg.len == 0)
+      return 0;
+   for (i = 0; i < arg.len; i++) {
+      if (!isalnum((unsigned char)arg.p[i]) && !strchr(",-_.", arg.p[i]))
+         return 0;
+   }
+   return 1;
+}
+
+int snitch_tags_valid(const char* s) {
+
+   Span arg;
+
+   arg.p = s;
+   arg.len = strlen(s);
+   return valid_tags(arg);
+}
+
+static SNITCH_OPCODE_TYPE parse_snitch_token(Span keyword) {
+  if (span_is(keyword, "interval"))
+    return SNITCH_OPCODE_INTERVAL;
+  if (span_is(keyword, "tags"))
+    return SNITCH_OPCODE_TAGS;
+  if (span_is(keyword, "deadline"))
+    return SNITCH_OPCODE_DEADLINE;
+  return SNITCH_OPCODE_BAD;
+}
+
+static void process_snitch_line(SnitchConfig* sc, Span keyword, Span arg) {
+
+  switch (parse_snitch_token(keyword)) {
+  case SNITCH_OPCODE_INTERVAL:
+    if (parse_interval(arg) <= 0) {
+      printf("bad snitch interval");
+      break;
+    }
+    sc->interval = parse_interval(arg);
+    break;
+  case SNITCH_OPCODE_TAGS:
+    if (!valid_tags(arg)) {
+      printf("bad snitch tags");
+      break;
+    }
+    free(sc->tags);
+    sc->tags = span_dup(arg);
+    break;
+  case SNITCH_OPCODE_DEADLINE:
+    /* seconds, fractions allowed */
+    if (span_double(arg) <= 0) {
+      printf("bad snitch deadline");
+      break;
+    }
+    sc->deadline_ms = (long)(span_double(arg) * 1000);
+    break;
+  case SNITCH_OPCODE_BAD:
+    printf("bad snitch directive");
+    break;
+  }
+}
+
+static void include_path(Options* options, const char* from, Span arg, int depth);
+
+/* One pass over the mapped file, a line at a time; nothing is copied but
+ * the values that are kept. Like a bad directive, a bad line is reported
+ * and skipped. */
+static void parse_buffer(Options* options, const char* filename, const char* p, const char* end, int depth) {
+
+   const char* eol;
+   const char* line_end;
+   Span keyword;
+   Span arg;
+   long section = -1;
+   int lineno = 0;
+
+   for (; p < end; p = eol + 1) {
+      lineno++;
+      if ((eol = memchr(p, '\n', (size_t)(end - p))) == NULL)
+         eol = end;
+      line_end = eol;
+
+      /* blank lines and comments */
+      while (p < line_end && is_space(*p))
+         p++;
+      if (p == line_end || *p == '#')
+         continue;
+
+      /* the lines under a bad section belong to no one, not to the
+       * global settings, until the next good one */
+      if (*p == '[') {
+         if ((section = open_section(options, p, line_end)) < 0) {
+            fprintf(stderr, "%s:%d: bad section\n", filename, lineno);
+            section = -2;
+         }
+         continue;
+      }
+      if (section == -2)
+         continue;
+
+      if (split_line(p, line_end, &keyword, &arg)) {
+         fprintf(stderr, "%s:%d: no matching quote\n", filename, lineno);
+         continue;
+      }
+
+      if (span_is(keyword, "include")) {
+         include_path(options, filename, arg, depth);
+      } else if (section >= 0) {
+         process_snitch_line(&options->snitches[section], keyword, arg);
+      } else {
+         process_config_line(options, keyword, arg);
+      }
+   }
+
+}
+
+static int parse_file(Options* options, const char* filename, int depth) {
+
+   struct stat st;
+   const char* map;
+   int fd;
+
+   if ((fd = open(filename, O_RDONLY | O_CLOEXEC)) < 0 || fstat(fd, &st) < 0) {
       fprintf(stderr, "%s is missing or unreadable\n", filename);
+      if (fd >= 0)
+         close(fd);
       return 1;
    }
+   if (st.st_size == 0) {
+      close(fd);
+      return 0;
+   }
 
-  while (fgets(line, sizeof(line), f)) {
-    if (strlen(line) == sizeof(line) - 1)
-      fprintf(stderr, "line too long\n");
-    if (process_config_line(options, line) != 0) 
-      fprintf(stderr, "bad configuration\n");
-  }
-  fclose(f);
-  return 0;
+   map = mmap(NULL, (size_t)st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+   close(fd);
+   if (map == MAP_FAILED) {
+      fprintf(stderr, "%s is missing or unreadable\n", filename);
+      return 1;
+   }
+   madvise((void*)map, (size_t)st.st_size, MADV_SEQUENTIAL);
+
+   parse_buffer(options, filename, map, map + st.st_size, depth);
+
+   munmap((void*)map, (size_t)st.st_size);
+   return 0;
 }
 
-static void lowercase(char *s)
-{
-	for (; *s; s++)
-		*s = tolower((u_char)*s);
+static int conf_file_filter(const struct dirent* de) {
+
+   size_t len = strlen(de->d_name);
+
+   return de->d_name[0] != '.' && len > 5 && strcmp(de->d_name + len - 5, ".conf") == 0;
 }
 
-static char* strdelim(char **s)
-{
-	char *old;
-	int wspace = 0;
+static int remember_include(Options* options, const char* path) {
+
+   char** grown;
 
-	if (*s == NULL)
-		return NULL;
+   if ((grown = realloc(options->included, (options->nincluded + 1) * sizeof(*grown))) == NULL)
+      return 1;
+   options->included = grown;
+   if ((options->included[options->nincluded] = strdup(path)) == NULL)
+      return 1;
+   options->nincluded++;
+   return 0;
+}
 
-	old = *s;
+/* Include FILE, or every *.conf in DIRECTORY in name order. Relative
+ * paths are taken from the directory of the including file. */
+static void include_path(Options* options, const char* from, Span arg, int depth) {
 
-	*s = strpbrk(*s, WHITESPACE QUOTE "=");
-	if (*s == NULL)
-		return (old);
+   char path[PATH_MAX];
+   char file[PATH_MAX];
+   struct dirent** names;
+   struct stat st;
+   const char* slash;
+   int n;
+   int i;
 
-	if (*s[0] == '\"') {
-		memmove(*s, *s + 1, strlen(*s)); /* move nul too */
-		/* Find matching quote */
-		if ((*s = strpbrk(*s, QUOTE)) == NULL) {
-			return (NULL);		/* no matching quote */
-		} else {
-			*s[0] = '\0';
-			*s += strspn(*s + 1, WHITESPACE) + 1;
-			return (old);
-		}
-	}
+   if (arg.len == 0) {
+      printf("missing include");
+      return;
+   }
+   if (depth >= MAX_INCLUDE_DEPTH) {
+      fprintf(stderr, "%s: includes nested too deep\n", from);
+      return;
+   }
 
-	/* Allow only one '=' to be skipped */
-	if (*s[0] == '=')
-		wspace = 1;
-	*s[0] = '\0';
+   slash = strrchr(from, '/');
+   if (arg.p[0] != '/' && slash)
+      snprintf(path, sizeof(path), "%.*s/%.*s", (int)(slash - from), from, (int)arg.len, arg.p);
+   else
+      snprintf(path, sizeof(path), "%.*s", (int)arg.len, arg.p);
 
-	/* Skip any extra whitespace after first token */
-	*s += strspn(*s + 1, WHITESPACE) + 1;
-	if (*s[0] == '=' && !wspace)
-		*s += strspn(*s + 1, WHITESPACE) + 1;
+   if (stat(path, &st) < 0) {
+      fprintf(stderr, "%s is missing or unreadable\n", path);
+      return;
+   }
+   remember_include(options, path);
+   if (!S_ISDIR(st.st_mode)) {
+      parse_file(options, path, depth + 1);
+      return;
+   }
 
-	return (old);
+   if ((n = scandir(path, &names, conf_file_filter, alphasort)) < 0) {
+      fprintf(stderr, "%s is missing or unreadable\n", path);
+      return;
+   }
+   for (i = 0; i < n; i++) {
+      if (snprintf(file, sizeof(file), "%s/%s", path, names[i]->d_name) < (int)sizeof(file))
+         parse_file(options, file, depth + 1);
+      free(names[i]);
+   }
+   free(names);
 }
 
-static OPCODE_TYPE parse_token(const char* cp) {
-  if (strcmp(cp, "dmsapikey") == 0) 
+static OPCODE_TYPE parse_token(Span keyword) {
+  if (span_is(keyword, "dmsapikey")) 
     return OPCODE_API_KEY;
-  if (strcmp(cp, "systemname") == 0)
+  if (span_is(keyword, "systemname"))
     return OPCODE_SYSTEM_NAME;
+  if (span_is(keyword, "checkininterval"))
+    return OPCODE_CHECK_IN_INTERVAL;
+  if (span_is(keyword, "cachefile"))
+    return OPCODE_CACHE_FILE;
+  if (span_is(keyword, "cachettl"))
+    return OPCODE_CACHE_TTL;
+  if (span_is(keyword, "apiurl"))
+    return OPCODE_API_URL;
+  if (span_is(keyword, "checkinurl"))
+    return OPCODE_CHECK_IN_URL;
+  if (span_is(keyword, "freshclamlog"))
+    return OPCODE_FRESHCLAM_LOG;
+  if (span_is(keyword, "clamdlog"))
+    return OPCODE_CLAMD_LOG;
+  if (span_is(keyword, "deadline"))
+    return OPCODE_DEADLINE;
+  if (span_is(keyword, "agentsocket"))
+    return OPCODE_AGENT_SOCKET;
+  if (span_is(keyword, "agentwindow"))
+    return OPCODE_AGENT_WINDOW;
+  if (span_is(keyword, "relay"))
+    return OPCODE_RELAY;
+  if (span_is(keyword, "snitchinterval"))
+    return OPCODE_SNITCH_INTERVAL;
+  if (span_is(keyword, "skipfraction"))
+    return OPCODE_SKIP_FRACTION;
+  if (span_is(keyword, "breakerthreshold"))
+    return OPCODE_BREAKER_THRESHOLD;
+  if (span_is(keyword, "breakercooldown"))
+    return OPCODE_BREAKER_COOLDOWN;
+  if (span_is(keyword, "clamdsocket"))
+    return OPCODE_CLAMD_SOCKET;
+  if (span_is(keyword, "clamdlatency"))
+    return OPCODE_CLAMD_LATENCY;
+  if (span_is(keyword, "clamdmaxqueue"))
+    return OPCODE_CLAMD_MAX_QUEUE;
+  if (span_is(keyword, "databasedirectory"))
+    return OPCODE_DATABASE_DIRECTORY;
+  if (span_is(keyword, "maxdatabaseage"))
+    return OPCODE_MAX_DATABASE_AGE;
+  if (span_is(keyword, "scancommand"))
+    return OPCODE_SCAN_COMMAND;
+  if (span_is(keyword, "statusttl"))
+    return OPCODE_STATUS_TTL;
   return OPCODE_BAD;
 }
 
-static int process_config_line(Options* options, char* line) {
+static int process_config_line(Options* options, Span keyword, Span arg) {
 
-  char* keyword;
-  char* arg;
-  char* s;
-  size_t len;
   OPCODE_TYPE opcode;
 
-  s = line;
-
-  /* Strip trailing whitepace */
-  if ((len = strlen(line)) == 0) 
-    return 0;
-
-  if ((keyword = strdelim(&s)) == NULL)
-    return 0;
-
-  /* we match on lowercase */
-  lowercase(keyword);
-
-  opcode = parse_token(keyword); 
+  opcode = parse_token(keyword);
 
   switch (opcode) {
   case OPCODE_API_KEY:
-    arg = strdelim(&s);
-    if (!arg || *arg == '\0')
+    if (arg.len == 0) {
       printf("missing api key");
-    options->api_key = strdup(arg);
+      break;
+    }
+    options->api_key = span_dup(arg);
     break;
   case OPCODE_SYSTEM_NAME:
-    arg = strdelim(&s);
-    if (!arg || *arg == '\0')
+    if (arg.len == 0) {
       printf("missing system name");
-    options->system_name = strdup(arg);
+      break;
+    }
+    options->system_name = span_dup(arg);
+    break;
+  case OPCODE_CHECK_IN_INTERVAL:
+    if (arg.len == 0 || span_long(arg) <= 0) {
+      printf("bad check-in interval");
+      break;
+    }
+    options->check_in_interval = span_long(arg);
+    break;
+  case OPCODE_CACHE_FILE:
+    if (arg.len == 0) {
+      printf("missing cache file");
+      break;
+    }
+    options->cache_file = span_dup(arg);
+    break;
+  case OPCODE_CACHE_TTL:
+    if (arg.len == 0 || span_long(arg) < 0) {
+      printf("bad cache ttl");
+      break;
+    }
+    options->cache_ttl = span_long(arg);
+    break;
+  case OPCODE_API_URL:
+    if (arg.len == 0) {
+      printf("missing api url");
+      break;
+    }
+    options->api_url = span_dup(arg);
+    break;
+  case OPCODE_CHECK_IN_URL:
+    if (arg.len == 0) {
+      printf("missing check-in url");
+      break;
+    }
+    options->check_in_url = span_dup(arg);
+    break;
+  case OPCODE_FRESHCLAM_LOG:
+    if (arg.len == 0) {
+      printf("missing freshclam log");
+      break;
+    }
+    free(options->freshclam_log);
+    options->freshclam_log = span_dup(arg);
+    break;
+  case OPCODE_CLAMD_LOG:
+    if (arg.len == 0) {
+      printf("missing clamd log");
+      break;
+    }
+    free(options->clamd_log);
+    options->clamd_log = span_dup(arg);
+    break;
+  case OPCODE_DEADLINE:
+    /* seconds, fractions allowed */
+    if (arg.len == 0 || span_double(arg) < 0) {
+      printf("bad deadline");
+      break;
+    }
+    options->deadline_ms = (long)(span_double(arg) * 1000);
+    break;
+  case OPCODE_AGENT_SOCKET:
+    if (arg.len == 0) {
+      printf("missing agent socket");
+      break;
+    }
+    options->agent_socket = span_dup(arg);
+    break;
+  case OPCODE_AGENT_WINDOW:
+    /* seconds, fractions allowed */
+    if (arg.len == 0 || span_double(arg) < 0) {
+      printf("bad agent window");
+      break;
+    }
+    options->agent_window_ms = (long)(span_double(arg) * 1000);
+    break;
+  case OPCODE_RELAY:
+    if (arg.len == 0) {
+      printf("missing relay");
+      break;
+    }
+    options->relay = span_dup(arg);
+    break;
+  case OPCODE_SNITCH_INTERVAL:
+    if (arg.len == 0 || span_long(arg) <= 0) {
+      printf("bad snitch interval");
+      break;
+    }
+    options->snitch_interval = span_long(arg);
+    break;
+  case OPCODE_SKIP_FRACTION:
+    if (arg.len == 0 || span_double(arg) < 0 || span_double(arg) >= 1) {
+      printf("bad skip fraction");
+      break;
+    }
+    options->skip_fraction = span_double(arg);
+    break;
+  case OPCODE_BREAKER_THRESHOLD:
+    if (arg.len == 0 || span_long(arg) < 0) {
+      printf("bad breaker threshold");
+      break;
+    }
+    options->breaker_threshold = span_long(arg);
+    break;
+  case OPCODE_BREAKER_COOLDOWN:
+    if (arg.len == 0 || span_long(arg) <= 0) {
+      printf("bad breaker cooldown");
+      break;
+    }
+    options->breaker_cooldown = span_long(arg);
+    break;
+  case OPCODE_CLAMD_SOCKET:
+    if (arg.len == 0) {
+      printf("missing clamd socket");
+      break;
+    }
+    free(options->clamd_socket);
+    options->clamd_socket = span_dup(arg);
+    break;
+  case OPCODE_CLAMD_LATENCY:
+    /* seconds, fractions allowed */
+    if (arg.len == 0 || span_double(arg) <= 0) {
+      printf("bad clamd latency");
+      break;
+    }
+    options->clamd_latency_ms = (long)(span_double(arg) * 1000);
+    break;
+  case OPCODE_CLAMD_MAX_QUEUE:
+    if (arg.len == 0 || span_long(arg) < 0) {
+      printf("bad clamd max queue");
+      break;
+    }
+    options->clamd_max_queue = span_long(arg);
+    break;
+  case OPCODE_DATABASE_DIRECTORY:
+    if (arg.len == 0) {
+      printf("missing database directory");
+      break;
+    }
+    free(options->database_directory);
+    options->database_directory = span_dup(arg);
+    break;
+  case OPCODE_MAX_DATABASE_AGE:
+    if (arg.len == 0 || span_long(arg) <= 0) {
+      printf("bad max database age");
+      break;
+    }
+    options->max_database_age = span_long(arg);
+    break;
+  case OPCODE_SCAN_COMMAND:
+    if (arg.len == 0) {
+      printf("missing scan command");
+      break;
+    }
+    free(options->scan_command);
+    options->scan_command = span_dup(arg);
+    break;
+  case OPCODE_STATUS_TTL:
+    if (arg.len == 0 || span_long(arg) < 0) {
+      printf("bad status ttl");
+      break;
+    }
+    options->status_ttl = span_long(arg);
     break;
   case OPCODE_BAD:
     printf("bad configuration directive");
@@ -29,14 +29,55 @@
 #ifndef READCONF_H
 #define READCONF_H
 
+#include <stddef.h>
+
+/* a [snitch NAME] section */
+typedef struct {
+   char* name;
+   long interval;
+   char* tags;
+   long deadline_ms;
+   size_t order;
+} SnitchConfig;
+
 typedef struct {
    char* api_key;
    char* system_name;
    int verbose;
+   long check_in_interval;
+   char* cache_file;
+   long cache_ttl;
+   char* api_url;
+   char* check_in_url;
+   char* freshclam_log;
+   char* clamd_log;
+   long deadline_ms;
+   char* agent_socket;
+   long agent_window_ms;
+   char* relay;
+   long snitch_interval;
+   double skip_fraction;
+   long breaker_threshold;
+   long breaker_cooldown;
+   char* clamd_socket;
+   long clamd_latency_ms;
+   long clamd_max_queue;
+   char* database_directory;
+   long max_database_age;
+   char* scan_command;
+   long status_ttl;
+   SnitchConfig* snitches;
+   size_t nsnitches;
+   char** included;
+   size_t nincluded;
 } Options;
 
 void  initialize_options(Options* options);
 void  free_options(Options* options);
 int   read_config_file(const char* filename, Options* options);
+const SnitchConfig* find_snitch_config(const Options* options, const char* name);
+const char* snitch_interval_name(long seconds);
+long  snitch_interval_seconds(const char* s);
+int   snitch_tags_valid(const char* s);
 
 #endif /* READCONFIG_H */
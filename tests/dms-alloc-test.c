@@ -0,0 +1,139 @@
+// vim:set et ts=3 sw=3:
+//  _____ _         _____                                 _       
+// |  __ (_)       |  __ \                               | |      
+// | |__) | _ __   | |__) |_ _ _   _ _ __ ___   ___ _ __ | |_ ___ 
+// |  ___/ | '_ \  |  ___/ _` | | | | '_ ` _ \ / _ \ '_ \| __/ __|
+// | |   | | | | | | |  | (_| | |_| | | | | | |  __/ | | | |_\__ \
+// |_|   |_|_| |_| |_|   \__,_|\__, |_| |_| |_|\___|_| |_|\__|___/
+//                              __/ |                             
+//                             |___/                              
+// Copyright (C) 2018 Pin Payments
+// http://pinpayments.com
+// 
+// This software is provided 'as-is', without any express or implied
+// warranty.  In no event will the authors be held liable for any damages
+// arising from the use of this software.
+// 
+// Permission is granted to anyone to use this software for any purpose,
+// including commercial applications, and to alter it and redistribute it
+// freely, subject to the following restrictions:
+// 
+// 1. The origin of this software must not be misrepresented; you must not
+//    claim that you wrote the original software. If you use this software
+//    in a product, an acknowledgment in the product documentation would be
+//    appreciated but is not required.
+// 2. Altered source versions must be plainly marked as such, and must not be
+//    misrepresented as being the original software.
+// 3. This notice may not be removed or altered from any source distribution.
+
+/*
+ * dms-alloc-test - a response of the size DMS sends goes through the
+ * download arena and the token scanner without a single heap
+ * allocation. Both are fed the way libcurl feeds them, a few bytes at
+ * a time, with malloc and friends counting underneath.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <dms-body.h>
+
+/* heap allocations allowed per response on these paths; raise it only
+ * knowingly */
+#define ALLOC_BUDGET 0
+#define CHUNK 7
+
+#define CREATE_RESPONSE \
+  "{\"token\":\"c2354d53d2\",\"href\":\"/v1/snitches/c2354d53d2\"," \
+  "\"name\":\"web-1 daily ClamAV\",\"tags\":[\"production\",\"anti-virus\"]," \
+  "\"notes\":\"{\\\"token\\\":\\\"not-this-one\\\"}\",\"status\":\"pending\"," \
+  "\"checked_in_at\":null,\"type\":{\"interval\":\"daily\",\"alert_type\":\"basic\"}," \
+  "\"check_in_url\":\"https://nosnch.in/c2354d53d2\",\"created_at\":\"2026-01-01T00:00:00.000Z\"," \
+  "\"alert_email\":[]}"
+
+#ifdef __GLIBC__
+/* Interposed over glibc's; glibc's entry points do the work. */
+extern void* __libc_malloc(size_t size);
+extern void* __libc_calloc(size_t nmemb, size_t size);
+extern void* __libc_realloc(void* ptr, size_t size);
+
+static unsigned long allocations = 0;
+
+void* malloc(size_t size) {
+   allocations++;
+   return __libc_malloc(size);
+}
+
+void* calloc(size_t nmemb, size_t size) {
+   allocations++;
+   return __libc_calloc(nmemb, size);
+}
+
+void* realloc(void* ptr, size_t size) {
+   allocations++;
+   return __libc_realloc(ptr, size);
+}
+#endif
+
+typedef size_t (*write_fn)(const void* ptr, size_t size, size_t nmemb, void* user_data);
+
+/* Feeds body to fn in CHUNK sized pieces and returns the allocations
+ * made meanwhile, or -1 if a piece was refused. */
+static long feed(write_fn fn, void* user, const char* body) {
+
+   size_t len = strlen(body);
+   size_t n;
+#ifdef __GLIBC__
+   unsigned long before = allocations;
+#endif
+
+   for (; len > 0; body += n, len -= n) {
+      n = len < CHUNK ? len : CHUNK;
+      if (fn(body, 1, n, user) != n)
+         return -1;
+   }
+#ifdef __GLIBC__
+   return (long)(allocations - before);
+#else
+   return 0;
+#endif
+}
+
+static int check(const char* what, long allocs) {
+
+   if (allocs < 0) {
+      fprintf(stderr, "%s: a chunk was refused\n", what);
+      return 1;
+   }
+   if (allocs > ALLOC_BUDGET) {
+      fprintf(stderr, "%s: %ld allocations, over the budget of %d\n", what, allocs, ALLOC_BUDGET);
+      return 1;
+   }
+   return 0;
+}
+
+int main(void) {
+
+   DownloadBuffer db;
+   TokenStream ts;
+   char token[64];
+   int rv = 0;
+
+   dms_token_stream_init(&ts, NULL, token, sizeof(token));
+   rv |= check("token scanner", feed(dms_token_stream_cb, &ts, CREATE_RESPONSE));
+   if (!ts.found || strcmp(token, "c2354d53d2") != 0) {
+      fprintf(stderr, "token scanner: found %s\n", ts.found ? token : "nothing");
+      rv = 1;
+   }
+
+   dms_body_init(&db, NULL);
+   rv |= check("download arena", feed(dms_body_download_cb, &db, CREATE_RESPONSE));
+   if (db.buf != db.arena || strcmp(db.buf, CREATE_RESPONSE) != 0) {
+      fprintf(stderr, "download arena: body not kept in the arena\n");
+      rv = 1;
+   }
+   dms_body_free(&db);
+
+   return rv;
+}
@@ -0,0 +1,99 @@
+// vim:set et ts=3 sw=3:
+//  _____ _         _____                                 _       
+// |  __ (_)       |  __ \                               | |      
+// | |__) | _ __   | |__) |_ _ _   _ _ __ ___   ___ _ __ | |_ ___ 
+// |  ___/ | '_ \  |  ___/ _` | | | | '_ ` _ \ / _ \ '_ \| __/ __|
+// | |   | | | | | | |  | (_| | |_| | | | | | |  __/ | | | |_\__ \
+// |_|   |_|_| |_| |_|   \__,_|\__, |_| |_| |_|\___|_| |_|\__|___/
+//                              __/ |                             
+//                             |___/                              
+// Copyright (C) 2018 Pin Payments
+// http://pinpayments.com
+// 
+// This software is provided 'as-is', without any express or implied
+// warranty.  In no event will the authors be held liable for any damages
+// arising from the use of this software.
+// 
+// Permission is granted to anyone to use this software for any purpose,
+// including commercial applications, and to alter it and redistribute it
+// freely, subject to the following restrictions:
+// 
+// 1. The origin of this software must not be misrepresented; you must not
+//    claim that you wrote the original software. If you use this software
+//    in a product, an acknowledgment in the product documentation would be
+//    appreciated but is not required.
+// 2. Altered source versions must be plainly marked as such, and must not be
+//    misrepresented as being the original software.
+// 3. This notice may not be removed or altered from any source distribution.
+
+/*
+ * dms-sched-test - the daemon schedules the snitches of this system from
+ * the token store and leaves out the ones -B provisioned for others.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include <dms-sched.h>
+#include <dms-tokens.h>
+#include <readconf.h>
+
+#define MAX_PATH 256
+
+int main(void) {
+
+   char dir[] = "/tmp/dms-sched-test.XXXXXX";
+   char store_file[MAX_PATH];
+   char lock_file[MAX_PATH];
+   TokenChange changes[4];
+   TokenStore store;
+   SnitchTable table;
+   Options options;
+   int rv = 1;
+
+   if (mkdtemp(dir) == NULL) {
+      fprintf(stderr, "cannot create a temporary directory\n");
+      return 1;
+   }
+   snprintf(store_file, sizeof(store_file), "%s/tokens", dir);
+   snprintf(lock_file, sizeof(lock_file), "%s/tokens.lock", dir);
+
+   changes[0].name = "clamav";
+   changes[0].token = "own-token";
+   changes[1].name = TOKEN_BULK_PREFIX "web-1";
+   changes[1].token = "web-1-token";
+   changes[2].name = TOKEN_BULK_PREFIX "web-2";
+   changes[2].token = "web-2-token";
+   changes[3].name = TOKEN_BULK_PREFIX "db-1";
+   changes[3].token = "db-1-token";
+
+   initialize_options(&options);
+   options.check_in_interval = 3600;
+   memset(&table, 0, sizeof(table));
+
+   if (dms_tokens_update(store_file, changes, 4) || dms_tokens_open(store_file, &store)) {
+      fprintf(stderr, "cannot write the token store\n");
+      goto out;
+   }
+   if (dms_tokens_lookup(&store, TOKEN_BULK_PREFIX "web-1") == NULL) {
+      fprintf(stderr, "bulk entry missing from the store\n");
+   } else if (dms_sched_add_store(&table, &store, &options)) {
+      fprintf(stderr, "cannot build the schedule\n");
+   } else if (table.count != 1 || strcmp(table.strings + table.name[0], "clamav") != 0
+              || table.interval[0] != 3600) {
+      fprintf(stderr, "scheduled %u snitches, expected only clamav\n", table.count);
+   } else {
+      rv = 0;
+   }
+   dms_tokens_close(&store);
+
+out:
+   dms_sched_free(&table);
+   free_options(&options);
+   unlink(store_file);
+   unlink(lock_file);
+   rmdir(dir);
+   return rv;
+}